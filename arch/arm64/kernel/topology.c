@@ -488,6 +488,66 @@ void __init arch_get_fast_and_slow_cpus(struct cpumask *fast,
 struct cpumask hmp_slow_cpu_mask;
 struct cpumask hmp_fast_cpu_mask;
 
+#define HMP_ENERGY_CELLS	4
+
+/*
+ * Read the energy model of the cluster made of 'cpus' from the node that
+ * the "sched-energy-model" phandle of its first cpu points to. That node
+ * has an "energy-model" table of <frequency capacity busy-power idle-power>
+ * rows, by ascending frequency; see struct hmp_energy_state.
+ */
+static struct hmp_energy_model * __init
+arch_get_hmp_energy_model(const struct cpumask *cpus)
+{
+	struct device_node *cn, *model;
+	struct hmp_energy_model *em = NULL;
+	struct hmp_energy_state *state;
+	const __be32 *cell;
+	int len, nr, i;
+
+	cn = of_get_cpu_node(cpumask_first(cpus), NULL);
+	if (!cn)
+		return NULL;
+	model = of_parse_phandle(cn, "sched-energy-model", 0);
+	of_node_put(cn);
+	if (!model)
+		return NULL;
+
+	cell = of_get_property(model, "energy-model", &len);
+	nr = len / (HMP_ENERGY_CELLS * sizeof(u32));
+	if (!cell || !nr || len % (HMP_ENERGY_CELLS * sizeof(u32))) {
+		pr_err("%s: invalid energy-model property\n", model->full_name);
+		goto out;
+	}
+
+	em = kzalloc(sizeof(*em) + nr * sizeof(*state), GFP_KERNEL);
+	if (!em)
+		goto out;
+	em->states = (struct hmp_energy_state *)(em + 1);
+
+	for (i = 0; i < nr; i++) {
+		state = &em->states[i];
+		state->freq = be32_to_cpup(cell++);
+		state->capacity = be32_to_cpup(cell++);
+		state->busy_power = be32_to_cpup(cell++);
+		state->idle_power = be32_to_cpup(cell++);
+
+		if (!state->capacity || (i && (state->freq <= state[-1].freq ||
+				state->capacity < state[-1].capacity))) {
+			pr_err("%s: energy-model row %d out of order\n",
+				model->full_name, i);
+			kfree(em);
+			em = NULL;
+			goto out;
+		}
+	}
+	em->nr_states = nr;
+
+out:
+	of_node_put(model);
+	return em;
+}
+
 void __init arch_get_hmp_domains(struct list_head *hmp_domains_list)
 {
 	struct hmp_domain *domain;
@@ -504,12 +564,14 @@ void __init arch_get_hmp_domains(struct list_head *hmp_domains_list)
 			kmalloc(sizeof(struct hmp_domain), GFP_KERNEL);
 		cpumask_copy(&domain->possible_cpus, &hmp_slow_cpu_mask);
 		cpumask_and(&domain->cpus, cpu_online_mask, &domain->possible_cpus);
+		domain->energy = arch_get_hmp_energy_model(&domain->possible_cpus);
 		list_add(&domain->hmp_domains, hmp_domains_list);
 	}
 	domain = (struct hmp_domain *)
 		kmalloc(sizeof(struct hmp_domain), GFP_KERNEL);
 	cpumask_copy(&domain->possible_cpus, &hmp_fast_cpu_mask);
 	cpumask_and(&domain->cpus, cpu_online_mask, &domain->possible_cpus);
+	domain->energy = arch_get_hmp_energy_model(&domain->possible_cpus);
 	list_add(&domain->hmp_domains, hmp_domains_list);
 }
 #endif /* CONFIG_SCHED_HMP */
@@ -0,0 +1,525 @@
+/*
+ * drivers/cpufreq/cpufreq_sched.c
+ *
+ * cpufreq governor driven by the scheduler's per-rq load tracking.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Instead of sampling idle time on a timer, the fair class reports the
+ * utilization of each cpu (0..1024) at enqueue, dequeue and tick through
+ * cpufreq_sched_set_util(). With frequency-invariant load tracking that
+ * is the share of the policy's maximum capacity in use, so the frequency
+ * for a policy is its busiest cpu's utilization scaled to policy->max,
+ * with target_load headroom. A cpu that has not reported for longer than
+ * a tick is idle and does not count: its last utilization is stale.
+ *
+ * The scheduler calls in with its rq lock held, so a new request is
+ * handed to a per-policy RT kthread through irq_work. Raising the
+ * frequency is rate limited by up_rate_limit_us and lowering it by
+ * down_rate_limit_us; a request that arrives too early is dropped and
+ * re-evaluated on the next update.
+ */
+
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/cpufreq.h>
+#include <linux/ipa.h>
+#include <linux/irq_work.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sched/rt.h>
+#include <linux/slab.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/cpufreq_sched.h>
+
+/* Utilization to run at, in percent.  Lower values result in higher speeds. */
+#define DEFAULT_TARGET_LOAD 80
+#define DEFAULT_UP_RATE_LIMIT (500)
+#define DEFAULT_DOWN_RATE_LIMIT (20 * USEC_PER_MSEC)
+
+struct cpufreq_sched_tunables {
+	int usage_count;
+	unsigned int target_load;
+	/* Minimum time between two increases of the frequency (usecs) */
+	unsigned long up_rate_limit;
+	/* Minimum time between two decreases of the frequency (usecs) */
+	unsigned long down_rate_limit;
+};
+
+struct cpufreq_sched_policy {
+	struct cpufreq_policy *policy;
+	struct cpufreq_sched_tunables *tunables;
+	struct cpufreq_frequency_table *freq_table;
+	struct task_struct *task;
+	struct irq_work irq_work;
+	struct mutex target_lock; /* serializes calls into the driver */
+	raw_spinlock_t lock; /* protects the next 3 fields */
+	unsigned int requested_freq;
+	u64 last_request;
+	bool request_pending;
+};
+
+struct cpufreq_sched_cpuinfo {
+	unsigned long util;
+	u64 last_update;
+	struct cpufreq_sched_policy *sp;
+};
+
+static DEFINE_PER_CPU(struct cpufreq_sched_cpuinfo, cpuinfo);
+static DEFINE_MUTEX(gov_lock);
+
+/* For cases where we have single governor instance for system */
+static struct cpufreq_sched_tunables *common_tunables;
+
+static unsigned int cpufreq_sched_choose_freq(struct cpufreq_sched_policy *sp,
+		unsigned long util, bool invariant)
+{
+	struct cpufreq_policy *policy = sp->policy;
+	struct cpufreq_frequency_table *table = sp->freq_table;
+	unsigned int best = policy->max;
+	u64 freq;
+	int i;
+
+	freq = (u64)util * (invariant ? policy->max : policy->cur) * 100;
+	do_div(freq, 1024 * sp->tunables->target_load);
+	freq = clamp_t(u64, freq, policy->min, policy->max);
+	if (!table)
+		return freq;
+
+	/*
+	 * Lowest table frequency at or above freq, as CPUFREQ_RELATION_L;
+	 * open-coded as cpufreq_frequency_table_target() may print.
+	 */
+	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		unsigned int f = table[i].frequency;
+
+		if (f == CPUFREQ_ENTRY_INVALID || f < freq || f > policy->max)
+			continue;
+		if (f < best)
+			best = f;
+	}
+	return best;
+}
+
+/*
+ * cpufreq_sched_set_util - report the utilization of a cpu
+ * @cpu: the cpu, whose rq lock the caller holds
+ * @util: its utilization, 0..1024
+ * @invariant: util is relative to the maximum capacity rather than to the
+ *	capacity at the current frequency
+ */
+void cpufreq_sched_set_util(int cpu, unsigned long util, bool invariant)
+{
+	struct cpufreq_sched_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	struct cpufreq_sched_policy *sp;
+	unsigned long max_util = 0, rate_limit;
+	unsigned int freq;
+	u64 now = local_clock();
+	int j;
+
+	pcpu->util = util;
+	pcpu->last_update = now;
+	sp = rcu_dereference_sched(pcpu->sp);
+	if (!sp)
+		return;
+
+	for_each_cpu(j, sp->policy->cpus) {
+		struct cpufreq_sched_cpuinfo *jcpu = &per_cpu(cpuinfo, j);
+
+		if ((s64)(now - ACCESS_ONCE(jcpu->last_update)) > TICK_NSEC)
+			continue;
+		max_util = max(max_util, ACCESS_ONCE(jcpu->util));
+	}
+	freq = cpufreq_sched_choose_freq(sp, max_util, invariant);
+
+	raw_spin_lock(&sp->lock);
+	if (freq == sp->requested_freq)
+		goto out;
+
+	if (freq > sp->requested_freq)
+		rate_limit = sp->tunables->up_rate_limit;
+	else
+		rate_limit = sp->tunables->down_rate_limit;
+	if ((s64)(now - sp->last_request) < (s64)rate_limit * NSEC_PER_USEC)
+		goto out;
+
+	sp->requested_freq = freq;
+	sp->last_request = now;
+	trace_cpufreq_sched_request(cpu, max_util, freq);
+
+	if (!sp->request_pending) {
+		sp->request_pending = true;
+		irq_work_queue(&sp->irq_work);
+	}
+out:
+	raw_spin_unlock(&sp->lock);
+}
+
+static void cpufreq_sched_irq_work(struct irq_work *irq_work)
+{
+	struct cpufreq_sched_policy *sp =
+		container_of(irq_work, struct cpufreq_sched_policy, irq_work);
+
+	wake_up_process(sp->task);
+}
+
+static int cpufreq_sched_thread(void *data)
+{
+	struct cpufreq_sched_policy *sp = data;
+	unsigned long flags;
+	unsigned int freq;
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		raw_spin_lock_irqsave(&sp->lock, flags);
+		if (!sp->request_pending) {
+			raw_spin_unlock_irqrestore(&sp->lock, flags);
+
+			if (kthread_should_stop())
+				break;
+
+			schedule();
+
+			if (kthread_should_stop())
+				break;
+
+			raw_spin_lock_irqsave(&sp->lock, flags);
+		}
+
+		set_current_state(TASK_RUNNING);
+		freq = sp->requested_freq;
+		sp->request_pending = false;
+		raw_spin_unlock_irqrestore(&sp->lock, flags);
+
+		mutex_lock(&sp->target_lock);
+		if (freq != sp->policy->cur)
+			__cpufreq_driver_target(sp->policy, freq,
+						CPUFREQ_RELATION_L);
+
+#if defined(CONFIG_CPU_THERMAL_IPA)
+		ipa_cpufreq_requested(sp->policy, freq);
+#endif
+
+		trace_cpufreq_sched_setspeed(sp->policy->cpu, freq,
+					     sp->policy->cur);
+		mutex_unlock(&sp->target_lock);
+	}
+
+	return 0;
+}
+
+static ssize_t show_target_load(struct cpufreq_sched_tunables *tunables,
+		char *buf)
+{
+	return sprintf(buf, "%u\n", tunables->target_load);
+}
+
+static ssize_t store_target_load(struct cpufreq_sched_tunables *tunables,
+		const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	if (!val || val > 100)
+		return -EINVAL;
+	tunables->target_load = val;
+	return count;
+}
+
+static ssize_t show_up_rate_limit_us(struct cpufreq_sched_tunables *tunables,
+		char *buf)
+{
+	return sprintf(buf, "%lu\n", tunables->up_rate_limit);
+}
+
+static ssize_t store_up_rate_limit_us(struct cpufreq_sched_tunables *tunables,
+		const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	tunables->up_rate_limit = val;
+	return count;
+}
+
+static ssize_t show_down_rate_limit_us(struct cpufreq_sched_tunables
+		*tunables, char *buf)
+{
+	return sprintf(buf, "%lu\n", tunables->down_rate_limit);
+}
+
+static ssize_t store_down_rate_limit_us(struct cpufreq_sched_tunables
+		*tunables, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	tunables->down_rate_limit = val;
+	return count;
+}
+
+/*
+ * Create show/store routines
+ * - sys: One governor instance for complete SYSTEM
+ * - pol: One governor instance per struct cpufreq_policy
+ */
+#define show_store_gov_pol_sys(file_name)				\
+static ssize_t show_##file_name##_gov_sys				\
+(struct kobject *kobj, struct attribute *attr, char *buf)		\
+{									\
+	return show_##file_name(common_tunables, buf);			\
+}									\
+									\
+static ssize_t show_##file_name##_gov_pol				\
+(struct cpufreq_policy *policy, char *buf)				\
+{									\
+	return show_##file_name(policy->governor_data, buf);		\
+}									\
+									\
+static ssize_t store_##file_name##_gov_sys				\
+(struct kobject *kobj, struct attribute *attr, const char *buf,		\
+	size_t count)							\
+{									\
+	return store_##file_name(common_tunables, buf, count);		\
+}									\
+									\
+static ssize_t store_##file_name##_gov_pol				\
+(struct cpufreq_policy *policy, const char *buf, size_t count)		\
+{									\
+	return store_##file_name(policy->governor_data, buf, count);	\
+}									\
+									\
+static struct global_attr file_name##_gov_sys =				\
+__ATTR(file_name, 0644, show_##file_name##_gov_sys,			\
+	store_##file_name##_gov_sys);					\
+									\
+static struct freq_attr file_name##_gov_pol =				\
+__ATTR(file_name, 0644, show_##file_name##_gov_pol,			\
+	store_##file_name##_gov_pol)
+
+show_store_gov_pol_sys(target_load);
+show_store_gov_pol_sys(up_rate_limit_us);
+show_store_gov_pol_sys(down_rate_limit_us);
+
+/* One Governor instance for entire system */
+static struct attribute *sched_attributes_gov_sys[] = {
+	&target_load_gov_sys.attr,
+	&up_rate_limit_us_gov_sys.attr,
+	&down_rate_limit_us_gov_sys.attr,
+	NULL,
+};
+
+static struct attribute_group sched_attr_group_gov_sys = {
+	.attrs = sched_attributes_gov_sys,
+	.name = "sched",
+};
+
+/* Per policy governor instance */
+static struct attribute *sched_attributes_gov_pol[] = {
+	&target_load_gov_pol.attr,
+	&up_rate_limit_us_gov_pol.attr,
+	&down_rate_limit_us_gov_pol.attr,
+	NULL,
+};
+
+static struct attribute_group sched_attr_group_gov_pol = {
+	.attrs = sched_attributes_gov_pol,
+	.name = "sched",
+};
+
+static struct attribute_group *get_sysfs_attr(void)
+{
+	if (have_governor_per_policy())
+		return &sched_attr_group_gov_pol;
+	else
+		return &sched_attr_group_gov_sys;
+}
+
+static int cpufreq_sched_start(struct cpufreq_policy *policy,
+		struct cpufreq_sched_tunables *tunables)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO-1 };
+	struct cpufreq_sched_policy *sp;
+	unsigned int j;
+
+	sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+	if (!sp)
+		return -ENOMEM;
+
+	sp->policy = policy;
+	sp->tunables = tunables;
+	sp->freq_table = cpufreq_frequency_get_table(policy->cpu);
+	sp->requested_freq = policy->cur;
+	mutex_init(&sp->target_lock);
+	raw_spin_lock_init(&sp->lock);
+	init_irq_work(&sp->irq_work, cpufreq_sched_irq_work);
+
+	sp->task = kthread_create(cpufreq_sched_thread, sp, "cfsched%d",
+				  policy->cpu);
+	if (IS_ERR(sp->task)) {
+		int rc = PTR_ERR(sp->task);
+
+		kfree(sp);
+		return rc;
+	}
+
+	sched_setscheduler_nocheck(sp->task, SCHED_FIFO, &param);
+	get_task_struct(sp->task);
+
+	/* NB: wake up so the thread does not look hung to the freezer */
+	wake_up_process(sp->task);
+
+	for_each_cpu(j, policy->related_cpus)
+		rcu_assign_pointer(per_cpu(cpuinfo, j).sp, sp);
+	return 0;
+}
+
+static void cpufreq_sched_stop(struct cpufreq_policy *policy)
+{
+	struct cpufreq_sched_policy *sp = per_cpu(cpuinfo, policy->cpu).sp;
+	unsigned int j;
+
+	if (!sp)
+		return;
+
+	for_each_cpu(j, policy->related_cpus)
+		rcu_assign_pointer(per_cpu(cpuinfo, j).sp, NULL);
+
+	/* the scheduler reports with preemption disabled */
+	synchronize_sched();
+	irq_work_sync(&sp->irq_work);
+
+	kthread_stop(sp->task);
+	put_task_struct(sp->task);
+	kfree(sp);
+}
+
+static int cpufreq_governor_sched(struct cpufreq_policy *policy,
+		unsigned int event)
+{
+	struct cpufreq_sched_tunables *tunables;
+	struct cpufreq_sched_policy *sp;
+	int rc = 0;
+
+	if (have_governor_per_policy())
+		tunables = policy->governor_data;
+	else
+		tunables = common_tunables;
+
+	WARN_ON(!tunables && (event != CPUFREQ_GOV_POLICY_INIT));
+
+	switch (event) {
+	case CPUFREQ_GOV_POLICY_INIT:
+		if (have_governor_per_policy()) {
+			WARN_ON(tunables);
+		} else if (tunables) {
+			tunables->usage_count++;
+			policy->governor_data = tunables;
+			return 0;
+		}
+
+		tunables = kzalloc(sizeof(*tunables), GFP_KERNEL);
+		if (!tunables) {
+			pr_err("%s: POLICY_INIT: kzalloc failed\n", __func__);
+			return -ENOMEM;
+		}
+
+		tunables->usage_count = 1;
+		tunables->target_load = DEFAULT_TARGET_LOAD;
+		tunables->up_rate_limit = DEFAULT_UP_RATE_LIMIT;
+		tunables->down_rate_limit = DEFAULT_DOWN_RATE_LIMIT;
+
+		policy->governor_data = tunables;
+		if (!have_governor_per_policy())
+			common_tunables = tunables;
+
+		rc = sysfs_create_group(get_governor_parent_kobj(policy),
+				get_sysfs_attr());
+		if (rc) {
+			kfree(tunables);
+			policy->governor_data = NULL;
+			if (!have_governor_per_policy())
+				common_tunables = NULL;
+		}
+		break;
+
+	case CPUFREQ_GOV_POLICY_EXIT:
+		if (!--tunables->usage_count) {
+			sysfs_remove_group(get_governor_parent_kobj(policy),
+					get_sysfs_attr());
+			kfree(tunables);
+			common_tunables = NULL;
+		}
+
+		policy->governor_data = NULL;
+		break;
+
+	case CPUFREQ_GOV_START:
+		mutex_lock(&gov_lock);
+		rc = cpufreq_sched_start(policy, tunables);
+		mutex_unlock(&gov_lock);
+		break;
+
+	case CPUFREQ_GOV_STOP:
+		mutex_lock(&gov_lock);
+		cpufreq_sched_stop(policy);
+		mutex_unlock(&gov_lock);
+		break;
+
+	case CPUFREQ_GOV_LIMITS:
+		sp = per_cpu(cpuinfo, policy->cpu).sp;
+		if (!sp)
+			break;
+
+		mutex_lock(&sp->target_lock);
+		if (policy->max < policy->cur)
+			__cpufreq_driver_target(policy,
+					policy->max, CPUFREQ_RELATION_H);
+		else if (policy->min > policy->cur)
+			__cpufreq_driver_target(policy,
+					policy->min, CPUFREQ_RELATION_L);
+		mutex_unlock(&sp->target_lock);
+		break;
+	}
+	return rc;
+}
+
+#ifndef CONFIG_CPU_FREQ_DEFAULT_GOV_SCHED
+static
+#endif
+struct cpufreq_governor cpufreq_gov_sched = {
+	.name = "sched",
+	.governor = cpufreq_governor_sched,
+	.max_transition_latency = 10000000,
+	.owner = THIS_MODULE,
+};
+
+static int __init cpufreq_sched_init(void)
+{
+	return cpufreq_register_governor(&cpufreq_gov_sched);
+}
+
+#ifdef CONFIG_CPU_FREQ_DEFAULT_GOV_SCHED
+fs_initcall(cpufreq_sched_init);
+#else
+module_init(cpufreq_sched_init);
+#endif
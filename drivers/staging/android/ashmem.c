@@ -31,6 +31,8 @@
 #include <linux/bitops.h>
 #include <linux/mutex.h>
 #include <linux/shmem_fs.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include "ashmem.h"
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
@@ -40,7 +42,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `lock'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -49,12 +51,19 @@ struct ashmem_area {
 	struct file *file;		 /* the shmem-based backing file */
 	size_t size;			 /* size of the mapping, in bytes */
 	unsigned long prot_mask;	 /* allowed prot bits, as vm_flags */
+	struct mutex lock;		 /* protects all of the above */
+	atomic_t purging;		 /* purges in flight, see ashmem_shrink */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `lock'; the shrinker also changes
+ * `pgpurged' and `purged' under `ashmem_lru_lock', so those, and any
+ * change of the range while it is on the LRU, need that lock as well.
+ *
+ * Pages are purged in page order, `pgpurged' being the first page that
+ * has not been. A range stays on the LRU until all its pages are purged.
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,21 +71,27 @@ struct ashmem_range {
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
+	size_t pgpurged;		/* first page not purged yet */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list not purged yet, ditto */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU and the purge state of each range
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->lock -> ashmem_lru_lock. The shrinker only takes
+ * ashmem_lru_lock and drops it before it purges, so reclaim never waits
+ * for an area, nor ioctls on one area for those on another.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* woken when the purges in flight on an area drop to zero */
+static DECLARE_WAIT_QUEUE_HEAD(ashmem_purge_wait);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -84,8 +99,11 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 #define range_size(range) \
 	((range)->pgend - (range)->pgstart + 1)
 
+#define range_lru_size(range) \
+	((range)->pgend + 1 - (range)->pgpurged)
+
 #define range_on_lru(range) \
-	((range)->purged == ASHMEM_NOT_PURGED)
+	((range)->pgpurged <= (range)->pgend)
 
 #define page_range_subsumes_range(range, start, end) \
 	(((range)->pgstart >= (start)) && ((range)->pgend <= (end)))
@@ -108,49 +126,51 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 static inline void lru_add(struct ashmem_range *range)
 {
 	list_add_tail(&range->lru, &ashmem_lru_list);
-	lru_count += range_size(range);
+	lru_count += range_lru_size(range);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
-	lru_count -= range_size(range);
+	lru_count -= range_lru_size(range);
 }
 
 /*
- * range_alloc - allocate and initialize a new ashmem_range structure
+ * range_alloc - initialize the new ashmem_range structure 'range'
  *
  * 'asma' - associated ashmem_area
  * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
+ * 'pgpurged' - first page that is not purged yet
  *
- * Caller must hold ashmem_mutex.
+ * 'range' is allocated by the caller before it takes ashmem_lru_lock.
+ *
+ * Caller must hold asma->lock and ashmem_lru_lock.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
-		       size_t start, size_t end)
+static void range_alloc(struct ashmem_area *asma,
+			struct ashmem_range *prev_range,
+			struct ashmem_range *range, unsigned int purged,
+			size_t start, size_t end, size_t pgpurged)
 {
-	struct ashmem_range *range;
-
-	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
-	if (unlikely(!range))
-		return -ENOMEM;
-
 	range->asma = asma;
 	range->pgstart = start;
 	range->pgend = end;
+	range->pgpurged = pgpurged;
 	range->purged = purged;
 
 	list_add_tail(&range->unpinned, &prev_range->unpinned);
 
 	if (range_on_lru(range))
 		lru_add(range);
-
-	return 0;
 }
 
+/*
+ * range_del - removes and frees a range
+ *
+ * Caller must hold asma->lock and ashmem_lru_lock.
+ */
 static void range_del(struct ashmem_range *range)
 {
 	list_del(&range->unpinned);
@@ -162,18 +182,26 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock and ashmem_lru_lock.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
 {
-	size_t pre = range_size(range);
+	if (range_on_lru(range))
+		lru_del(range);
 
 	range->pgstart = start;
 	range->pgend = end;
+	range->pgpurged = clamp(range->pgpurged, start, end + 1);
 
 	if (range_on_lru(range))
-		lru_count -= pre - range_size(range);
+		lru_add(range);
+}
+
+/* ashmem_wait_purges - waits for the shrinker to finish purging 'asma' */
+static void ashmem_wait_purges(struct ashmem_area *asma)
+{
+	wait_event(ashmem_purge_wait, !atomic_read(&asma->purging));
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -190,6 +218,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->lock);
+	atomic_set(&asma->purging, 0);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -202,10 +232,13 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	spin_lock(&ashmem_lru_lock);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
+
+	/* the shrinker may still be punching holes in asma->file */
+	ashmem_wait_purges(asma);
 
 	if (asma->file)
 		fput(asma->file);
@@ -220,7 +253,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0)
@@ -231,7 +264,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 		goto out_unlock;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 
 	/*
 	 * asma and asma->file are used outside the lock here.  We assume
@@ -247,7 +280,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	return ret;
 
 out_unlock:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
@@ -256,7 +289,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -276,7 +309,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
@@ -292,7 +325,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -334,7 +367,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	}
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
@@ -355,7 +388,9 @@ out:
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	size_t start, nr;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
@@ -363,24 +398,46 @@ static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	if (!sc->nr_to_scan)
 		return lru_count;
 
-	if (!mutex_trylock(&ashmem_mutex))
-		return -1;
+	spin_lock(&ashmem_lru_lock);
+	while (sc->nr_to_scan && !list_empty(&ashmem_lru_list)) {
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		asma = range->asma;
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE;
+		/*
+		 * Take the range's lowest pages that are left, but no more
+		 * than we were asked for: the rest stays at the head of the
+		 * LRU for the next call.
+		 */
+		start = range->pgpurged;
+		nr = min_t(size_t, range_lru_size(range), sc->nr_to_scan);
+		lru_del(range);
+		range->pgpurged += nr;
+		range->purged = ASHMEM_WAS_PURGED;
+		if (range_on_lru(range)) {
+			list_add(&range->lru, &ashmem_lru_list);
+			lru_count += range_lru_size(range);
+		}
 
-		do_fallocate(range->asma->file,
+		/*
+		 * Pinning waits for us before it returns, and release before
+		 * it drops asma->file, so neither the pages nor the file can
+		 * go away under us; the range itself we do not touch again.
+		 */
+		atomic_inc(&asma->purging);
+		spin_unlock(&ashmem_lru_lock);
+
+		do_fallocate(asma->file,
 				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-				start, end - start);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+				start * PAGE_SIZE, nr * PAGE_SIZE);
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+		if (atomic_dec_and_test(&asma->purging))
+			wake_up_all(&ashmem_purge_wait);
+
+		sc->nr_to_scan -= nr;
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -394,7 +451,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -409,7 +466,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
@@ -420,10 +477,10 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	char local_name[ASHMEM_NAME_LEN];
 
 	/*
-	 * Holding the ashmem_mutex while doing a copy_from_user might cause
+	 * Holding asma->lock while doing a copy_from_user might cause
 	 * an data abort which would try to access mmap_sem. If another
 	 * thread has invoked ashmem_mmap then it will be holding the
-	 * semaphore and will be waiting for ashmem_mutex, there by leading to
+	 * semaphore and will be waiting for asma->lock, there by leading to
 	 * deadlock. We'll release the mutex  and take the name to a local
 	 * variable that does not need protection and later copy the local
 	 * variable to the structure member with lock held.
@@ -433,14 +490,14 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 		return len;
 	if (len == ASHMEM_NAME_LEN)
 		local_name[ASHMEM_NAME_LEN - 1] = '\0';
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file))
 		ret = -EINVAL;
 	else
 		strcpy(asma->name + ASHMEM_NAME_PREFIX_LEN, local_name);
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
@@ -456,7 +513,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 	 */
 	char local_name[ASHMEM_NAME_LEN];
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 
 		/*
@@ -469,7 +526,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 		len = sizeof(ASHMEM_NAME_DEF);
 		memcpy(local_name, ASHMEM_NAME_DEF, len);
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 
 	/*
 	 * Now we are just copying from the stack variable to userland
@@ -484,7 +541,8 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock, and wait for the purges in flight before
+ * it lets userspace touch the pages.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -512,23 +570,43 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    create a new range for the other side.
 		 */
 		if (page_range_in_range(range, pgstart, pgend)) {
+			struct ashmem_range *split = NULL;
+
+			/* Case #4 needs a new range, allocate it up front */
+			if (range->pgstart < pgstart && range->pgend > pgend) {
+				split = kmem_cache_zalloc(ashmem_range_cachep,
+							  GFP_KERNEL);
+				if (unlikely(!split))
+					return -ENOMEM;
+			}
+
+			/*
+			 * The shrinker takes only ashmem_lru_lock, so hold it
+			 * while we read the purge state and take the pages off
+			 * the LRU; pages it has already started to purge are
+			 * reported as such and waited for by our caller.
+			 */
+			spin_lock(&ashmem_lru_lock);
 			ret |= range->purged;
 
 			/* Case #1: Easy. Just nuke the whole thing. */
 			if (page_range_subsumes_range(range, pgstart, pgend)) {
 				range_del(range);
+				spin_unlock(&ashmem_lru_lock);
 				continue;
 			}
 
 			/* Case #2: We overlap from the start, so adjust it */
 			if (range->pgstart >= pgstart) {
 				range_shrink(range, pgend + 1, range->pgend);
+				spin_unlock(&ashmem_lru_lock);
 				continue;
 			}
 
 			/* Case #3: We overlap from the rear, so adjust it */
 			if (range->pgend <= pgend) {
 				range_shrink(range, range->pgstart, pgstart-1);
+				spin_unlock(&ashmem_lru_lock);
 				continue;
 			}
 
@@ -537,9 +615,12 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+			range_alloc(asma, range, split, range->purged,
+				    pgend + 1, range->pgend,
+				    clamp(range->pgpurged, pgend + 1,
+					  range->pgend + 1));
 			range_shrink(range, range->pgstart, pgstart - 1);
+			spin_unlock(&ashmem_lru_lock);
 			break;
 		}
 	}
@@ -550,11 +631,11 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range, *next, *new_range;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
 restart:
@@ -572,20 +653,31 @@ restart:
 		if (page_range_in_range(range, pgstart, pgend)) {
 			pgstart = min_t(size_t, range->pgstart, pgstart),
 			pgend = max_t(size_t, range->pgend, pgend);
+			spin_lock(&ashmem_lru_lock);
 			purged |= range->purged;
 			range_del(range);
+			spin_unlock(&ashmem_lru_lock);
 			goto restart;
 		}
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	new_range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
+	if (unlikely(!new_range))
+		return -ENOMEM;
+
+	/* the merged range may still hold pages; purge all of it again */
+	spin_lock(&ashmem_lru_lock);
+	range_alloc(asma, range, new_range, purged, pgstart, pgend, pgstart);
+	spin_unlock(&ashmem_lru_lock);
+
+	return 0;
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -634,11 +726,12 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
 		ret = ashmem_pin(asma, pgstart, pgend);
+		ashmem_wait_purges(asma);
 		break;
 	case ASHMEM_UNPIN:
 		ret = ashmem_unpin(asma, pgstart, pgend);
@@ -648,7 +741,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 
 	return ret;
 }
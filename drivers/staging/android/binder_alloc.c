@@ -0,0 +1,1115 @@
+/* binder_alloc.c
+ *
+ * Android IPC Subsystem
+ *
+ * Copyright (C) 2007-2017 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <asm/cacheflush.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/module.h>
+#include <linux/rtmutex.h>
+#include <linux/rbtree.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include "binder_alloc.h"
+#include "binder_trace.h"
+
+static DEFINE_MUTEX(binder_alloc_mmap_lock);
+
+/* allocators with a mapping, walked by the shrinker */
+static LIST_HEAD(binder_alloc_list);
+static DEFINE_MUTEX(binder_alloc_list_lock);
+static atomic_long_t binder_alloc_lru_count;
+
+enum {
+	BINDER_DEBUG_USER_ERROR             = 1U << 0,
+	BINDER_DEBUG_OPEN_CLOSE             = 1U << 1,
+	BINDER_DEBUG_BUFFER_ALLOC           = 1U << 2,
+	BINDER_DEBUG_BUFFER_ALLOC_ASYNC     = 1U << 3,
+};
+static uint32_t binder_alloc_debug_mask = BINDER_DEBUG_USER_ERROR;
+
+module_param_named(debug_mask, binder_alloc_debug_mask,
+		   uint, S_IWUSR | S_IRUGO);
+
+/* unused pages a proc keeps mapped before they are freed eagerly */
+int binder_alloc_lru_max = 32;
+module_param_named(lru_max_pages, binder_alloc_lru_max,
+		   int, S_IWUSR | S_IRUGO);
+
+/* freed small buffers kept per size class */
+int binder_alloc_small_cache_depth = 8;
+module_param_named(small_cache_depth, binder_alloc_small_cache_depth,
+		   int, S_IWUSR | S_IRUGO);
+
+#define binder_alloc_debug(mask, x...) \
+	do { \
+		if (binder_alloc_debug_mask & mask) \
+			pr_info(x); \
+	} while (0)
+
+static size_t binder_alloc_buffer_size(struct binder_alloc *alloc,
+				       struct binder_buffer *buffer)
+{
+	if (list_is_last(&buffer->entry, &alloc->buffers))
+		return alloc->buffer + alloc->buffer_size -
+			(void *)buffer->data;
+	else
+		return (size_t)list_entry(buffer->entry.next,
+			struct binder_buffer, entry) - (size_t)buffer->data;
+}
+
+static void binder_insert_free_buffer(struct binder_alloc *alloc,
+				      struct binder_buffer *new_buffer)
+{
+	struct rb_node **p = &alloc->free_buffers.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	size_t new_buffer_size;
+
+	BUG_ON(!new_buffer->free);
+
+	new_buffer_size = binder_alloc_buffer_size(alloc, new_buffer);
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "%d: add free buffer, size %zd, at %p\n",
+		      alloc->pid, new_buffer_size, new_buffer);
+
+	while (*p) {
+		parent = *p;
+		buffer = rb_entry(parent, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+
+		buffer_size = binder_alloc_buffer_size(alloc, buffer);
+
+		if (new_buffer_size < buffer_size)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new_buffer->rb_node, parent, p);
+	rb_insert_color(&new_buffer->rb_node, &alloc->free_buffers);
+}
+
+static void binder_insert_allocated_buffer_locked(
+		struct binder_alloc *alloc, struct binder_buffer *new_buffer)
+{
+	struct rb_node **p = &alloc->allocated_buffers.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_buffer *buffer;
+
+	BUG_ON(new_buffer->free);
+
+	while (*p) {
+		parent = *p;
+		buffer = rb_entry(parent, struct binder_buffer, rb_node);
+		BUG_ON(buffer->free);
+
+		if (new_buffer < buffer)
+			p = &parent->rb_left;
+		else if (new_buffer > buffer)
+			p = &parent->rb_right;
+		else
+			BUG();
+	}
+	rb_link_node(&new_buffer->rb_node, parent, p);
+	rb_insert_color(&new_buffer->rb_node, &alloc->allocated_buffers);
+}
+
+static struct binder_buffer *binder_alloc_prepare_to_free_locked(
+		struct binder_alloc *alloc,
+		uintptr_t user_ptr)
+{
+	struct rb_node *n = alloc->allocated_buffers.rb_node;
+	struct binder_buffer *buffer;
+	struct binder_buffer *kern_ptr;
+
+	kern_ptr = (struct binder_buffer *)(user_ptr - alloc->user_buffer_offset
+		- offsetof(struct binder_buffer, data));
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(buffer->free);
+
+		if (kern_ptr < buffer)
+			n = n->rb_left;
+		else if (kern_ptr > buffer)
+			n = n->rb_right;
+		else {
+			/*
+			 * Guard against user threads attempting to
+			 * free the buffer twice
+			 */
+			if (!buffer->allow_user_free)
+				return ERR_PTR(-EPERM);
+			buffer->allow_user_free = 0;
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * binder_alloc_prepare_to_free() - get buffer given user ptr
+ * @alloc:	binder_alloc for this proc
+ * @user_ptr:	User pointer to buffer data
+ *
+ * Validate userspace pointer to buffer data and return buffer corresponding to
+ * that user pointer. Search the rb tree for buffer that matches user data
+ * pointer. The buffer can no longer be freed by userspace once this returns,
+ * so two threads racing on the same BC_FREE_BUFFER only succeed once.
+ *
+ * Return:	Pointer to buffer, NULL if no buffer matches or ERR_PTR(-EPERM)
+ *		if the buffer was not handed to userspace or is already being
+ *		freed
+ */
+struct binder_buffer *binder_alloc_prepare_to_free(struct binder_alloc *alloc,
+						   uintptr_t user_ptr)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&alloc->mutex);
+	buffer = binder_alloc_prepare_to_free_locked(alloc, user_ptr);
+	mutex_unlock(&alloc->mutex);
+	return buffer;
+}
+
+static struct binder_lru_page *binder_alloc_page(struct binder_alloc *alloc,
+						 void *page_addr)
+{
+	return &alloc->pages[(page_addr - alloc->buffer) / PAGE_SIZE];
+}
+
+static void binder_lru_add_locked(struct binder_alloc *alloc,
+				  struct binder_lru_page *page)
+{
+	if (WARN_ON(!page->page_ptr || !list_empty(&page->lru)))
+		return;
+	list_add_tail(&page->lru, &alloc->lru);
+	alloc->lru_pages++;
+	atomic_long_inc(&binder_alloc_lru_count);
+}
+
+static void binder_lru_del_locked(struct binder_alloc *alloc,
+				  struct binder_lru_page *page)
+{
+	if (list_empty(&page->lru))
+		return;
+	list_del_init(&page->lru);
+	alloc->lru_pages--;
+	atomic_long_dec(&binder_alloc_lru_count);
+}
+
+/*
+ * Unmap and free one page; the caller holds the mmap_sem of the mm @vma
+ * belongs to, if @vma is not NULL.
+ */
+static void binder_free_page_locked(struct binder_alloc *alloc,
+				    struct binder_lru_page *page,
+				    struct vm_area_struct *vma)
+{
+	void *page_addr = alloc->buffer + (page - alloc->pages) * PAGE_SIZE;
+
+	if (vma)
+		zap_page_range(vma, (uintptr_t)page_addr +
+			alloc->user_buffer_offset, PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+}
+
+/*
+ * Take a reference to the mm the buffer is mapped into, unless it is
+ * already being torn down. The group leader may have exited while other
+ * threads still use the mm, so it is not looked up through a task.
+ */
+static struct mm_struct *binder_alloc_get_mm(struct binder_alloc *alloc)
+{
+	struct mm_struct *mm = alloc->vma_vm_mm;
+
+	if (mm && atomic_inc_not_zero(&mm->mm_users))
+		return mm;
+	return NULL;
+}
+
+/*
+ * The last mmput() tears down the whole address space, which reclaim
+ * must not do, so that is left to a worker.
+ */
+static void binder_alloc_put_mm(struct binder_alloc *alloc,
+				struct mm_struct *mm, bool reclaim)
+{
+	if (!reclaim)
+		mmput(mm);
+	else if (!atomic_add_unless(&mm->mm_users, -1, 1))
+		schedule_work(&alloc->mm_put_work);
+}
+
+static void binder_alloc_mm_put_func(struct work_struct *work)
+{
+	struct binder_alloc *alloc =
+		container_of(work, struct binder_alloc, mm_put_work);
+
+	mmput(alloc->vma_vm_mm);
+}
+
+/*
+ * Free the least recently used of the unused pages until at most
+ * @max_pages are left. In reclaim context we must not wait for the
+ * mmap_sem, so the pages are left alone if it is contended. They are
+ * also left alone while the mm is being torn down and may still map
+ * them; binder_alloc_vma_close() clears the vma only after that.
+ *
+ * Return: number of pages freed
+ */
+static int binder_alloc_trim_locked(struct binder_alloc *alloc, int max_pages,
+				    bool reclaim)
+{
+	struct binder_lru_page *page;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm;
+	int freed = 0;
+
+	if (alloc->lru_pages <= max_pages)
+		return 0;
+
+	mm = binder_alloc_get_mm(alloc);
+	vma = NULL;
+	if (mm) {
+		if (reclaim) {
+			if (!down_write_trylock(&mm->mmap_sem)) {
+				binder_alloc_put_mm(alloc, mm, reclaim);
+				return 0;
+			}
+		} else {
+			down_write(&mm->mmap_sem);
+		}
+		vma = alloc->vma;
+	} else if (ACCESS_ONCE(alloc->vma)) {
+		return 0;
+	}
+
+	while (alloc->lru_pages > max_pages) {
+		page = list_first_entry(&alloc->lru, struct binder_lru_page,
+					lru);
+		binder_lru_del_locked(alloc, page);
+		binder_free_page_locked(alloc, page, vma);
+		freed++;
+	}
+
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		binder_alloc_put_mm(alloc, mm, reclaim);
+	}
+	return freed;
+}
+
+/**
+ * binder_alloc_trim() - free unused pages kept mapped for reuse
+ * @alloc:	binder_alloc for this proc
+ * @max_pages:	number of unused pages to keep
+ */
+void binder_alloc_trim(struct binder_alloc *alloc, int max_pages)
+{
+	mutex_lock(&alloc->mutex);
+	binder_alloc_trim_locked(alloc, max_pages, false);
+	mutex_unlock(&alloc->mutex);
+}
+
+static int binder_update_page_range(struct binder_alloc *alloc, int allocate,
+				    void *start, void *end,
+				    struct vm_area_struct *vma)
+{
+	void *page_addr;
+	unsigned long user_page_addr;
+	struct vm_struct tmp_area;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	bool need_mm = false;
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "%d: %s pages %p-%p\n", alloc->pid,
+		     allocate ? "allocate" : "free", start, end);
+
+	if (end <= start)
+		return 0;
+
+	trace_binder_update_page_range(alloc, allocate, start, end);
+
+	if (allocate == 0)
+		goto free_range;
+
+	/* pages still on the LRU can be reused without touching the mm */
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = binder_alloc_page(alloc, page_addr);
+		if (!page->page_ptr) {
+			need_mm = true;
+			break;
+		}
+	}
+
+	if (need_mm && !vma)
+		mm = binder_alloc_get_mm(alloc);
+
+	if (mm) {
+		down_write(&mm->mmap_sem);
+		vma = alloc->vma;
+	}
+
+	if (need_mm && vma == NULL) {
+		pr_err("%d: binder_alloc_buf failed to map pages in userspace, no vma\n",
+			alloc->pid);
+		goto err_no_vma;
+	}
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		int ret;
+
+		page = binder_alloc_page(alloc, page_addr);
+		if (page->page_ptr) {
+			binder_lru_del_locked(alloc, page);
+			continue;
+		}
+
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_HIGHMEM |
+					    __GFP_ZERO);
+		if (page->page_ptr == NULL) {
+			pr_err("%d: binder_alloc_buf failed for page at %p\n",
+				alloc->pid, page_addr);
+			goto err_alloc_page_failed;
+		}
+		tmp_area.addr = page_addr;
+		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
+		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page->page_ptr);
+		if (ret) {
+			pr_err("%d: binder_alloc_buf failed to map page at %p in kernel\n",
+			       alloc->pid, page_addr);
+			goto err_map_kernel_failed;
+		}
+		user_page_addr =
+			(uintptr_t)page_addr + alloc->user_buffer_offset;
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
+		if (ret) {
+			pr_err("%d: binder_alloc_buf failed to map page at %lx in userspace\n",
+			       alloc->pid, user_page_addr);
+			goto err_vm_insert_page_failed;
+		}
+		/* vm_insert_page does not seem to increment the refcount */
+	}
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return 0;
+
+free_range:
+	/*
+	 * Keep the pages mapped for the next buffer in this range, unless
+	 * the proc already holds more unused pages than it may. Trimming
+	 * then goes down to half of that, so that a proc hovering around
+	 * the limit does not map and unmap a page on every transaction.
+	 */
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE)
+		binder_lru_add_locked(alloc, binder_alloc_page(alloc, page_addr));
+	if (alloc->lru_pages > binder_alloc_lru_max)
+		binder_alloc_trim_locked(alloc, binder_alloc_lru_max / 2,
+					 false);
+	return 0;
+
+err_vm_insert_page_failed:
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+err_map_kernel_failed:
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+err_alloc_page_failed:
+	/* the pages we got so far are fine, keep them for later */
+	for (page_addr -= PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE)
+		binder_lru_add_locked(alloc, binder_alloc_page(alloc, page_addr));
+err_no_vma:
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return -ENOMEM;
+}
+
+/*
+ * Take a cached small buffer of at least @size bytes. Only the size
+ * class @size falls into and the next one up are searched, so that a
+ * small request does not pin a much larger chunk.
+ */
+static struct binder_buffer *binder_alloc_get_cached_locked(
+		struct binder_alloc *alloc, size_t size)
+{
+	struct binder_buffer *buffer;
+	int bin, last;
+
+	bin = DIV_ROUND_UP(size, 1 << BINDER_SMALL_BUF_SHIFT) - 1;
+	if (bin < 0)
+		bin = 0;
+	last = min(bin + 1, BINDER_SMALL_BUF_BINS - 1);
+	for (; bin <= last; bin++) {
+		buffer = list_first_entry_or_null(&alloc->small_free[bin],
+						  struct binder_buffer,
+						  cache_entry);
+		if (buffer) {
+			list_del(&buffer->cache_entry);
+			alloc->small_free_count[bin]--;
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static void binder_merge_free_buffer_locked(struct binder_alloc *alloc,
+					    struct binder_buffer *buffer,
+					    size_t buffer_size);
+
+/* give all cached small buffers back to the general allocator */
+static bool binder_alloc_flush_cache_locked(struct binder_alloc *alloc)
+{
+	struct binder_buffer *buffer, *tmp;
+	bool flushed = false;
+	int bin;
+
+	for (bin = 0; bin < BINDER_SMALL_BUF_BINS; bin++) {
+		list_for_each_entry_safe(buffer, tmp, &alloc->small_free[bin],
+					 cache_entry) {
+			list_del(&buffer->cache_entry);
+			binder_merge_free_buffer_locked(alloc, buffer,
+				binder_alloc_buffer_size(alloc, buffer));
+			flushed = true;
+		}
+		alloc->small_free_count[bin] = 0;
+	}
+	return flushed;
+}
+
+static struct binder_buffer *binder_alloc_new_buf_locked(
+		struct binder_alloc *alloc, size_t data_size,
+		size_t offsets_size, size_t extra_buffers_size, int is_async)
+{
+	struct rb_node *n;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	struct rb_node *best_fit = NULL;
+	void *has_page_addr;
+	void *end_page_addr;
+	size_t size, data_offsets_size;
+
+	if (alloc->vma == NULL) {
+		pr_err("%d: binder_alloc_buf, no vma\n",
+		       alloc->pid);
+		return NULL;
+	}
+
+	data_offsets_size = ALIGN(data_size, sizeof(void *)) +
+		ALIGN(offsets_size, sizeof(void *));
+
+	if (data_offsets_size < data_size || data_offsets_size < offsets_size) {
+		binder_alloc_debug(BINDER_DEBUG_USER_ERROR,
+				   "%d: got transaction with invalid size %zd-%zd\n",
+				   alloc->pid, data_size, offsets_size);
+		return NULL;
+	}
+	size = data_offsets_size + ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < data_offsets_size || size < extra_buffers_size) {
+		binder_alloc_debug(BINDER_DEBUG_USER_ERROR,
+				   "%d: got transaction with invalid extra_buffers_size %zd\n",
+				   alloc->pid, extra_buffers_size);
+		return NULL;
+	}
+
+	if (is_async &&
+	    alloc->free_async_space < size + sizeof(struct binder_buffer)) {
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "%d: binder_alloc_buf size %zd failed, no async space left\n",
+			      alloc->pid, size);
+		return NULL;
+	}
+
+	if (size <= BINDER_SMALL_BUF_BINS << BINDER_SMALL_BUF_SHIFT) {
+		buffer = binder_alloc_get_cached_locked(alloc, size);
+		if (buffer) {
+			/* its pages were never released */
+			binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "%d: binder_alloc_buf size %zd got cached %p\n",
+				      alloc->pid, size, buffer);
+			goto got_buffer;
+		}
+	}
+
+retry:
+	n = alloc->free_buffers.rb_node;
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+		buffer_size = binder_alloc_buffer_size(alloc, buffer);
+
+		if (size < buffer_size) {
+			best_fit = n;
+			n = n->rb_left;
+		} else if (size > buffer_size)
+			n = n->rb_right;
+		else {
+			best_fit = n;
+			break;
+		}
+	}
+	if (best_fit == NULL) {
+		if (binder_alloc_flush_cache_locked(alloc))
+			goto retry;
+		pr_err("%d: binder_alloc_buf size %zd failed, no address space\n",
+			alloc->pid, size);
+		return NULL;
+	}
+	if (n == NULL) {
+		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+		buffer_size = binder_alloc_buffer_size(alloc, buffer);
+	}
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "%d: binder_alloc_buf size %zd got buffer %p size %zd\n",
+		      alloc->pid, size, buffer, buffer_size);
+
+	has_page_addr =
+		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
+	if (n == NULL) {
+		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+			buffer_size = size; /* no room for other buffers */
+		else
+			buffer_size = size + sizeof(struct binder_buffer);
+	}
+	end_page_addr =
+		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
+	if (end_page_addr > has_page_addr)
+		end_page_addr = has_page_addr;
+	if (binder_update_page_range(alloc, 1,
+	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
+		return NULL;
+
+	rb_erase(best_fit, &alloc->free_buffers);
+	buffer->free = 0;
+	if (buffer_size != size) {
+		struct binder_buffer *new_buffer = (void *)buffer->data + size;
+		list_add(&new_buffer->entry, &buffer->entry);
+		new_buffer->free = 1;
+		binder_insert_free_buffer(alloc, new_buffer);
+	}
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "%d: binder_alloc_buf size %zd got %p\n",
+		      alloc->pid, size, buffer);
+got_buffer:
+	buffer->allow_user_free = 0;
+	binder_insert_allocated_buffer_locked(alloc, buffer);
+	buffer->data_size = data_size;
+	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
+	buffer->async_transaction = is_async;
+	if (is_async) {
+		alloc->free_async_space -= size + sizeof(struct binder_buffer);
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
+			     "%d: binder_alloc_buf size %zd async free %zd\n",
+			      alloc->pid, size, alloc->free_async_space);
+	}
+
+	return buffer;
+}
+
+/**
+ * binder_alloc_new_buf() - Allocate a new binder buffer
+ * @alloc:              binder_alloc for this proc
+ * @data_size:          size of user data buffer
+ * @offsets_size:       user specified buffer offset
+ * @extra_buffers_size: size of extra space for scatter-gather buffers
+ * @is_async:           buffer for async transaction
+ *
+ * Allocate a new buffer given the requested sizes. Returns
+ * the kernel version of the buffer pointer. The size allocated
+ * is the sum of the three sizes rounded up to pointer-sized boundaries.
+ *
+ * Return:	The allocated buffer or NULL on failure
+ */
+struct binder_buffer *binder_alloc_new_buf(struct binder_alloc *alloc,
+					   size_t data_size,
+					   size_t offsets_size,
+					   size_t extra_buffers_size,
+					   int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&alloc->mutex);
+	buffer = binder_alloc_new_buf_locked(alloc, data_size, offsets_size,
+					     extra_buffers_size, is_async);
+	mutex_unlock(&alloc->mutex);
+	return buffer;
+}
+
+static void *buffer_start_page(struct binder_buffer *buffer)
+{
+	return (void *)((uintptr_t)buffer & PAGE_MASK);
+}
+
+static void *buffer_end_page(struct binder_buffer *buffer)
+{
+	return (void *)(((uintptr_t)(buffer + 1) - 1) & PAGE_MASK);
+}
+
+static void binder_delete_free_buffer(struct binder_alloc *alloc,
+				      struct binder_buffer *buffer)
+{
+	struct binder_buffer *prev, *next = NULL;
+	int free_page_end = 1;
+	int free_page_start = 1;
+
+	BUG_ON(alloc->buffers.next == &buffer->entry);
+	prev = list_entry(buffer->entry.prev, struct binder_buffer, entry);
+	BUG_ON(!prev->free);
+	if (buffer_end_page(prev) == buffer_start_page(buffer)) {
+		free_page_start = 0;
+		if (buffer_end_page(prev) == buffer_end_page(buffer))
+			free_page_end = 0;
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "%d: merge free, buffer %p share page with %p\n",
+			      alloc->pid, buffer, prev);
+	}
+
+	if (!list_is_last(&buffer->entry, &alloc->buffers)) {
+		next = list_entry(buffer->entry.next,
+				  struct binder_buffer, entry);
+		if (buffer_start_page(next) == buffer_end_page(buffer)) {
+			free_page_end = 0;
+			if (buffer_start_page(next) ==
+			    buffer_start_page(buffer))
+				free_page_start = 0;
+			binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "%d: merge free, buffer %p share page with %p\n",
+				      alloc->pid, buffer, prev);
+		}
+	}
+	list_del(&buffer->entry);
+	if (free_page_start || free_page_end) {
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "%d: merge free, buffer %p do not share page%s%s with %p or %p\n",
+			     alloc->pid, buffer, free_page_start ? "" : " end",
+			     free_page_end ? "" : " start", prev, next);
+		binder_update_page_range(alloc, 0, free_page_start ?
+			buffer_start_page(buffer) : buffer_end_page(buffer),
+			(free_page_end ? buffer_end_page(buffer) :
+			buffer_start_page(buffer)) + PAGE_SIZE, NULL);
+	}
+}
+
+/*
+ * Keep a freed small buffer on the free list of its size class instead
+ * of merging it, so that the next transaction of about the same size
+ * gets it back without a tree search, split or page range update. The
+ * buffer stays marked as in use, so its neighbours do not merge with it.
+ */
+static bool binder_alloc_cache_buffer_locked(struct binder_alloc *alloc,
+					     struct binder_buffer *buffer,
+					     size_t buffer_size)
+{
+	int bin = (buffer_size >> BINDER_SMALL_BUF_SHIFT) - 1;
+
+	if (bin < 0 || bin >= BINDER_SMALL_BUF_BINS ||
+	    alloc->small_free_count[bin] >= binder_alloc_small_cache_depth)
+		return false;
+
+	list_add(&buffer->cache_entry, &alloc->small_free[bin]);
+	alloc->small_free_count[bin]++;
+	return true;
+}
+
+static void binder_free_buf_locked(struct binder_alloc *alloc,
+				   struct binder_buffer *buffer)
+{
+	size_t size, buffer_size;
+
+	buffer_size = binder_alloc_buffer_size(alloc, buffer);
+
+	size = ALIGN(buffer->data_size, sizeof(void *)) +
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "%d: binder_free_buf %p size %zd buffer_size %zd\n",
+		      alloc->pid, buffer, size, buffer_size);
+
+	BUG_ON(buffer->free);
+	BUG_ON(size > buffer_size);
+	BUG_ON(buffer->transaction != NULL);
+	BUG_ON((void *)buffer < alloc->buffer);
+	BUG_ON((void *)buffer > alloc->buffer + alloc->buffer_size);
+
+	if (buffer->async_transaction) {
+		alloc->free_async_space += size + sizeof(struct binder_buffer);
+
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
+			     "%d: binder_free_buf size %zd async free %zd\n",
+			      alloc->pid, size, alloc->free_async_space);
+	}
+
+	rb_erase(&buffer->rb_node, &alloc->allocated_buffers);
+	if (binder_alloc_cache_buffer_locked(alloc, buffer, buffer_size))
+		return;
+	binder_merge_free_buffer_locked(alloc, buffer, buffer_size);
+}
+
+static void binder_merge_free_buffer_locked(struct binder_alloc *alloc,
+					    struct binder_buffer *buffer,
+					    size_t buffer_size)
+{
+	binder_update_page_range(alloc, 0,
+		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
+		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
+		NULL);
+	buffer->free = 1;
+	if (!list_is_last(&buffer->entry, &alloc->buffers)) {
+		struct binder_buffer *next = list_entry(buffer->entry.next,
+						struct binder_buffer, entry);
+		if (next->free) {
+			rb_erase(&next->rb_node, &alloc->free_buffers);
+			binder_delete_free_buffer(alloc, next);
+		}
+	}
+	if (alloc->buffers.next != &buffer->entry) {
+		struct binder_buffer *prev = list_entry(buffer->entry.prev,
+						struct binder_buffer, entry);
+		if (prev->free) {
+			binder_delete_free_buffer(alloc, buffer);
+			rb_erase(&prev->rb_node, &alloc->free_buffers);
+			buffer = prev;
+		}
+	}
+	binder_insert_free_buffer(alloc, buffer);
+}
+
+/**
+ * binder_alloc_free_buf() - free a binder buffer
+ * @alloc:	binder_alloc for this proc
+ * @buffer:	kernel pointer to buffer
+ *
+ * Free the buffer allocated via binder_alloc_new_buf()
+ */
+void binder_alloc_free_buf(struct binder_alloc *alloc,
+			   struct binder_buffer *buffer)
+{
+	mutex_lock(&alloc->mutex);
+	binder_free_buf_locked(alloc, buffer);
+	mutex_unlock(&alloc->mutex);
+}
+
+/**
+ * binder_alloc_mmap_handler() - map virtual address space for proc
+ * @alloc:	alloc structure for this proc
+ * @vma:	vma passed to mmap()
+ *
+ * Called by binder_mmap() to initialize the space specified in
+ * vma for allocating binder buffers
+ *
+ * Return:
+ *      0 = success
+ *      -EBUSY = address space already mapped
+ *      -ENOMEM = failed to map memory to given address space
+ */
+int binder_alloc_mmap_handler(struct binder_alloc *alloc,
+			      struct vm_area_struct *vma)
+{
+	int ret;
+	struct vm_struct *area;
+	const char *failure_string;
+	struct binder_buffer *buffer;
+	size_t i;
+
+	mutex_lock(&binder_alloc_mmap_lock);
+	if (alloc->buffer) {
+		ret = -EBUSY;
+		failure_string = "already mapped";
+		goto err_already_mapped;
+	}
+
+	area = get_vm_area(vma->vm_end - vma->vm_start, VM_IOREMAP);
+	if (area == NULL) {
+		ret = -ENOMEM;
+		failure_string = "get_vm_area";
+		goto err_get_vm_area_failed;
+	}
+	alloc->buffer = area->addr;
+	alloc->user_buffer_offset = vma->vm_start - (uintptr_t)alloc->buffer;
+	mutex_unlock(&binder_alloc_mmap_lock);
+
+#ifdef CONFIG_CPU_CACHE_VIPT
+	if (cache_is_vipt_aliasing()) {
+		while (CACHE_COLOUR((vma->vm_start ^ (uint32_t)alloc->buffer))) {
+			pr_info("%s: %d %lx-%lx maps %p bad alignment\n",
+				__func__, alloc->pid, vma->vm_start,
+				vma->vm_end, alloc->buffer);
+			vma->vm_start += PAGE_SIZE;
+		}
+	}
+#endif
+	alloc->pages = kzalloc(sizeof(alloc->pages[0]) *
+			       ((vma->vm_end - vma->vm_start) / PAGE_SIZE),
+			       GFP_KERNEL);
+	if (alloc->pages == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc page array";
+		goto err_alloc_pages_failed;
+	}
+	alloc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < alloc->buffer_size / PAGE_SIZE; i++)
+		INIT_LIST_HEAD(&alloc->pages[i].lru);
+
+	if (binder_update_page_range(alloc, 1, alloc->buffer,
+				     alloc->buffer + PAGE_SIZE, vma)) {
+		ret = -ENOMEM;
+		failure_string = "alloc small buf";
+		goto err_alloc_small_buf_failed;
+	}
+	buffer = alloc->buffer;
+	INIT_LIST_HEAD(&alloc->buffers);
+	list_add(&buffer->entry, &alloc->buffers);
+	buffer->free = 1;
+	binder_insert_free_buffer(alloc, buffer);
+	alloc->free_async_space = alloc->buffer_size / 2;
+	barrier();
+	alloc->vma = vma;
+	alloc->vma_vm_mm = vma->vm_mm;
+	/* pinned so that the shrinker can always look at it */
+	atomic_inc(&alloc->vma_vm_mm->mm_count);
+
+	mutex_lock(&binder_alloc_list_lock);
+	list_add_tail(&alloc->lru_entry, &binder_alloc_list);
+	mutex_unlock(&binder_alloc_list_lock);
+
+	return 0;
+
+err_alloc_small_buf_failed:
+	kfree(alloc->pages);
+	alloc->pages = NULL;
+err_alloc_pages_failed:
+	mutex_lock(&binder_alloc_mmap_lock);
+	vfree(alloc->buffer);
+	alloc->buffer = NULL;
+err_get_vm_area_failed:
+err_already_mapped:
+	mutex_unlock(&binder_alloc_mmap_lock);
+	pr_err("%s: %d %lx-%lx %s failed %d\n", __func__,
+	       alloc->pid, vma->vm_start, vma->vm_end, failure_string, ret);
+	return ret;
+}
+
+/**
+ * binder_alloc_deferred_release() - free all buffers and pages of a proc
+ * @alloc:	binder_alloc for this proc
+ *
+ * Called once the binder_proc owning @alloc is no longer referenced;
+ * the vma must already have been closed.
+ */
+void binder_alloc_deferred_release(struct binder_alloc *alloc)
+{
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(alloc->vma);
+
+	mutex_lock(&binder_alloc_list_lock);
+	if (!list_empty(&alloc->lru_entry))
+		list_del_init(&alloc->lru_entry);
+	mutex_unlock(&binder_alloc_list_lock);
+
+	buffers = 0;
+	mutex_lock(&alloc->mutex);
+	while ((n = rb_first(&alloc->allocated_buffers))) {
+		struct binder_buffer *buffer;
+
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+
+		if (buffer->transaction) {
+			pr_err("release proc %d, buffer %d, transaction not freed\n",
+			       alloc->pid, buffer->debug_id);
+			buffer->transaction = NULL;
+		}
+
+		binder_free_buf_locked(alloc, buffer);
+		buffers++;
+	}
+
+	page_count = 0;
+	if (alloc->pages) {
+		int i;
+
+		for (i = 0; i < alloc->buffer_size / PAGE_SIZE; i++) {
+			void *page_addr;
+
+			if (!alloc->pages[i].page_ptr)
+				continue;
+			binder_lru_del_locked(alloc, &alloc->pages[i]);
+
+			page_addr = alloc->buffer + i * PAGE_SIZE;
+			binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "%s: %d: page %d at %p not freed\n",
+				     __func__, alloc->pid, i, page_addr);
+			unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+			__free_page(alloc->pages[i].page_ptr);
+			page_count++;
+		}
+		kfree(alloc->pages);
+		vfree(alloc->buffer);
+	}
+	mutex_unlock(&alloc->mutex);
+	if (alloc->vma_vm_mm) {
+		flush_work(&alloc->mm_put_work);
+		mmdrop(alloc->vma_vm_mm);
+	}
+
+	binder_alloc_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "%s: %d buffers %d, pages %d\n",
+		     __func__, alloc->pid, buffers, page_count);
+}
+
+static void print_binder_buffer(struct seq_file *m, const char *prefix,
+				struct binder_buffer *buffer)
+{
+	seq_printf(m, "%s %d: %p size %zd:%zd %s\n",
+		   prefix, buffer->debug_id, buffer->data,
+		   buffer->data_size, buffer->offsets_size,
+		   buffer->transaction ? "active" : "delivered");
+}
+
+/**
+ * binder_alloc_print_allocated() - print buffer info
+ * @m:     seq_file for output via seq_printf()
+ * @alloc: binder_alloc for this proc
+ *
+ * Prints information about every buffer associated with
+ * the binder_alloc state to the given seq_file
+ */
+void binder_alloc_print_allocated(struct seq_file *m,
+				  struct binder_alloc *alloc)
+{
+	struct rb_node *n;
+
+	mutex_lock(&alloc->mutex);
+	for (n = rb_first(&alloc->allocated_buffers); n != NULL; n = rb_next(n))
+		print_binder_buffer(m, "  buffer",
+				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&alloc->mutex);
+}
+
+/**
+ * binder_alloc_get_allocated_count() - return count of buffers
+ * @alloc: binder_alloc for this proc
+ *
+ * Return: count of allocated buffers
+ */
+int binder_alloc_get_allocated_count(struct binder_alloc *alloc)
+{
+	struct rb_node *n;
+	int count = 0;
+
+	mutex_lock(&alloc->mutex);
+	for (n = rb_first(&alloc->allocated_buffers); n != NULL; n = rb_next(n))
+		count++;
+	mutex_unlock(&alloc->mutex);
+	return count;
+}
+
+/**
+ * binder_alloc_vma_close() - invalidate address space
+ * @alloc: binder_alloc for this proc
+ *
+ * Called from binder_vma_close() when releasing address space.
+ * Clears alloc->vma to prevent new incoming transactions from
+ * allocating more buffers.
+ */
+void binder_alloc_vma_close(struct binder_alloc *alloc)
+{
+	ACCESS_ONCE(alloc->vma) = NULL;
+}
+
+/**
+ * binder_alloc_init() - called by binder_open() for per-proc initialization
+ * @alloc: binder_alloc for this proc
+ *
+ * Called from binder_open() to initialize binder_alloc fields for
+ * new binder proc
+ */
+void binder_alloc_init(struct binder_alloc *alloc)
+{
+	int bin;
+
+	alloc->pid = current->group_leader->pid;
+	mutex_init(&alloc->mutex);
+	INIT_LIST_HEAD(&alloc->buffers);
+	INIT_LIST_HEAD(&alloc->lru);
+	INIT_LIST_HEAD(&alloc->lru_entry);
+	INIT_WORK(&alloc->mm_put_work, binder_alloc_mm_put_func);
+	for (bin = 0; bin < BINDER_SMALL_BUF_BINS; bin++)
+		INIT_LIST_HEAD(&alloc->small_free[bin]);
+}
+
+/*
+ * Free unused pages of all procs, oldest first within each proc. Lock
+ * order is alloc->mutex before mmap_sem, and we may be called with
+ * either held, so nothing is waited for.
+ */
+static int binder_alloc_shrink(struct shrinker *shrink,
+			       struct shrink_control *sc)
+{
+	struct binder_alloc *alloc;
+	unsigned long nr = sc->nr_to_scan;
+
+	if (!nr)
+		goto out;
+	if (!mutex_trylock(&binder_alloc_list_lock))
+		return -1;
+	list_for_each_entry(alloc, &binder_alloc_list, lru_entry) {
+		int max_pages;
+
+		if (!mutex_trylock(&alloc->mutex))
+			continue;
+		max_pages = (unsigned long)alloc->lru_pages > nr ?
+			    alloc->lru_pages - nr : 0;
+		nr -= binder_alloc_trim_locked(alloc, max_pages, true);
+		mutex_unlock(&alloc->mutex);
+		if (!nr)
+			break;
+	}
+	mutex_unlock(&binder_alloc_list_lock);
+out:
+	return min_t(long, atomic_long_read(&binder_alloc_lru_count), INT_MAX);
+}
+
+static struct shrinker binder_alloc_shrinker = {
+	.shrink = binder_alloc_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/**
+ * binder_alloc_shrinker_init() - register the shrinker for unused pages
+ *
+ * Called once from binder_init().
+ */
+void binder_alloc_shrinker_init(void)
+{
+	register_shrinker(&binder_alloc_shrinker);
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2017 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_BINDER_ALLOC_H
+#define _LINUX_BINDER_ALLOC_H
+
+#include <linux/rbtree.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+
+struct binder_transaction;
+struct binder_node;
+
+/*
+ * Freed buffers of up to BINDER_SMALL_BUF_BINS << BINDER_SMALL_BUF_SHIFT
+ * bytes are kept on per-size free lists instead of being merged back
+ */
+#define BINDER_SMALL_BUF_SHIFT	6
+#define BINDER_SMALL_BUF_BINS	8
+
+/**
+ * struct binder_buffer - buffer used for binder transactions
+ * @entry:              entry alloc->buffers
+ * @rb_node:            node for allocated_buffers/free_buffers rb trees
+ * @cache_entry:        entry in alloc->small_free while cached there
+ * @free:               true if buffer is free
+ * @allow_user_free:    set once userspace has been handed the buffer,
+ *                      cleared again when it asks to free it
+ * @async_transaction:  buffer has been allocated for an async transaction
+ * @debug_id:           unique ID for debugging
+ * @transaction:        pointer to associated struct binder_transaction
+ * @target_node:        struct binder_node associated with this buffer
+ * @data_size:          size of @transaction data
+ * @offsets_size:       size of array of offsets
+ * @extra_buffers_size: size of space for scatter-gather buffers
+ * @data:               start of the data, followed by the offsets and
+ *                      the scatter-gather buffers
+ *
+ * Bookkeeping structure for binder transaction buffers. The buffer
+ * list and the free/allocated state are protected by the owning
+ * binder_alloc's mutex, @transaction by the inner lock of the
+ * binder_proc the buffer belongs to.
+ */
+struct binder_buffer {
+	struct list_head entry; /* free and allocated entries by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head cache_entry;
+	};
+	unsigned free:1;
+	unsigned allow_user_free:1;
+	unsigned async_transaction:1;
+	unsigned debug_id:29;
+
+	struct binder_transaction *transaction;
+
+	struct binder_node *target_node;
+	size_t data_size;
+	size_t offsets_size;
+	size_t extra_buffers_size;
+	uint8_t data[0];
+};
+
+/**
+ * struct binder_lru_page - page object used for binder shrinker
+ * @lru:        entry in alloc->lru while no buffer uses the page
+ * @page_ptr:   pointer to physical page in mmap'd space
+ *
+ * Pages no longer covered by any buffer stay mapped on the LRU, so that
+ * the next allocation in the same range does not have to allocate and
+ * map them again. They are only freed by the shrinker or once the
+ * owning proc holds more than its share of them.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+};
+
+/**
+ * struct binder_alloc - per-binder proc state for binder allocator
+ * @mutex:              protects all fields of the allocator; taken
+ *                      without holding any of the binder_proc locks
+ * @vma:                vm_area_struct passed to mmap_handler
+ *                      (invariant after mmap)
+ * @vma_vm_mm:          copy of vma->vm_mm (invariant after mmap); the
+ *                      mm_struct is pinned until the deferred release
+ * @mm_put_work:        drops a reference to @vma_vm_mm that reclaim
+ *                      must not drop itself
+ * @buffer:             base of per-proc address space mapped via mmap
+ * @user_buffer_offset: offset between user and kernel VAs for buffer
+ * @buffers:            list of all buffers for this proc
+ * @free_buffers:       rb tree of buffers available for allocation
+ *                      sorted by size
+ * @allocated_buffers:  rb tree of allocated buffers sorted by address
+ * @free_async_space:   VA space available for async buffers. This is
+ *                      initialized at mmap time to 1/2 the full VA space
+ * @pages:              array of binder_lru_page for each page of
+ *                      mmap'd space
+ * @lru:                unused but still mapped @pages, oldest first
+ * @lru_pages:          number of @pages currently on @lru
+ * @lru_entry:          entry in the list of allocators the shrinker walks
+ * @small_free:         freed small buffers by size class, not merged
+ *                      with their neighbours
+ * @small_free_count:   number of buffers on each @small_free list
+ * @buffer_size:        size of address space specified via mmap
+ * @pid:                pid for associated binder_proc (invariant after init)
+ *
+ * Bookkeeping structure for per-proc address space management for binder
+ * buffers. It is normally initialized during binder_init() and binder_mmap()
+ * calls. The address space is used for both user-visible buffers and for
+ * struct binder_buffer objects used to track the user buffers
+ */
+struct binder_alloc {
+	struct mutex mutex;
+	struct vm_area_struct *vma;
+	struct mm_struct *vma_vm_mm;
+	struct work_struct mm_put_work;
+	void *buffer;
+	ptrdiff_t user_buffer_offset;
+	struct list_head buffers;
+	struct rb_root free_buffers;
+	struct rb_root allocated_buffers;
+	size_t free_async_space;
+	struct binder_lru_page *pages;
+	struct list_head lru;
+	int lru_pages;
+	struct list_head lru_entry;
+	struct list_head small_free[BINDER_SMALL_BUF_BINS];
+	int small_free_count[BINDER_SMALL_BUF_BINS];
+	size_t buffer_size;
+	int pid;
+};
+
+extern int binder_alloc_lru_max;
+extern int binder_alloc_small_cache_depth;
+
+#ifdef CONFIG_ANDROID_BINDER_IPC_SELFTEST
+void binder_selftest_alloc(struct binder_alloc *alloc);
+#else
+static inline void binder_selftest_alloc(struct binder_alloc *alloc) {}
+#endif
+
+extern struct binder_buffer *binder_alloc_new_buf(struct binder_alloc *alloc,
+						  size_t data_size,
+						  size_t offsets_size,
+						  size_t extra_buffers_size,
+						  int is_async);
+extern void binder_alloc_init(struct binder_alloc *alloc);
+extern void binder_alloc_shrinker_init(void);
+extern void binder_alloc_trim(struct binder_alloc *alloc, int max_pages);
+extern void binder_alloc_vma_close(struct binder_alloc *alloc);
+extern struct binder_buffer *
+binder_alloc_prepare_to_free(struct binder_alloc *alloc,
+			     uintptr_t user_ptr);
+extern void binder_alloc_free_buf(struct binder_alloc *alloc,
+				  struct binder_buffer *buffer);
+extern int binder_alloc_mmap_handler(struct binder_alloc *alloc,
+				     struct vm_area_struct *vma);
+extern void binder_alloc_deferred_release(struct binder_alloc *alloc);
+extern int binder_alloc_get_allocated_count(struct binder_alloc *alloc);
+extern void binder_alloc_print_allocated(struct seq_file *m,
+					 struct binder_alloc *alloc);
+
+/**
+ * binder_alloc_get_free_async_space() - get free space available for async
+ * @alloc:	binder_alloc for this proc
+ *
+ * Return:	the bytes remaining in the address-space for async transactions
+ */
+static inline size_t
+binder_alloc_get_free_async_space(struct binder_alloc *alloc)
+{
+	size_t free_async_space;
+
+	mutex_lock(&alloc->mutex);
+	free_async_space = alloc->free_async_space;
+	mutex_unlock(&alloc->mutex);
+	return free_async_space;
+}
+
+/**
+ * binder_alloc_get_user_buffer_offset() - get offset between kernel/user addrs
+ * @alloc:	binder_alloc for this proc
+ *
+ * Return:	the offset between kernel and user-space addresses to use for
+ * virtual address conversion
+ */
+static inline ptrdiff_t
+binder_alloc_get_user_buffer_offset(struct binder_alloc *alloc)
+{
+	/*
+	 * user_buffer_offset is constant if vma is set and
+	 * undefined if vma is not set. It is possible to
+	 * get here with !alloc->vma if the target process
+	 * is dying while a transaction is being initiated.
+	 * Returning the old value is ok in this case and
+	 * the transaction will fail.
+	 */
+	return alloc->user_buffer_offset;
+}
+
+#endif /* _LINUX_BINDER_ALLOC_H */
@@ -0,0 +1,256 @@
+/* binder_alloc_selftest.c
+ *
+ * Android IPC Subsystem
+ *
+ * Copyright (C) 2017 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/mm_types.h>
+#include "binder_alloc.h"
+
+#define BUFFER_NUM		5
+#define BENCH_OUTSTANDING	4
+#define BENCH_ITERATIONS	4096
+
+static bool binder_selftest_run = true;
+static int binder_selftest_failures;
+static DEFINE_MUTEX(binder_selftest_lock);
+
+/*
+ * Sizes are kept above the small buffer size classes, so that every free
+ * goes through merging and the page LRU.
+ */
+static const size_t binder_selftest_patterns[][BUFFER_NUM] = {
+	{ 600, 700, PAGE_SIZE, 2 * PAGE_SIZE + 8, 800 },
+	{ 2 * PAGE_SIZE - 100, 3000, PAGE_SIZE + 1, 1000, 4 * PAGE_SIZE },
+	{ PAGE_SIZE - 64, PAGE_SIZE - 64, PAGE_SIZE - 64, PAGE_SIZE - 64,
+	  PAGE_SIZE - 64 },
+};
+
+/* transaction sizes for the latency benchmark, mostly small ones */
+static const size_t binder_selftest_mix[] = {
+	32, 96, 200, 64, 480, 1024, 128, 3000, 256, 8192, 40, 300,
+};
+
+static bool check_buffer_pages_allocated(struct binder_alloc *alloc,
+					 struct binder_buffer *buffer,
+					 size_t size)
+{
+	struct binder_lru_page *page;
+	void *page_addr, *end;
+	bool ret = true;
+
+	mutex_lock(&alloc->mutex);
+	end = (void *)PAGE_ALIGN((uintptr_t)buffer->data + size);
+	for (page_addr = (void *)((uintptr_t)buffer->data & PAGE_MASK);
+	     page_addr < end; page_addr += PAGE_SIZE) {
+		page = &alloc->pages[(page_addr - alloc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr || !list_empty(&page->lru)) {
+			pr_err("%s: page %td of a %zd byte buffer is %s\n",
+			       __func__, page - alloc->pages, size,
+			       page->page_ptr ? "on the lru" : "not allocated");
+			ret = false;
+			break;
+		}
+	}
+	mutex_unlock(&alloc->mutex);
+	return ret;
+}
+
+/*
+ * With all buffers freed, only the first page, which holds the header of
+ * the one free buffer, may still be in use. The others must be on the
+ * LRU or, once it has been trimmed, freed.
+ */
+static bool check_all_pages_unused(struct binder_alloc *alloc, bool trimmed)
+{
+	struct binder_lru_page *page;
+	bool ret = true;
+	size_t i;
+
+	mutex_lock(&alloc->mutex);
+	for (i = 1; i < alloc->buffer_size / PAGE_SIZE; i++) {
+		page = &alloc->pages[i];
+		if (page->page_ptr && (trimmed || list_empty(&page->lru))) {
+			pr_err("%s: page %zu is %s\n", __func__, i,
+			       list_empty(&page->lru) ? "still in use" :
+			       "still on the lru");
+			ret = false;
+			break;
+		}
+	}
+	mutex_unlock(&alloc->mutex);
+	return ret;
+}
+
+static struct binder_buffer *binder_selftest_new_buf(struct binder_alloc *alloc,
+						     size_t size)
+{
+	struct binder_buffer *buffer;
+
+	buffer = binder_alloc_new_buf(alloc, size, 0, 0, 0);
+	/* binder_transaction() would attach the transaction here */
+	if (buffer)
+		buffer->transaction = NULL;
+	return buffer;
+}
+
+static void binder_selftest_alloc_free(struct binder_alloc *alloc,
+				       const size_t *sizes,
+				       const int *free_order)
+{
+	struct binder_buffer *buffers[BUFFER_NUM] = { NULL };
+	int i;
+
+	for (i = 0; i < BUFFER_NUM; i++) {
+		buffers[i] = binder_selftest_new_buf(alloc, sizes[i]);
+		if (!buffers[i] ||
+		    !check_buffer_pages_allocated(alloc, buffers[i],
+						  sizes[i])) {
+			pr_err("%s: allocation %d of %zd bytes failed\n",
+			       __func__, i, sizes[i]);
+			binder_selftest_failures++;
+			break;
+		}
+	}
+	for (i = 0; i < BUFFER_NUM; i++) {
+		if (buffers[free_order[i]])
+			binder_alloc_free_buf(alloc, buffers[free_order[i]]);
+	}
+	if (!check_all_pages_unused(alloc, false))
+		binder_selftest_failures++;
+}
+
+/* run binder_selftest_alloc_free() for every permutation of free_order */
+static void binder_selftest_free_orders(struct binder_alloc *alloc,
+					const size_t *sizes, int *free_order,
+					int depth, unsigned int used)
+{
+	int i;
+
+	if (depth == BUFFER_NUM) {
+		binder_selftest_alloc_free(alloc, sizes, free_order);
+		return;
+	}
+	for (i = 0; i < BUFFER_NUM; i++) {
+		if (used & BIT(i))
+			continue;
+		free_order[depth] = i;
+		binder_selftest_free_orders(alloc, sizes, free_order,
+					    depth + 1, used | BIT(i));
+	}
+}
+
+/*
+ * Keep BENCH_OUTSTANDING buffers of mixed sizes in flight, like a proc
+ * receiving transactions it frees shortly after, and return the average
+ * time to free the oldest buffer and allocate a new one.
+ */
+static u64 binder_selftest_bench(struct binder_alloc *alloc)
+{
+	struct binder_buffer *ring[BENCH_OUTSTANDING] = { NULL };
+	ktime_t start;
+	u64 elapsed;
+	int i, slot;
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		slot = i % BENCH_OUTSTANDING;
+		if (ring[slot])
+			binder_alloc_free_buf(alloc, ring[slot]);
+		ring[slot] = binder_selftest_new_buf(alloc,
+			binder_selftest_mix[i % ARRAY_SIZE(binder_selftest_mix)]);
+		if (!ring[slot]) {
+			pr_err("%s: allocation %d failed\n", __func__, i);
+			binder_selftest_failures++;
+			break;
+		}
+	}
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+	for (slot = 0; slot < BENCH_OUTSTANDING; slot++) {
+		if (ring[slot])
+			binder_alloc_free_buf(alloc, ring[slot]);
+	}
+	return i ? div_u64(elapsed, i) : 0;
+}
+
+static bool binder_selftest_alloc_is_empty(struct binder_alloc *alloc)
+{
+	bool empty;
+
+	mutex_lock(&alloc->mutex);
+	empty = RB_EMPTY_ROOT(&alloc->allocated_buffers) &&
+		list_is_singular(&alloc->buffers);
+	mutex_unlock(&alloc->mutex);
+	return empty;
+}
+
+/**
+ * binder_selftest_alloc() - Test alloc and free of buffer pages.
+ * @alloc: Pointer to alloc struct.
+ *
+ * Allocate BUFFER_NUM buffers to cover all page alignment cases, then
+ * free them in all orders possible. Check that pages are correctly
+ * allocated, put onto the lru when buffers are freed, and freed when the
+ * lru is trimmed. Then compare the latency of a mixed-size transaction
+ * load with the small buffer and page caches disabled and enabled.
+ *
+ * The caches are disabled for all procs while the benchmark runs.
+ */
+void binder_selftest_alloc(struct binder_alloc *alloc)
+{
+	int free_order[BUFFER_NUM];
+	int lru_max, cache_depth;
+	u64 uncached, cached;
+	size_t i;
+
+	if (!binder_selftest_run)
+		return;
+	mutex_lock(&binder_selftest_lock);
+	if (!binder_selftest_run || !ACCESS_ONCE(alloc->vma) ||
+	    !binder_selftest_alloc_is_empty(alloc))
+		goto done;
+	pr_info("STARTED\n");
+
+	for (i = 0; i < ARRAY_SIZE(binder_selftest_patterns); i++) {
+		binder_selftest_free_orders(alloc, binder_selftest_patterns[i],
+					    free_order, 0, 0);
+		binder_alloc_trim(alloc, 0);
+		if (!check_all_pages_unused(alloc, true))
+			binder_selftest_failures++;
+	}
+
+	lru_max = binder_alloc_lru_max;
+	cache_depth = binder_alloc_small_cache_depth;
+	binder_alloc_lru_max = 0;
+	binder_alloc_small_cache_depth = 0;
+	uncached = binder_selftest_bench(alloc);
+	binder_alloc_lru_max = lru_max;
+	binder_alloc_small_cache_depth = cache_depth;
+	cached = binder_selftest_bench(alloc);
+	pr_info("mixed-size alloc+free: %llu ns uncached, %llu ns cached\n",
+		uncached, cached);
+
+	if (binder_selftest_failures > 0)
+		pr_info("%d tests FAILED\n", binder_selftest_failures);
+	else
+		pr_info("PASSED\n");
+	binder_selftest_run = false;
+
+done:
+	mutex_unlock(&binder_selftest_lock);
+}
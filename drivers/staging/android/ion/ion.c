@@ -1188,12 +1188,59 @@ struct ion_vma_list {
 	struct vm_area_struct *vma;
 };
 
+/*
+ * Cleans the dirty pages of a fault mapped buffer in [start, end) and unmaps
+ * them from userspace so that the next cpu access faults and marks them dirty
+ * again. Only the dirty range is walked. Caller holds buffer->lock.
+ */
+static void ion_buffer_sync_dirty_range(struct ion_buffer *buffer,
+					struct device *dev,
+					enum dma_data_direction dir,
+					unsigned long start, unsigned long end)
+{
+	struct ion_vma_list *vma_list;
+	unsigned long i;
+
+	start = max(start, buffer->dirty_start);
+	end = min(end, buffer->dirty_end);
+	if (start >= end)
+		return;
+
+	for (i = start; i < end; i++) {
+		struct page *page = buffer->pages[i];
+
+		if (ion_buffer_page_is_dirty(page))
+			ion_pages_sync_for_device(dev, ion_buffer_page(page),
+							PAGE_SIZE, dir);
+
+		ion_buffer_page_clean(buffer->pages + i);
+	}
+
+	list_for_each_entry(vma_list, &buffer->vmas, list) {
+		struct vm_area_struct *vma = vma_list->vma;
+		unsigned long vstart = vma->vm_pgoff;
+		unsigned long vend = vstart + vma_pages(vma);
+		unsigned long zstart = max(start, vstart);
+		unsigned long zend = min(end, vend);
+
+		if (zstart >= zend)
+			continue;
+
+		zap_page_range(vma,
+			       vma->vm_start + ((zstart - vstart) << PAGE_SHIFT),
+			       (zend - zstart) << PAGE_SHIFT, NULL);
+	}
+
+	if (start == buffer->dirty_start)
+		buffer->dirty_start = end;
+	else if (end == buffer->dirty_end)
+		buffer->dirty_end = start;
+}
+
 static void ion_buffer_sync_for_device(struct ion_buffer *buffer,
 				       struct device *dev,
 				       enum dma_data_direction dir)
 {
-	int i;
-	struct ion_vma_list *vma_list;
 	int pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
 
 	ion_buffer_make_ready_lock(buffer);
@@ -1208,21 +1255,7 @@ static void ion_buffer_sync_for_device(struct ion_buffer *buffer,
 		return;
 
 	mutex_lock(&buffer->lock);
-	for (i = 0; i < pages; i++) {
-		struct page *page = buffer->pages[i];
-
-		if (ion_buffer_page_is_dirty(page))
-			ion_pages_sync_for_device(dev, ion_buffer_page(page),
-							PAGE_SIZE, dir);
-
-		ion_buffer_page_clean(buffer->pages + i);
-	}
-	list_for_each_entry(vma_list, &buffer->vmas, list) {
-		struct vm_area_struct *vma = vma_list->vma;
-
-		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
-			       NULL);
-	}
+	ion_buffer_sync_dirty_range(buffer, dev, dir, 0, pages);
 	mutex_unlock(&buffer->lock);
 }
 
@@ -1236,6 +1269,15 @@ static int ion_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	ion_buffer_page_dirty(buffer->pages + vmf->pgoff);
 	BUG_ON(!buffer->pages || !buffer->pages[vmf->pgoff]);
 
+	if (buffer->dirty_start >= buffer->dirty_end) {
+		buffer->dirty_start = vmf->pgoff;
+		buffer->dirty_end = vmf->pgoff + 1;
+	} else if (vmf->pgoff < buffer->dirty_start) {
+		buffer->dirty_start = vmf->pgoff;
+	} else if (vmf->pgoff >= buffer->dirty_end) {
+		buffer->dirty_end = vmf->pgoff + 1;
+	}
+
 	pfn = page_to_pfn(ion_buffer_page(buffer->pages[vmf->pgoff]));
 	ret = vm_insert_pfn(vma, (unsigned long)vmf->virtual_address, pfn);
 	mutex_unlock(&buffer->lock);
@@ -1558,6 +1600,86 @@ static int ion_sync_for_device(struct ion_client *client, int fd)
 	return 0;
 }
 
+/* syncs the pages of the sg table that cover [offset, offset + len) */
+static void ion_buffer_sync_sg_range(struct ion_buffer *buffer,
+				     unsigned long offset, unsigned long len,
+				     enum dma_data_direction dir)
+{
+	struct sg_table *table = buffer->sg_table;
+	struct scatterlist *sg;
+	unsigned long pos = 0, end = offset + len;
+	int i;
+
+	for_each_sg(table->sgl, sg, table->nents, i) {
+		unsigned long sg_end = pos + sg->length;
+
+		if (sg_end > offset) {
+			unsigned long from = sg->offset + max(offset, pos) - pos;
+			unsigned long to = sg->offset + min(end, sg_end) - pos;
+
+			from &= PAGE_MASK;
+			ion_pages_sync_for_device(NULL,
+					nth_page(sg_page(sg), from >> PAGE_SHIFT),
+					PAGE_ALIGN(to) - from, dir);
+		}
+
+		pos = sg_end;
+		if (pos >= end)
+			break;
+	}
+}
+
+static int ion_sync_partial_for_device(struct ion_client *client, int fd,
+				       u64 offset, u64 len)
+{
+	struct dma_buf *dmabuf;
+	struct ion_buffer *buffer;
+	int ret = 0;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	/* if this memory came from ion */
+	if (dmabuf->ops != &dma_buf_ops) {
+		pr_err("%s: can not sync dmabuf from another exporter\n",
+		       __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+	buffer = dmabuf->priv;
+
+	if (!len || offset >= buffer->size || len > buffer->size - offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!ion_buffer_cached(buffer))
+		goto out;
+
+	trace_ion_sync_start(_RET_IP_, buffer->dev->dev.this_device,
+				DMA_BIDIRECTIONAL, len,
+				buffer->vaddr, offset, false);
+
+	if (ion_buffer_fault_user_mappings(buffer)) {
+		mutex_lock(&buffer->lock);
+		ion_buffer_sync_dirty_range(buffer, NULL, DMA_BIDIRECTIONAL,
+				offset >> PAGE_SHIFT,
+				PAGE_ALIGN(offset + len) >> PAGE_SHIFT);
+		mutex_unlock(&buffer->lock);
+	} else {
+		ion_buffer_sync_sg_range(buffer, offset, len,
+					 DMA_BIDIRECTIONAL);
+	}
+
+	trace_ion_sync_end(_RET_IP_, buffer->dev->dev.this_device,
+				DMA_BIDIRECTIONAL, len,
+				buffer->vaddr, offset, false);
+out:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
 static long ion_alloc_preload(struct ion_client *client,
 				unsigned int heap_id_mask,
 				unsigned int flags,
@@ -1633,6 +1755,7 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	union {
 		struct ion_fd_data fd;
+		struct ion_fd_partial_data fd_partial;
 		struct ion_allocation_data allocation;
 		struct ion_handle_data handle;
 		struct ion_custom_data custom;
@@ -1706,6 +1829,13 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		ret = ion_sync_for_device(client, data.fd.fd);
 		break;
 	}
+	case ION_IOC_SYNC_PARTIAL:
+	{
+		ret = ion_sync_partial_for_device(client, data.fd_partial.fd,
+						  data.fd_partial.offset,
+						  data.fd_partial.len);
+		break;
+	}
 	case ION_IOC_CUSTOM:
 	{
 		if (!dev->custom_ioctl)
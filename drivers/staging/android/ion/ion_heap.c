@@ -245,6 +245,15 @@ size_t ion_heap_freelist_shrink(struct ion_heap *heap, size_t size)
 	return _ion_heap_freelist_drain(heap, size, true);
 }
 
+void ion_heap_refill_kick(struct ion_heap *heap)
+{
+	if (!heap->ops->refill || !(heap->flags & ION_HEAP_FLAG_DEFER_FREE))
+		return;
+
+	if (!atomic_xchg(&heap->refill_pending, 1))
+		wake_up(&heap->waitqueue);
+}
+
 static int ion_heap_deferred_free(void *data)
 {
 	struct ion_heap *heap = data;
@@ -253,11 +262,15 @@ static int ion_heap_deferred_free(void *data)
 		struct ion_buffer *buffer;
 
 		wait_event_freezable(heap->waitqueue,
-				     ion_heap_freelist_size(heap) > 0);
+				     ion_heap_freelist_size(heap) > 0 ||
+				     atomic_read(&heap->refill_pending));
 
 		spin_lock(&heap->free_lock);
 		if (list_empty(&heap->free_list)) {
 			spin_unlock(&heap->free_lock);
+			/* freeing goes first, it refills the pools as well */
+			if (atomic_xchg(&heap->refill_pending, 0))
+				heap->ops->refill(heap);
 			continue;
 		}
 		buffer = list_first_entry(&heap->free_list, struct ion_buffer,
@@ -279,6 +292,7 @@ int ion_heap_init_deferred_free(struct ion_heap *heap)
 	heap->free_list_size = 0;
 	spin_lock_init(&heap->free_lock);
 	init_waitqueue_head(&heap->waitqueue);
+	atomic_set(&heap->refill_pending, 0);
 	heap->task = kthread_run(ion_heap_deferred_free, heap,
 				 "%s", heap->name);
 	sched_setscheduler(heap->task, SCHED_IDLE, &param);
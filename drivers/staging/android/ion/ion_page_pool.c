@@ -20,10 +20,32 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/swap.h>
 #include "ion_priv.h"
 
+/*
+ * Each pool is fronted by a small per-cpu magazine of pages so that the
+ * page-by-page allocation and free loops of the heaps do not bounce
+ * pool->mutex between cpus. A magazine is refilled from and drained to
+ * the shared lists in batches of about half its size. The magazine lock
+ * is only ever taken by its own cpu, except when the shrinker drains all
+ * magazines, so it is uncontended in the common case.
+ * Magazines are sized to hold at most ION_PAGE_POOL_MAG_BYTES per cpu, so
+ * the pools of the highest orders run without a magazine.
+ */
+#define ION_PAGE_POOL_MAG_SIZE	16
+#define ION_PAGE_POOL_MAG_BYTES	(64 * 1024)
+#define ION_PAGE_POOL_MAG_BATCH	(ION_PAGE_POOL_MAG_SIZE / 2 + 1)
+
+struct ion_page_pool_mag {
+	spinlock_t lock;
+	int count;
+	struct page *pages[ION_PAGE_POOL_MAG_SIZE];
+};
+
 void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
 {
 	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
@@ -45,6 +67,17 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
+static void __ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+{
+	if (PageHighMem(page)) {
+		list_add_tail(&page->lru, &pool->high_items);
+		pool->high_count++;
+	} else {
+		list_add_tail(&page->lru, &pool->low_items);
+		pool->low_count++;
+	}
+}
+
 static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 {
 #ifdef CONFIG_DEBUG_LIST
@@ -55,17 +88,23 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 		ion_clear_page_clean(page);
 
 	mutex_lock(&pool->mutex);
-	if (PageHighMem(page)) {
-		list_add_tail(&page->lru, &pool->high_items);
-		pool->high_count++;
-	} else {
-		list_add_tail(&page->lru, &pool->low_items);
-		pool->low_count++;
-	}
+	__ion_page_pool_add(pool, page);
 	mutex_unlock(&pool->mutex);
 	return 0;
 }
 
+/* pages must already be prepared by ion_page_pool_mag_push() */
+static void ion_page_pool_add_batch(struct ion_page_pool *pool,
+				    struct page **pages, int nr)
+{
+	int i;
+
+	mutex_lock(&pool->mutex);
+	for (i = 0; i < nr; i++)
+		__ion_page_pool_add(pool, pages[i]);
+	mutex_unlock(&pool->mutex);
+}
+
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 {
 	struct page *page;
@@ -84,12 +123,144 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	return page;
 }
 
+static struct page *ion_page_pool_mag_pop(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_mag *mag;
+	struct page *page = NULL;
+
+	mag = get_cpu_ptr(pool->mags);
+	spin_lock(&mag->lock);
+	if (mag->count)
+		page = mag->pages[--mag->count];
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(pool->mags);
+
+	return page;
+}
+
+static void ion_page_pool_mag_push(struct ion_page_pool *pool,
+				   struct page *page)
+{
+	struct ion_page_pool_mag *mag;
+	struct page *batch[ION_PAGE_POOL_MAG_BATCH];
+	int nr = 0;
+
+#ifdef CONFIG_DEBUG_LIST
+	BUG_ON(page->lru.next != LIST_POISON1 ||
+			page->lru.prev != LIST_POISON2);
+#endif
+	if (pool->cached)
+		ion_clear_page_clean(page);
+
+	mag = get_cpu_ptr(pool->mags);
+	spin_lock(&mag->lock);
+	if (mag->count == pool->mag_size) {
+		/* spill the older half so that the next frees stay local */
+		nr = min_t(int, pool->mag_size / 2 + 1, ARRAY_SIZE(batch));
+		memcpy(batch, mag->pages, sizeof(batch[0]) * nr);
+		mag->count -= nr;
+		memmove(mag->pages, mag->pages + nr,
+			sizeof(mag->pages[0]) * mag->count);
+	}
+	mag->pages[mag->count++] = page;
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(pool->mags);
+
+	if (nr)
+		ion_page_pool_add_batch(pool, batch, nr);
+}
+
+/*
+ * Takes a batch of pages from the shared lists under a single mutex hold,
+ * returns one of them and stashes the rest in the local magazine.
+ */
+static struct page *ion_page_pool_mag_refill(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_mag *mag;
+	struct page *batch[ION_PAGE_POOL_MAG_BATCH];
+	struct page *page;
+	int max = min_t(int, pool->mag_size / 2 + 1, ARRAY_SIZE(batch));
+	int nr = 0;
+
+	mutex_lock(&pool->mutex);
+	while (nr < max) {
+		if (pool->high_count)
+			batch[nr++] = ion_page_pool_remove(pool, true);
+		else if (pool->low_count)
+			batch[nr++] = ion_page_pool_remove(pool, false);
+		else
+			break;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!nr)
+		return NULL;
+
+	page = batch[--nr];
+
+	mag = get_cpu_ptr(pool->mags);
+	spin_lock(&mag->lock);
+	while (nr && mag->count < pool->mag_size)
+		mag->pages[mag->count++] = batch[--nr];
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(pool->mags);
+
+	/* the magazine was refilled by a free on this cpu meanwhile */
+	if (nr)
+		ion_page_pool_add_batch(pool, batch, nr);
+
+	return page;
+}
+
+static void ion_page_pool_drain_mags(struct ion_page_pool *pool)
+{
+	int cpu;
+
+	if (!pool->mags)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_mag *mag = per_cpu_ptr(pool->mags, cpu);
+		struct page *pages[ION_PAGE_POOL_MAG_SIZE];
+		int nr;
+
+		spin_lock(&mag->lock);
+		nr = mag->count;
+		memcpy(pages, mag->pages, sizeof(pages[0]) * nr);
+		mag->count = 0;
+		spin_unlock(&mag->lock);
+
+		if (nr)
+			ion_page_pool_add_batch(pool, pages, nr);
+	}
+}
+
+int ion_page_pool_mag_count(struct ion_page_pool *pool)
+{
+	int cpu, count = 0;
+
+	if (!pool->mags)
+		return 0;
+
+	for_each_possible_cpu(cpu)
+		count += ACCESS_ONCE(per_cpu_ptr(pool->mags, cpu)->count);
+
+	return count;
+}
+
 struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
 	struct page *page = NULL;
 
 	BUG_ON(!pool);
 
+	if (pool->mags) {
+		page = ion_page_pool_mag_pop(pool);
+		if (!page)
+			page = ion_page_pool_mag_refill(pool);
+		return page;
+	}
+
 	mutex_lock(&pool->mutex);
 	if (pool->high_count)
 		page = ion_page_pool_remove(pool, true);
@@ -106,6 +277,11 @@ void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
 
 	BUG_ON(pool->order != compound_order(page));
 
+	if (pool->mags) {
+		ion_page_pool_mag_push(pool, page);
+		return;
+	}
+
 	ret = ion_page_pool_add(pool, page);
 	if (ret)
 		ion_page_pool_free_pages(pool, page);
@@ -113,7 +289,7 @@ void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
 
 static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
-	int count = pool->low_count;
+	int count = pool->low_count + ion_page_pool_mag_count(pool);
 
 	if (high)
 		count += pool->high_count;
@@ -176,11 +352,14 @@ err_vm_map:
  */
 void ion_page_pool_preload_prepare(struct ion_page_pool *pool, long num_pages)
 {
-	long pages_in_pool = pool->high_count + pool->low_count;
+	long pages_in_pool;
 	long freed = 0;
 
 	BUG_ON(pool->order != 0);
 
+	ion_page_pool_drain_mags(pool);
+	pages_in_pool = pool->high_count + pool->low_count;
+
 	while (pages_in_pool-- > num_pages) {
 		struct page *page;
 		mutex_lock(&pool->mutex);
@@ -212,7 +391,8 @@ long ion_page_pool_preload(struct ion_page_pool *pool,
 	 * of pages to preload currently, this function just tries that the pool
 	 * has enough pages for the preload request.
 	 */
-	pages_required = num_pages - (pool->high_count + pool->low_count);
+	pages_required = num_pages - (pool->high_count + pool->low_count +
+				      ion_page_pool_mag_count(pool));
 	pr_info("%s: order %d pages requested - %ld, to preload - %ld\n",
 		__func__, pool->order, num_pages, pages_required);
 	if (pages_required <= 0)
@@ -284,6 +464,41 @@ long ion_page_pool_preload(struct ion_page_pool *pool,
 	return num_pages - pages_required;
 }
 
+int ion_page_pool_count(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count +
+		ion_page_pool_mag_count(pool);
+}
+
+/*
+ * Adds one page to the pool that is zeroed and, for noncached pools, clean
+ * in the cache, so the allocating thread finds it ready for use. Never
+ * enters reclaim or dips into the reserves. Returns false if no page could
+ * be allocated.
+ */
+bool ion_page_pool_refill(struct ion_page_pool *pool)
+{
+	gfp_t gfp_mask = (pool->gfp_mask | __GFP_NORETRY | __GFP_NOWARN |
+			  __GFP_NO_KSWAPD | __GFP_NOMEMALLOC) & ~__GFP_WAIT;
+	struct page *page;
+
+	page = alloc_pages(gfp_mask, pool->order);
+	if (!page)
+		return false;
+
+	if (!__init_pages_for_preload(page, pool->order,
+			!(gfp_mask & __GFP_ZERO), !pool->cached)) {
+		ion_page_pool_free_pages(pool, page);
+		return false;
+	}
+
+	if (!pool->cached)
+		ion_set_page_clean(page);
+
+	ion_page_pool_add(pool, page);
+	return true;
+}
+
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 				int nr_to_scan)
 {
@@ -295,6 +510,9 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	else
 		high = !!(gfp_mask & __GFP_HIGHMEM);
 
+	if (nr_to_scan > 0)
+		ion_page_pool_drain_mags(pool);
+
 	for (i = 0; i < nr_to_scan; i += (1 << pool->order)) {
 		struct page *page;
 
@@ -328,12 +546,42 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 	pool->order = order;
 	mutex_init(&pool->mutex);
 	plist_node_init(&pool->list, order);
+	atomic_long_set(&pool->hits, 0);
+	atomic_long_set(&pool->misses, 0);
+
+	pool->mag_size = min_t(int, ION_PAGE_POOL_MAG_SIZE,
+			(ION_PAGE_POOL_MAG_BYTES >> PAGE_SHIFT) >> order);
+	pool->mags = NULL;
+	if (pool->mag_size) {
+		int cpu;
+
+		pool->mags = alloc_percpu(struct ion_page_pool_mag);
+		if (!pool->mags) {
+			kfree(pool);
+			return NULL;
+		}
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(pool->mags, cpu)->lock);
+	}
 
 	return pool;
 }
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	int cpu;
+
+	if (pool->mags) {
+		for_each_possible_cpu(cpu) {
+			struct ion_page_pool_mag *mag =
+					per_cpu_ptr(pool->mags, cpu);
+
+			while (mag->count)
+				ion_page_pool_free_pages(pool,
+						mag->pages[--mag->count]);
+		}
+		free_percpu(pool->mags);
+	}
 	kfree(pool);
 }
 
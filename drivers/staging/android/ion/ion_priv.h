@@ -65,6 +65,8 @@ struct ion_iovm_map {
  * @sg_table:		the sg table for the buffer if dmap_cnt is not zero
  * @pages:		flat array of pages in the buffer -- used by fault
  *			handler and only valid for buffers that are faulted in
+ * @dirty_start:	first page of the range holding all dirty @pages
+ * @dirty_end:		page after the dirty range, empty if <= @dirty_start
  * @vmas:		list of vma's mapping this buffer
  * @handle_count:	count of handles referencing this buffer
  * @task_comm:		taskcomm of last client to reference this buffer in a
@@ -93,6 +95,8 @@ struct ion_buffer {
 	int dmap_cnt;
 	struct sg_table *sg_table;
 	struct page **pages;
+	unsigned long dirty_start;
+	unsigned long dirty_end;
 	struct list_head vmas;
 	struct list_head iovas;
 	/* used to track orphaned buffers */
@@ -128,6 +132,8 @@ void ion_buffer_destroy(struct ion_buffer *buffer);
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
+ * @refill		top up heap caches from the deferred free thread when
+ *			it is otherwise idle (optional)
  *
  * allocate, phys, and map_user return 0 on success, -errno on error.
  * map_dma and map_kernel return pointer on success, ERR_PTR on
@@ -153,6 +159,7 @@ struct ion_heap_ops {
 	int (*shrink)(struct ion_heap *heap, gfp_t gfp_mask, int nr_to_scan);
 	void (*preload) (struct ion_heap *heap, unsigned int count,
 			 unsigned int flags, struct ion_preload_object obj[]);
+	void (*refill)(struct ion_heap *heap);
 };
 
 /* [INTERNAL USE ONLY] threshold value for whole cache flush */
@@ -198,6 +205,7 @@ struct ion_heap_ops {
  * @lock:		protects the free list
  * @waitqueue:		queue to wait on from deferred free thread
  * @task:		task struct of deferred free thread
+ * @refill_pending:	the deferred free thread should call ops->refill
  * @vm_sem:		semaphore for reserved_vm_area
  * @page_idx:		index of reserved_vm_area slots
  * @reserved_vm_area:	reserved vm area
@@ -224,6 +232,7 @@ struct ion_heap {
 	spinlock_t free_lock;
 	wait_queue_head_t waitqueue;
 	struct task_struct *task;
+	atomic_t refill_pending;
 
 	int (*debug_show)(struct ion_heap *heap, struct seq_file *, void *);
 };
@@ -373,6 +382,15 @@ size_t ion_heap_freelist_shrink(struct ion_heap *heap,
  */
 size_t ion_heap_freelist_size(struct ion_heap *heap);
 
+/**
+ * ion_heap_refill_kick - ask the deferred free thread to refill the heap
+ * @heap:		the heap
+ *
+ * The heap's refill op is called from the deferred free thread once the
+ * free list is empty. Does nothing for heaps without a refill op or
+ * without deferred free.
+ */
+void ion_heap_refill_kick(struct ion_heap *heap);
 
 /**
  * functions for creating and destroying the built in ion heaps.
@@ -480,6 +498,11 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  *			item list
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
+ * @cached:		true if the pool holds pages for cached buffers
+ * @mag_size:		capacity of each per-cpu magazine, 0 if disabled
+ * @mags:		per-cpu magazines of pages in front of the lists
+ * @hits:		allocations served from the pool
+ * @misses:		allocations that fell back to the page allocator
  * @list:		plist node for list of pools
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
@@ -496,6 +519,10 @@ struct ion_page_pool {
 	gfp_t gfp_mask;
 	unsigned int order;
 	bool cached;
+	int mag_size;
+	struct ion_page_pool_mag __percpu *mags;
+	atomic_long_t hits;
+	atomic_long_t misses;
 	struct plist_node list;
 };
 
@@ -504,6 +531,9 @@ void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc_pages(struct ion_page_pool *pool);
 struct page *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_mag_count(struct ion_page_pool *pool);
+int ion_page_pool_count(struct ion_page_pool *pool);
+bool ion_page_pool_refill(struct ion_page_pool *pool);
 
 /** ion_page_pool_shrink - shrinks the size of the memory cached in the pool
  * @pool:		the pool
@@ -20,6 +20,7 @@
 #include <linux/err.h>
 #include <linux/highmem.h>
 #include <linux/mm.h>
+#include <linux/module.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -57,9 +58,23 @@ static inline unsigned int order_to_size(int order)
 	return PAGE_SIZE << order;
 }
 
+/*
+ * The deferred free thread keeps the pools topped up with pages that are
+ * already zeroed and cache clean, so that allocations do not have to do it
+ * on the allocating thread. This is the budget for the whole heap in KB; it
+ * is split evenly across the pools and a pool whose share is smaller than
+ * one of its chunks is not refilled. 0 disables the refill.
+ */
+static unsigned int pool_refill_kb = 1024;
+module_param(pool_refill_kb, uint, S_IRUGO | S_IWUSR);
+
+/* refilling is paused for this long after the shrinker has run */
+#define ION_SYSTEM_HEAP_REFILL_BACKOFF	(2 * HZ)
+
 struct ion_system_heap {
 	struct ion_heap heap;
 	struct ion_page_pool **pools;
+	unsigned long last_shrink;
 };
 
 static struct page *alloc_buffer_page(struct ion_system_heap *heap,
@@ -67,7 +82,7 @@ static struct page *alloc_buffer_page(struct ion_system_heap *heap,
 				      unsigned long order)
 {
 	int idx = order_to_index(order);
-	struct ion_page_pool *pool;
+	struct ion_page_pool *pool, *alt_pool;
 	struct page *page;
 
 	if (!ion_buffer_cached(buffer))
@@ -76,20 +91,26 @@ static struct page *alloc_buffer_page(struct ion_system_heap *heap,
 	pool = heap->pools[idx];
 
 	page = ion_page_pool_alloc(pool);
-	if (!page) {
-		/* try with alternative pool */
-		if (ion_buffer_cached(buffer))
-			pool = heap->pools[idx + num_orders];
-		else
-			pool = heap->pools[idx - num_orders];
-
-		page = ion_page_pool_alloc(pool);
+	if (page) {
+		atomic_long_inc(&pool->hits);
+		return page;
 	}
 
-	if (!page)
-		page = ion_page_pool_alloc_pages(pool);
+	/* try with alternative pool */
+	if (ion_buffer_cached(buffer))
+		alt_pool = heap->pools[idx + num_orders];
+	else
+		alt_pool = heap->pools[idx - num_orders];
 
-	return page;
+	page = ion_page_pool_alloc(alt_pool);
+	if (page) {
+		atomic_long_inc(&alt_pool->hits);
+		return page;
+	}
+
+	/* only now does the page allocator have to serve it */
+	atomic_long_inc(&pool->misses);
+	return ion_page_pool_alloc_pages(alt_pool);
 }
 
 static void free_buffer_page(struct ion_system_heap *heap,
@@ -198,6 +219,8 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 		ion_buffer_set_ready(buffer);
 
 	buffer->priv_virt = table;
+	if (pool_refill_kb)
+		ion_heap_refill_kick(heap);
 	return 0;
 
 free_table:
@@ -413,6 +436,9 @@ static int ion_system_heap_shrink(struct ion_heap *heap, gfp_t gfp_mask,
 
 	sys_heap = container_of(heap, struct ion_system_heap, heap);
 
+	if (nr_to_scan > 0)
+		sys_heap->last_shrink = jiffies;
+
 	/* cached pools first, low order pages first */
 	for (nocached = 0; nocached < 2; nocached++) {
 		for (i = 0; i < num_orders; i++) {
@@ -433,6 +459,37 @@ static int ion_system_heap_shrink(struct ion_heap *heap, gfp_t gfp_mask,
 	return nr_total;
 }
 
+static void ion_system_heap_refill(struct ion_heap *heap)
+{
+	struct ion_system_heap *sys_heap;
+	unsigned long share;
+	int i;
+
+	sys_heap = container_of(heap, struct ion_system_heap, heap);
+	share = ((unsigned long)pool_refill_kb << 10) / (num_orders * 2);
+
+	for (i = 0; i < num_orders * 2; i++) {
+		struct ion_page_pool *pool = sys_heap->pools[i];
+		int target = share >> (PAGE_SHIFT + pool->order);
+
+		while (ion_page_pool_count(pool) < target) {
+			/* back off while the shrinker is taking pages away */
+			if (time_before(jiffies,
+					ACCESS_ONCE(sys_heap->last_shrink) +
+					ION_SYSTEM_HEAP_REFILL_BACKOFF))
+				return;
+			/* let the thread free buffers first and come back */
+			if (ion_heap_freelist_size(heap) > 0) {
+				ion_heap_refill_kick(heap);
+				return;
+			}
+			if (!ion_page_pool_refill(pool))
+				return;
+			cond_resched();
+		}
+	}
+}
+
 static struct ion_heap_ops system_heap_ops = {
 	.allocate = ion_system_heap_allocate,
 	.free = ion_system_heap_free,
@@ -443,6 +500,7 @@ static struct ion_heap_ops system_heap_ops = {
 	.map_user = ion_heap_map_user,
 	.shrink = ion_system_heap_shrink,
 	.preload = ion_system_heap_preload_allocate,
+	.refill = ion_system_heap_refill,
 };
 
 static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
@@ -463,6 +521,13 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in cached pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (PAGE_SIZE << pool->order) * pool->low_count);
+		seq_printf(s, "%d order %u pages in cached per-cpu magazines = %lu total\n",
+			   ion_page_pool_mag_count(pool), pool->order,
+			   (PAGE_SIZE << pool->order) *
+			   ion_page_pool_mag_count(pool));
+		seq_printf(s, "order %u cached pool: %ld hits, %ld misses\n",
+			   pool->order, atomic_long_read(&pool->hits),
+			   atomic_long_read(&pool->misses));
 	}
 
 	for (i = num_orders; i < (num_orders * 2); i++) {
@@ -474,6 +539,13 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in uncached pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (PAGE_SIZE << pool->order) * pool->low_count);
+		seq_printf(s, "%d order %u pages in uncached per-cpu magazines = %lu total\n",
+			   ion_page_pool_mag_count(pool), pool->order,
+			   (PAGE_SIZE << pool->order) *
+			   ion_page_pool_mag_count(pool));
+		seq_printf(s, "order %u uncached pool: %ld hits, %ld misses\n",
+			   pool->order, atomic_long_read(&pool->hits),
+			   atomic_long_read(&pool->misses));
 	}
 
 	return 0;
@@ -490,6 +562,7 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 	heap->heap.ops = &system_heap_ops;
 	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
 	heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
+	heap->last_shrink = jiffies - ION_SYSTEM_HEAP_REFILL_BACKOFF;
 	heap->pools = kzalloc(sizeof(struct ion_page_pool *) * num_orders * 2,
 			      GFP_KERNEL);
 	if (!heap->pools)
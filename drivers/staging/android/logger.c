@@ -30,6 +30,7 @@
 #include <linux/time.h>
 #include <linux/vmalloc.h>
 #include <linux/aio.h>
+#include <linux/percpu.h>
 #include <linux/exynos-ss.h>
 #include "logger.h"
 
@@ -40,27 +41,42 @@
  * @buffer:	The actual ring buffer
  * @misc:	The "misc" device representing the log
  * @wq:		The wait queue for @readers
+ * @batch_wq:	The wait queue for @readers that set a poll threshold
  * @readers:	This log's readers
- * @mutex:	The mutex that protects the @buffer
- * @w_off:	The current write head offset
- * @head:	The head, or location that readers start reading at.
+ * @mutex:	The mutex that serializes the readers
+ * @w_off:	The write head offset, up to which writers have reserved space
+ * @c_off:	The commit offset, up to which entries are complete
+ * @head:	The head, or oldest entry that writers have not overwritten.
+ *		This is where new readers start reading.
+ * @wake_off:	The offset at which @batch_wq needs waking
  * @size:	The size of the log
  * @logs:	The list of log channels
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers do not take a lock. @w_off, @c_off and @head only ever grow and
+ * are reduced to a position in @buffer with logger_offset(). A writer
+ * reserves space by moving @w_off with cmpxchg, moves @head past the old
+ * entries that space is about to overwrite, copies its entry in and then
+ * publishes it by moving @c_off, in the order the space was reserved.
+ * Readers take @mutex, read only below @c_off, and find out on their own
+ * that a writer lapped them by comparing their offset with @head.
  */
 struct logger_log {
 	unsigned char		*buffer;
 	struct miscdevice	misc;
 	wait_queue_head_t	wq;
+	wait_queue_head_t	batch_wq;
 	struct list_head	readers;
 	struct mutex		mutex;
 	size_t			w_off;
+	size_t			c_off;
 	size_t			head;
+	size_t			wake_off;
 	size_t			size;
 #ifdef CONFIG_EXYNOS_SNAPSHOT_HOOK_LOGGER
+	spinlock_t		ess_lock;
 	bool			ess_hook;
 	char			*ess_buf;
 	char			*ess_sync_buf;
@@ -72,14 +88,29 @@ struct logger_log {
 
 static LIST_HEAD(log_list);
 
+/*
+ * Entries are put together here before they are copied into a log, so that
+ * no page fault can happen while a writer holds reserved space.
+ */
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+static char __percpu *logger_staging;
+
 
 /**
  * struct logger_reader - a logging device open for reading
  * @log:	The associated log
  * @list:	The associated entry in @logger_log's list
- * @r_off:	The current read head offset.
+ * @r_off:	The current read head offset, which may have been lapped
  * @r_all:	Reader can read all entries
  * @r_ver:	Reader ABI version
+ * @r_batch:	Reader gets as many entries per read() as fit
+ * @r_filter:	Reader only gets entries of @r_uid
+ * @r_uid:	The uid to filter on
+ * @r_threshold: Bytes the log must grow by before a waiting reader wakes
+ * @r_wake:	Reader waits for @r_wake_off on log->batch_wq
+ * @r_wake_off:	The offset at which a waiting reader wants to be woken
  *
  * This object lives from open to release, so we don't need additional
  * reference counting. The structure is protected by log->mutex.
@@ -90,14 +121,29 @@ struct logger_reader {
 	size_t			r_off;
 	bool			r_all;
 	int			r_ver;
+	bool			r_batch;
+	bool			r_filter;
+	kuid_t			r_uid;
+	size_t			r_threshold;
+	bool			r_wake;
+	size_t			r_wake_off;
 };
 
+/* a log->wake_off that no write can reach */
+#define LOGGER_WAKE_NEVER	(SIZE_MAX >> 1)
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 static size_t logger_offset(struct logger_log *log, size_t n)
 {
 	return n & (log->size - 1);
 }
 
+/* logger_before - is offset 'a' before offset 'b', allowing for wrapping */
+static inline bool logger_before(size_t a, size_t b)
+{
+	return (ssize_t)(a - b) < 0;
+}
+
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -144,22 +190,20 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
- *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
- *
- * Caller needs to hold log->mutex.
+ * logger_read_header - copies the header of the committed entry at 'off'
+ * into 'entry'. Returns false if a writer has lapped 'off' in the meantime,
+ * in which case the copy cannot be trusted.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static bool logger_read_header(struct logger_log *log, size_t off,
+			       struct logger_entry *entry)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_entry *hdr;
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	hdr = get_entry_header(log, logger_offset(log, off), entry);
+	if (hdr != entry)
+		memcpy(entry, hdr, sizeof(struct logger_entry));
+	smp_rmb();
+	return !logger_before(off, ACCESS_ONCE(log->head));
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -196,17 +240,18 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * user-space buffer 'buf': the header 'entry' that logger_peek() returned
+ * and the message that follows it. Returns 'count' on success, or -EAGAIN
+ * if a writer lapped the reader while the message was being copied.
  *
  * Caller must hold log->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   struct logger_entry *entry,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -214,7 +259,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
@@ -240,44 +284,156 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
+	/* writers move the head before they overwrite anything */
+	smp_rmb();
+	if (logger_before(reader->r_off, ACCESS_ONCE(log->head)))
+		return -EAGAIN;
+
+	reader->r_off += sizeof(struct logger_entry) + count;
 
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * get_next_entry_by_uid - Starting at 'off', returns the offset of the
+ * first committed entry readable by 'euid'
  */
 static size_t get_next_entry_by_uid(struct logger_log *log,
 		size_t off, kuid_t euid)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+	size_t c_off = ACCESS_ONCE(log->c_off);
 
-		entry = get_entry_header(log, off, &scratch);
+	smp_rmb();
+	while (logger_before(off, c_off)) {
+		struct logger_entry entry;
 
-		if (uid_eq(entry->euid, euid))
+		if (!logger_read_header(log, off, &entry)) {
+			off = ACCESS_ONCE(log->head);
+			continue;
+		}
+
+		if (uid_eq(entry.euid, euid))
 			return off;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
+		off += sizeof(struct logger_entry) + entry.len;
 	}
 
 	return off;
 }
 
+/*
+ * logger_peek - moves 'reader' to the next entry it may read, pulling it
+ * forward to the head if writers lapped it, and copies the header of that
+ * entry into 'entry'. Returns false if there is nothing to read.
+ *
+ * Caller must hold log->mutex.
+ */
+static bool logger_peek(struct logger_log *log, struct logger_reader *reader,
+			struct logger_entry *entry)
+{
+	size_t head;
+
+	while (1) {
+		head = ACCESS_ONCE(log->head);
+		if (logger_before(reader->r_off, head))
+			reader->r_off = head;
+
+		if (!reader->r_all)
+			reader->r_off = get_next_entry_by_uid(log,
+				reader->r_off, current_euid());
+		else if (reader->r_filter)
+			reader->r_off = get_next_entry_by_uid(log,
+				reader->r_off, reader->r_uid);
+
+		if (!logger_before(reader->r_off, ACCESS_ONCE(log->c_off)))
+			return false;
+
+		smp_rmb();
+		if (logger_read_header(log, reader->r_off, entry))
+			return true;
+	}
+}
+
+/*
+ * logger_update_wake - arms or disarms the wakeup of 'reader' at its poll
+ * threshold and recomputes the earliest offset at which writers need to
+ * wake log->batch_wq.
+ *
+ * Caller must hold log->mutex.
+ */
+static void logger_update_wake(struct logger_log *log,
+			       struct logger_reader *reader, bool arm)
+{
+	size_t wake_off = ACCESS_ONCE(log->c_off) + LOGGER_WAKE_NEVER;
+	struct logger_reader *r;
+
+	reader->r_wake = arm;
+	reader->r_wake_off = reader->r_off + reader->r_threshold;
+
+	list_for_each_entry(r, &log->readers, list)
+		if (r->r_wake && logger_before(r->r_wake_off, wake_off))
+			wake_off = r->r_wake_off;
+	ACCESS_ONCE(log->wake_off) = wake_off;
+
+	/* pairs with the barrier in logger_aio_write() */
+	smp_mb();
+}
+
+/*
+ * logger_readable - returns true if 'reader' has something to read. When
+ * 'wait' is set and the reader has a poll threshold, that also takes the
+ * log to have grown by the threshold since the reader's offset; until it
+ * has, the reader is armed to be woken at that point.
+ *
+ * Caller must hold log->mutex.
+ */
+static bool logger_readable(struct logger_log *log,
+			    struct logger_reader *reader, bool wait)
+{
+	struct logger_entry entry;
+	size_t head;
+	bool ready;
+
+	if (!wait || !reader->r_threshold)
+		return logger_peek(log, reader, &entry);
+
+	head = ACCESS_ONCE(log->head);
+	if (logger_before(reader->r_off, head))
+		reader->r_off = head;
+
+	while (1) {
+		ready = ACCESS_ONCE(log->c_off) - reader->r_off >=
+			reader->r_threshold;
+		if (!ready) {
+			logger_update_wake(log, reader, true);
+			/* we may have raced with the write that got us there */
+			ready = ACCESS_ONCE(log->c_off) - reader->r_off >=
+				reader->r_threshold;
+		}
+		if (!ready)
+			return false;
+		if (reader->r_wake)
+			logger_update_wake(log, reader, false);
+
+		if (logger_peek(log, reader, &entry))
+			return true;
+		/*
+		 * Everything written was filtered out and r_off has moved up
+		 * to it; wait for the threshold from there instead.
+		 */
+	}
+}
+
 /*
  * logger_read - our log's read() method
  *
  * Behavior:
  *
  *	- O_NONBLOCK works
- *	- If there are no log entries to read, blocks until log is written to
- *	- Atomically reads exactly one log entry
+ *	- If there are no log entries to read, blocks until log is written to,
+ *	  or until the poll threshold's worth of bytes has been written
+ *	- Atomically reads exactly one log entry, or with batching enabled as
+ *	  many complete entries as fit into the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -287,21 +443,25 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+	wait_queue_head_t *wq;
+	struct logger_entry entry;
+	ssize_t ret, nr;
 	DEFINE_WAIT(wait);
 
 start:
+	wq = reader->r_threshold ? &log->batch_wq : &log->wq;
 	while (1) {
 		mutex_lock(&log->mutex);
 
-		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
+		prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
+		ret = !logger_readable(log, reader, !nonblock);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
 
-		if (file->f_flags & O_NONBLOCK) {
+		if (nonblock) {
 			ret = -EAGAIN;
 			break;
 		}
@@ -314,108 +474,76 @@ start:
 		schedule();
 	}
 
-	finish_wait(&log->wq, &wait);
+	finish_wait(wq, &wait);
 	if (ret)
 		return ret;
 
 	mutex_lock(&log->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	while (1) {
+		/* is there still something to read or did we race? */
+		if (unlikely(!logger_peek(log, reader, &entry))) {
+			if (ret)
+				break;
+			mutex_unlock(&log->mutex);
+			goto start;
+		}
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+		/* get the size of the next entry */
+		nr = get_user_hdr_len(reader->r_ver) + entry.len;
+		if (count - ret < (size_t)nr) {
+			if (!ret)
+				ret = -EINVAL;
+			break;
+		}
 
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+		/* get exactly one entry from the log */
+		nr = do_read_log_to_user(log, reader, &entry, buf + ret, nr);
+		if (nr == -EAGAIN)
+			continue;
+		if (nr < 0) {
+			if (!ret)
+				ret = nr;
+			break;
+		}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+		ret += nr;
+		if (!reader->r_batch)
+			break;
+	}
 
-out:
 	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_reclaim - moves the head past the entries that a write reserved
+ * up to 'end' is going to overwrite. Readers still behind the head notice
+ * that they were lapped and catch up on their own.
  *
- * Caller must hold log->mutex.
+ * Concurrent writers race to move the head with cmpxchg. A writer that
+ * started walking from a head that someone else has moved since may have
+ * read entries that are being overwritten, but then its cmpxchg fails and
+ * it walks again from the new head.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_reclaim(struct logger_log *log, size_t end)
 {
-	size_t count = 0;
+	size_t target = end - log->size;
+	struct logger_entry scratch;
+	struct logger_entry *entry;
+	size_t head, off;
 
 	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
-
-/*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
- *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
- */
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
-	}
-
-	return 0;
-}
-
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
-
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		head = ACCESS_ONCE(log->head);
+		for (off = head; logger_before(off, target);
+		     off += sizeof(struct logger_entry) + entry->len)
+			entry = get_entry_header(log, logger_offset(log, off),
+						 &scratch);
+	} while (off != head && cmpxchg(&log->head, head, off) != head);
+
+	/* order the head against the overwrite */
+	smp_mb();
 }
 
 #ifdef CONFIG_EXYNOS_SNAPSHOT_HOOK_LOGGER
@@ -453,12 +581,9 @@ static int reparse_hook_logger_header(struct logger_log *log,
 	return strlen(log->ess_buf);
 }
 
-static size_t copy_hook_logger(struct logger_log *log, char *buf, size_t count,
+static size_t copy_hook_logger(const char *src, char *buf, size_t count,
 				size_t filled_size, size_t max_size)
 {
-	size_t len = min(count, log->size - log->w_off);
-	size_t m_off = (size_t)buf + filled_size;
-
 	if (max_size <= filled_size) {
 		pr_err("%s: failed to hooking platform log - count: %zu max: %zu, fill: %zu\n",
 			__func__, count, max_size, filled_size);
@@ -467,126 +592,172 @@ static size_t copy_hook_logger(struct logger_log *log, char *buf, size_t count,
 
 	/* Considering count size */
 	if (filled_size + count < max_size) {
-		memcpy((void *)m_off, log->buffer + log->w_off, len);
-		if (count != len)
-			memcpy((void *)m_off + len, log->buffer, count - len);
+		memcpy(buf + filled_size, src, count);
 		filled_size += count;
 	} else {
-		/* Cut off over max_size in count == len */
-		if (count == len) {
-			memcpy((void *)m_off, log->buffer + log->w_off,
-					max_size - filled_size - 1);
-		} else {
-			/* Considering len size */
-			if (filled_size + len < max_size) {
-				/* Enough to fill len size */
-				memcpy((void *)m_off, log->buffer + log->w_off, len);
-				/* Cut off over max_size */
-				memcpy((void *)(m_off + len), log->buffer,
-						max_size - filled_size - len - 1);
-			} else {
-				/* Cut off over max size */
-				memcpy((void *)m_off, log->buffer + log->w_off,
-						max_size - filled_size - 1);
-			}
-		}
+		/* Cut off over max size */
+		memcpy(buf + filled_size, src, max_size - filled_size - 1);
 		filled_size = max_size;
 	}
 	return filled_size;
 }
+
+/*
+ * hook_logger_entry - passes the entry that was just written to the
+ * snapshot hook, segment by segment as userspace wrote it. Writers no
+ * longer serialize on the log, so the hook buffers have their own lock.
+ */
+static void hook_logger_entry(struct logger_log *log,
+			      struct logger_entry *entry,
+			      const struct iovec *iov, unsigned long nr_segs)
+{
+	const char *src = entry->msg;
+	size_t left = entry->len;
+
+	spin_lock(&log->ess_lock);
+
+	if (func_hook_logger && log->ess_buf)
+		log->ess_size = reparse_hook_logger_header(log, entry);
+
+	while (nr_segs-- > 0 && left) {
+		size_t len = min_t(size_t, iov->iov_len, left);
+
+		/*
+		 *  There are times when log buffer is just 1 bytes
+		 *  for sync with kernel log buffer
+		 */
+		if (len > 1 && log->ess_sync_buf &&
+		    log->ess_sync_size < ESS_MAX_SYNC_BUF_SIZE - 1 &&
+		    strncmp(src, "!@", 2) == 0) {
+			log->ess_sync_size = copy_hook_logger(src,
+							      log->ess_sync_buf,
+							      len,
+							      log->ess_sync_size,
+							      ESS_MAX_SYNC_BUF_SIZE);
+		}
+		if (func_hook_logger && log->ess_hook) {
+			if (log->ess_size < ESS_MAX_BUF_SIZE - 1) {
+				log->ess_size = copy_hook_logger(src,
+								 log->ess_buf,
+								 len,
+								 log->ess_size,
+								 ESS_MAX_BUF_SIZE);
+			}
+		}
+		src += len;
+		left -= len;
+		iov++;
+	}
+
+	if (func_hook_logger && log->ess_hook) {
+		/* it is allowed to hook if ess_size < ESS_MAX_BUF_SIZE */
+		if (log->ess_size < ESS_MAX_BUF_SIZE) {
+			char *eatnl = log->ess_buf + log->ess_size - 1;
+			*eatnl = '\n';
+			while (--eatnl >= log->ess_buf) {
+				if (*eatnl == '\n')
+					*eatnl = '\0';
+			};
+			func_hook_logger(log->misc.name, log->ess_buf, log->ess_size);
+		}
+	}
+	/* if it is kernel sync logs */
+	if (log->ess_sync_size) {
+		/* save code to prevent overflow during printk */
+		if (log->ess_sync_size < ESS_MAX_SYNC_BUF_SIZE)
+			log->ess_sync_buf[log->ess_sync_size - 1] = '\0';
+		else
+			log->ess_sync_buf[ESS_MAX_SYNC_BUF_SIZE - 1] = '\0';
+		pr_info("%s\n", log->ess_sync_buf);
+		/* clear ess_sync_buf */
+		memset(log->ess_sync_buf, 0, ESS_MAX_SYNC_BUF_SIZE);
+		log->ess_sync_size = 0;
+	}
+
+	spin_unlock(&log->ess_lock);
+}
 #endif
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes the 'count' byte entry 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have preemption disabled, which bounds the space that
+ * writers hold reserved but have not committed yet to one entry per CPU,
+ * far less than the size of any log. So a writer never overwrites an
+ * entry that is still being written, and one that waits for the writers
+ * ahead of it to commit never waits for long.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
-	size_t len;
+	size_t start, off, len;
+
+	do {
+		start = ACCESS_ONCE(log->w_off);
+	} while (cmpxchg(&log->w_off, start, start + count) != start);
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	logger_reclaim(log, start + count);
+
+	off = logger_offset(log, start);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
 
-#ifdef CONFIG_EXYNOS_SNAPSHOT_HOOK_LOGGER
-	if (func_hook_logger && log->ess_buf)
-		log->ess_size = reparse_hook_logger_header(log,
-					(struct logger_entry *)buf);
-#endif
-	log->w_off = logger_offset(log, log->w_off + count);
+	/* commit in the order the space was reserved */
+	while (ACCESS_ONCE(log->c_off) != start)
+		cpu_relax();
+	smp_mb();
+	ACCESS_ONCE(log->c_off) = start + count;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * copy_iov_from_user - gathers 'count' bytes from the user-space vector
+ * 'iov' into 'buf'. With 'atomic' set, page faults are not serviced and
+ * any data that is not resident makes the copy fail.
  *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_iov_from_user(char *buf, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count, bool atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && count) {
+		size_t len = min_t(size_t, iov->iov_len, count);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
+		if (!access_ok(VERIFY_READ, iov->iov_base, len))
+			return -EFAULT;
+		if (atomic ? __copy_from_user_inatomic(buf, iov->iov_base, len)
+			   : __copy_from_user(buf, iov->iov_base, len))
 			return -EFAULT;
 
-#ifdef CONFIG_EXYNOS_SNAPSHOT_HOOK_LOGGER
-	/*
-	 *  There are times when log buffer is just 1 bytes
-	 *  for sync with kernel log buffer
-	 */
-	if (len > 1 && log->ess_sync_size < ESS_MAX_SYNC_BUF_SIZE - 1 &&
-		strncmp(log->buffer + log->w_off, "!@", 2) == 0) {
-		log->ess_sync_size = copy_hook_logger(log,
-						      log->ess_sync_buf,
-						      count,
-						      log->ess_sync_size,
-						      ESS_MAX_SYNC_BUF_SIZE);
-	}
-	if (func_hook_logger && log->ess_hook) {
-		if (log->ess_size < ESS_MAX_BUF_SIZE - 1) {
-			log->ess_size = copy_hook_logger(log,
-							 log->ess_buf,
-							 count,
-							 log->ess_size,
-							 ESS_MAX_BUF_SIZE);
-		}
+		buf += len;
+		count -= len;
+		iov++;
 	}
-#endif
-	log->w_off = logger_offset(log, log->w_off + count);
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is put together in this CPU's staging buffer and then copied
+ * into the log without taking any lock. Should the payload not be resident,
+ * it is faulted in through a temporary buffer instead. A payload that cannot
+ * be copied completely is not written at all, to avoid message corruption
+ * from missing fragments.
  */
 static ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig;
 	struct logger_entry header;
+	struct logger_entry *entry;
 	struct timespec now;
-	ssize_t ret = 0;
+	char *slow = NULL;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -602,70 +773,47 @@ static ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	orig = log->w_off;
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	preempt_disable();
+	entry = (struct logger_entry *)this_cpu_ptr(logger_staging);
+	pagefault_disable();
+	ret = copy_iov_from_user(entry->msg, iov, nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		preempt_enable();
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		slow = kmalloc(sizeof(struct logger_entry) + header.len,
+			       GFP_KERNEL);
+		if (!slow)
+			return -ENOMEM;
+		entry = (struct logger_entry *)slow;
+		ret = copy_iov_from_user(entry->msg, iov, nr_segs, header.len,
+					 false);
+		if (ret) {
+			kfree(slow);
+			return ret;
 		}
 
-		iov++;
-		ret += nr;
+		preempt_disable();
 	}
+
+	memcpy(entry, &header, sizeof(struct logger_entry));
+	do_write_log(log, entry, sizeof(struct logger_entry) + header.len);
+
 #ifdef CONFIG_EXYNOS_SNAPSHOT_HOOK_LOGGER
-	if (func_hook_logger && log->ess_hook) {
-		/* it is allowed to hook if ess_size < ESS_MAX_BUF_SIZE */
-		if (log->ess_size < ESS_MAX_BUF_SIZE) {
-			char *eatnl = log->ess_buf + log->ess_size - 1;
-			*eatnl = '\n';
-			while (--eatnl >= log->ess_buf) {
-				if (*eatnl == '\n')
-					*eatnl = '\0';
-			};
-			func_hook_logger(log->misc.name, log->ess_buf, log->ess_size);
-		}
-	}
-	/* if it is kernel sync logs */
-	if (log->ess_sync_size) {
-		/* save code to prevent overflow during printk */
-		if (log->ess_sync_size < ESS_MAX_SYNC_BUF_SIZE)
-			log->ess_sync_buf[log->ess_sync_size - 1] = '\0';
-		else
-			log->ess_sync_buf[ESS_MAX_SYNC_BUF_SIZE - 1] = '\0';
-		pr_info("%s\n", log->ess_sync_buf);
-		/* clear ess_sync_buf */
-		memset(log->ess_sync_buf, 0, ESS_MAX_SYNC_BUF_SIZE);
-		log->ess_sync_size = 0;
-	}
+	hook_logger_entry(log, entry, iov, nr_segs);
 #endif
-	mutex_unlock(&log->mutex);
+	preempt_enable();
+	kfree(slow);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	/* pairs with the barrier in logger_update_wake() */
+	smp_mb();
+	if (!logger_before(ACCESS_ONCE(log->c_off), ACCESS_ONCE(log->wake_off)))
+		wake_up_interruptible(&log->batch_wq);
+
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int minor)
@@ -705,13 +853,17 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
+		reader->r_filter = false;
+		reader->r_threshold = 0;
+		reader->r_wake = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = ACCESS_ONCE(log->head);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -735,6 +887,8 @@ static int logger_release(struct inode *ignored, struct file *file)
 
 		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		if (reader->r_wake)
+			logger_update_wake(log, reader, false);
 		mutex_unlock(&log->mutex);
 
 		kfree(reader);
@@ -764,14 +918,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	reader = file->private_data;
 	log = reader->log;
 
-	poll_wait(file, &log->wq, wait);
+	poll_wait(file, reader->r_threshold ? &log->batch_wq : &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	if (logger_readable(log, reader, true))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -791,10 +941,62 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+static long logger_set_uid_filter(struct logger_reader *reader,
+				  void __user *arg)
+{
+	kuid_t uid;
+	int val;
+
+	if (copy_from_user(&val, arg, sizeof(int)))
+		return -EFAULT;
+
+	if (val < 0) {
+		reader->r_filter = false;
+		return 0;
+	}
+
+	uid = make_kuid(current_user_ns(), val);
+	if (!uid_valid(uid))
+		return -EINVAL;
+
+	/* readers without access to all entries only get their own anyway */
+	if (!reader->r_all && !uid_eq(uid, current_euid()))
+		return -EPERM;
+
+	reader->r_uid = uid;
+	reader->r_filter = true;
+	return 0;
+}
+
+static long logger_set_poll_threshold(struct logger_log *log,
+				      struct logger_reader *reader,
+				      void __user *arg)
+{
+	int threshold;
+
+	if (copy_from_user(&threshold, arg, sizeof(int)))
+		return -EFAULT;
+
+	/*
+	 * logger_reclaim() only frees whole entries, so a full log may be
+	 * short of log->size by up to one entry; more would never be ready.
+	 */
+	if (threshold < 0 ||
+	    (size_t)threshold > log->size - LOGGER_ENTRY_MAX_LEN)
+		return -EINVAL;
+
+	reader->r_threshold = threshold;
+	if (reader->r_wake)
+		logger_update_wake(log, reader, false);
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
+	size_t c_off, head;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
@@ -810,10 +1012,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		if (logger_before(reader->r_off, ACCESS_ONCE(log->head)))
+			reader->r_off = ACCESS_ONCE(log->head);
+		ret = ACCESS_ONCE(log->c_off) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -822,13 +1023,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (logger_peek(log, reader, &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
 		break;
@@ -842,9 +1038,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EPERM;
 			break;
 		}
+		c_off = ACCESS_ONCE(log->c_off);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = c_off;
+		/* writers may be moving the head too, never move it back */
+		do {
+			head = ACCESS_ONCE(log->head);
+		} while (logger_before(head, c_off) &&
+			 cmpxchg(&log->head, head, c_off) != head);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -863,6 +1064,35 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		if (get_user(ret, (int __user *)argp)) {
+			ret = -EFAULT;
+			break;
+		}
+		reader->r_batch = ret != 0;
+		ret = 0;
+		break;
+	case LOGGER_SET_UID_FILTER:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_uid_filter(reader, argp);
+		break;
+	case LOGGER_SET_POLL_THRESHOLD:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_poll_threshold(log, reader, argp);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -913,10 +1143,13 @@ static int __init create_log(char *log_name, int size)
 	log->misc.parent = NULL;
 
 	init_waitqueue_head(&log->wq);
+	init_waitqueue_head(&log->batch_wq);
 	INIT_LIST_HEAD(&log->readers);
 	mutex_init(&log->mutex);
 	log->w_off = 0;
+	log->c_off = 0;
 	log->head = 0;
+	log->wake_off = LOGGER_WAKE_NEVER;
 	log->size = size;
 
 	INIT_LIST_HEAD(&log->logs);
@@ -934,6 +1167,7 @@ static int __init create_log(char *log_name, int size)
 		(unsigned long) log->size >> 10, log->misc.name);
 
 #ifdef CONFIG_EXYNOS_SNAPSHOT_HOOK_LOGGER
+	spin_lock_init(&log->ess_lock);
 	buffer = vmalloc(ESS_MAX_SYNC_BUF_SIZE);
 	if (buffer)
 		log->ess_sync_buf = buffer;
@@ -976,6 +1210,11 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_staging = __alloc_percpu(LOGGER_ENTRY_MAX_LEN,
+					__alignof__(struct logger_entry));
+	if (!logger_staging)
+		return -ENOMEM;
+
 	ret = create_log(LOGGER_LOG_MAIN, 256*1024);
 	if (unlikely(ret))
 		goto out;
@@ -1008,6 +1247,7 @@ static void __exit logger_exit(void)
 		list_del(&current_log->logs);
 		kfree(current_log);
 	}
+	free_percpu(logger_staging);
 }
 
 
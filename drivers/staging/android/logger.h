@@ -85,5 +85,8 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 7) /* entries per read */
+#define LOGGER_SET_UID_FILTER		_IO(__LOGGERIO, 8) /* read one uid */
+#define LOGGER_SET_POLL_THRESHOLD	_IO(__LOGGERIO, 9) /* bytes to wake */
 
 #endif /* _LINUX_LOGGER_H */
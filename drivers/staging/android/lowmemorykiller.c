@@ -40,6 +40,16 @@
 #include <linux/swap.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/vmpressure.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/wait.h>
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 static uint32_t lowmem_debug_level = 1;
 static short lowmem_adj[6] = {
@@ -60,23 +70,474 @@ static uint32_t lowmem_lmkcount = 0;
 
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * With lowmem_vmpressure set, kill decisions also take the efficiency of
+ * reclaim into account, as reported by vmpressure: the percentage of
+ * scanned pages that were reclaimed. While reclaim is efficient, page
+ * cache is really reclaimable and only the most critical minfree level
+ * kills. Once efficiency drops below lowmem_min_efficiency, or swap
+ * (zram) is almost full so anon pages can't be reclaimed either, the
+ * cache is no longer counted as free and kills escalate.
+ */
+static bool lowmem_vmpressure;
+static int lowmem_min_efficiency = 30;
+static int lowmem_min_swap_free = 10;
+static int lowmem_pressure;
+static unsigned long lowmem_pressure_stamp;
+
+/*
+ * A killed task only frees its memory once it gets to run exit_mmap(),
+ * which can take a while if it is stuck in D state or waiting for a
+ * slow cpu. The reaper thread unmaps the victim's private anonymous
+ * memory right away instead. kill_to_free_us reports the time from
+ * the kill until the memory was released, by the reaper or by the
+ * victim itself if it got there first.
+ */
+#define LOWMEM_REAP_QUEUE	8
+#define LOWMEM_REAP_RETRIES	10
+
+struct lowmem_victim {
+	struct task_struct *task;
+	struct mm_struct *mm;
+	ktime_t kill_time;
+};
+
+static bool lowmem_reaper_enable = true;
+static struct task_struct *lowmem_reaper_thread;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reaper_wait);
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static struct lowmem_victim lowmem_reap_queue[LOWMEM_REAP_QUEUE];
+static unsigned int lowmem_reap_head, lowmem_reap_tail;
+
+static unsigned long lowmem_reap_pages;
+static unsigned long lowmem_kill_to_free_us;
+static unsigned long lowmem_kill_to_free_max_us;
+
+/* time spent looking for a victim, to judge the cost of the search */
+static unsigned long lowmem_scan_ns;
+static uint32_t lowmem_scan_count;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			pr_info(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+/*
+ * Thread group leaders of user processes, ordered by oom_score_adj, so
+ * that a victim can be found without walking every process. The key is
+ * cached in task->adj_key because oom_score_adj is written before the
+ * tree is updated. Callers must not hold task_lock or siglock, the
+ * victim search takes task_lock under lowmem_adj_tree_lock.
+ */
+static struct rb_root lowmem_adj_tree = RB_ROOT;
+static DEFINE_SPINLOCK(lowmem_adj_tree_lock);
+/* leader of the last victim, until it is released or the timeout */
+static struct task_struct *lowmem_deathpending;
+
+static void __lowmem_adj_tree_insert(struct task_struct *p)
+{
+	struct rb_node **link = &lowmem_adj_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct task_struct *entry;
+
+	p->adj_key = p->signal->oom_score_adj;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct task_struct, adj_node);
+		if (p->adj_key < entry->adj_key)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&p->adj_node, parent, link);
+	rb_insert_color(&p->adj_node, &lowmem_adj_tree);
+}
+
+static void __lowmem_adj_tree_erase(struct task_struct *p)
+{
+	rb_erase(&p->adj_node, &lowmem_adj_tree);
+	RB_CLEAR_NODE(&p->adj_node);
+}
+
+void lowmem_adj_tree_add(struct task_struct *p)
+{
+	if (p->flags & PF_KTHREAD)
+		return;
+
+	spin_lock(&lowmem_adj_tree_lock);
+	if (RB_EMPTY_NODE(&p->adj_node))
+		__lowmem_adj_tree_insert(p);
+	spin_unlock(&lowmem_adj_tree_lock);
+}
+
+void lowmem_adj_tree_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_adj_tree_lock);
+	if (!RB_EMPTY_NODE(&p->adj_node))
+		__lowmem_adj_tree_erase(p);
+	if (lowmem_deathpending == p)
+		lowmem_deathpending = NULL;
+	spin_unlock(&lowmem_adj_tree_lock);
+}
+
+/* oom_score_adj of @p's thread group has been written, re-sort it */
+void lowmem_adj_tree_update(struct task_struct *p)
+{
+	spin_lock(&lowmem_adj_tree_lock);
+	p = p->group_leader;
+	if (!RB_EMPTY_NODE(&p->adj_node) &&
+	    p->adj_key != p->signal->oom_score_adj) {
+		__lowmem_adj_tree_erase(p);
+		__lowmem_adj_tree_insert(p);
+	}
+	spin_unlock(&lowmem_adj_tree_lock);
+}
+
+/*
+ * Walk the index from the highest oom_score_adj down, stopping at
+ * @min_score_adj or as soon as every remaining task ranks below the
+ * current pick. Only tasks sharing the highest eligible oom_score_adj
+ * have their rss compared. Returns the victim with its size in
+ * @tasksize and score in @score_adj, or NULL. Returns ERR_PTR(-EBUSY)
+ * if an earlier victim is still dying. Called under rcu_read_lock().
+ */
+static struct task_struct *lowmem_select_victim(short min_score_adj,
+		int *tasksize, short *score_adj)
+{
+	struct rb_node *node;
+	struct task_struct *tsk, *p;
+	struct task_struct *selected = NULL, *leader = NULL;
+	int size;
+
+	spin_lock(&lowmem_adj_tree_lock);
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		spin_unlock(&lowmem_adj_tree_lock);
+		return ERR_PTR(-EBUSY);
+	}
+
+	for (node = rb_last(&lowmem_adj_tree); node; node = rb_prev(node)) {
+		tsk = rb_entry(node, struct task_struct, adj_node);
+		if (tsk->adj_key < min_score_adj)
+			break;
+		if (selected && tsk->adj_key < *score_adj)
+			break;
+
+		p = find_lock_task_mm(tsk);
+		if (!p)
+			continue;
+		/* already killed, possibly reaped by now */
+		if (test_tsk_thread_flag(p, TIF_MEMDIE)) {
+			task_unlock(p);
+			continue;
+		}
+		size = get_mm_rss(p->mm);
+		task_unlock(p);
+		if (size <= 0)
+			continue;
+		if (selected && size <= *tasksize)
+			continue;
+		selected = p;
+		leader = tsk;
+		*tasksize = size;
+		*score_adj = tsk->adj_key;
+		lowmem_print(2, "select '%s' (%d), adj %hd, size %d, to kill\n",
+			     p->comm, p->pid, tsk->adj_key, size);
+	}
+	lowmem_deathpending = leader;
+	spin_unlock(&lowmem_adj_tree_lock);
+
+	return selected;
+}
+#else
+static struct task_struct *lowmem_select_victim(short min_score_adj,
+		int *tasksize, short *score_adj)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
+	int size;
+
+	for_each_process(tsk) {
+		struct task_struct *p;
+		short oom_score_adj;
+
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+
+		p = find_lock_task_mm(tsk);
+		if (!p)
+			continue;
+
+		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+			task_unlock(p);
+			return ERR_PTR(-EBUSY);
+		}
+		if (test_tsk_thread_flag(p, TIF_MEMDIE)) {
+			task_unlock(p);
+			continue;
+		}
+		oom_score_adj = p->signal->oom_score_adj;
+		if (oom_score_adj < min_score_adj) {
+			task_unlock(p);
+			continue;
+		}
+		size = get_mm_rss(p->mm);
+		task_unlock(p);
+		if (size <= 0)
+			continue;
+		if (selected) {
+			if (oom_score_adj < *score_adj)
+				continue;
+			if (oom_score_adj == *score_adj &&
+			    size <= *tasksize)
+				continue;
+		}
+		selected = p;
+		*tasksize = size;
+		*score_adj = oom_score_adj;
+		lowmem_print(2, "select '%s' (%d), adj %hd, size %d, to kill\n",
+			     p->comm, p->pid, oom_score_adj, size);
+	}
+
+	return selected;
+}
+#endif
+
+/*
+ * Is @mm used outside of @victim's thread group by a task that is not
+ * exiting as well, e.g. a CLONE_VM child or a kthread that did use_mm()?
+ * Its memory must not be torn down then.
+ */
+static bool lowmem_mm_is_shared(struct mm_struct *mm,
+				struct task_struct *victim)
+{
+	struct task_struct *p, *t;
+	bool shared = false;
+
+	if (atomic_read(&mm->mm_users) <= get_nr_threads(victim) + 1)
+		return false;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		if (same_thread_group(p, victim))
+			continue;
+		/* the leader may be gone while other threads still run */
+		t = find_lock_task_mm(p);
+		if (!t)
+			continue;
+		shared = t->mm == mm && !fatal_signal_pending(t);
+		task_unlock(t);
+		if (shared)
+			break;
+	}
+	rcu_read_unlock();
+
+	return shared;
+}
+
+/*
+ * Unmap the private anonymous memory of @victim's @mm while the task is
+ * still on its way out, the same way MADV_DONTNEED does. Returns false
+ * if mmap_sem could not be taken.
+ */
+static bool lowmem_reap_mm(struct task_struct *victim, struct mm_struct *mm,
+			   unsigned long *freed)
+{
+	struct vm_area_struct *vma;
+	unsigned long anon, left;
+	int retries;
+
+	*freed = 0;
+
+	/* the victim got to exit_mmap() first */
+	if (!atomic_inc_not_zero(&mm->mm_users))
+		return true;
+
+	for (retries = 0; retries < LOWMEM_REAP_RETRIES; retries++) {
+		if (down_read_trylock(&mm->mmap_sem))
+			break;
+		schedule_timeout_uninterruptible(HZ / 100 ?: 1);
+	}
+	if (retries == LOWMEM_REAP_RETRIES) {
+		mmput(mm);
+		return false;
+	}
+
+	if (lowmem_mm_is_shared(mm, victim)) {
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+		return true;
+	}
+
+	anon = get_mm_counter(mm, MM_ANONPAGES);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_flags & (VM_SHARED | VM_LOCKED | VM_HUGETLB |
+				     VM_PFNMAP))
+			continue;
+		/* only plain anonymous memory, not special mappings */
+		if (vma->vm_file || vma->vm_ops)
+			continue;
+		zap_page_range(vma, vma->vm_start,
+			       vma->vm_end - vma->vm_start, NULL);
+	}
+	/*
+	 * Threads still running can fault pages back in, and the split
+	 * rss counters lag behind: never report less than nothing.
+	 */
+	left = get_mm_counter(mm, MM_ANONPAGES);
+	*freed = anon > left ? anon - left : 0;
+	up_read(&mm->mmap_sem);
+
+	mmput(mm);
+	return true;
+}
+
+static int lowmem_reaper(void *unused)
+{
+	struct lowmem_victim victim;
+	unsigned long freed;
+	unsigned long us;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(lowmem_reaper_wait,
+				     lowmem_reap_head != lowmem_reap_tail ||
+				     kthread_should_stop());
+
+		spin_lock(&lowmem_reap_lock);
+		if (lowmem_reap_head == lowmem_reap_tail) {
+			spin_unlock(&lowmem_reap_lock);
+			continue;
+		}
+		victim = lowmem_reap_queue[lowmem_reap_tail % LOWMEM_REAP_QUEUE];
+		lowmem_reap_tail++;
+		spin_unlock(&lowmem_reap_lock);
+
+		if (lowmem_reap_mm(victim.task, victim.mm, &freed)) {
+			us = ktime_to_us(ktime_sub(ktime_get(),
+						   victim.kill_time));
+			lowmem_kill_to_free_us = us;
+			if (us > lowmem_kill_to_free_max_us)
+				lowmem_kill_to_free_max_us = us;
+			lowmem_reap_pages += freed;
+			/* the memory is back, don't hold off the next kill */
+			lowmem_deathpending_timeout = jiffies;
+			lowmem_print(2, "reaped '%s' (%d), %lukB in %luus\n",
+				     victim.task->comm, victim.task->pid,
+				     freed * (PAGE_SIZE / 1024), us);
+		}
+
+		mmdrop(victim.mm);
+		put_task_struct(victim.task);
+	}
+
+	return 0;
+}
+
+/* Hand @selected, which was just sent SIGKILL, to the reaper */
+static void lowmem_queue_reap(struct task_struct *selected)
+{
+	struct lowmem_victim *victim;
+	struct mm_struct *mm;
+
+	if (!lowmem_reaper_enable || !lowmem_reaper_thread)
+		return;
+
+	task_lock(selected);
+	mm = selected->mm;
+	if (mm)
+		atomic_inc(&mm->mm_count);
+	task_unlock(selected);
+	if (!mm)
+		return;
+
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_head - lowmem_reap_tail >= LOWMEM_REAP_QUEUE) {
+		spin_unlock(&lowmem_reap_lock);
+		mmdrop(mm);
+		return;
+	}
+	victim = &lowmem_reap_queue[lowmem_reap_head % LOWMEM_REAP_QUEUE];
+	get_task_struct(selected);
+	victim->task = selected;
+	victim->mm = mm;
+	victim->kill_time = ktime_get();
+	lowmem_reap_head++;
+	spin_unlock(&lowmem_reap_lock);
+
+	wake_up(&lowmem_reaper_wait);
+}
+
+static int lowmem_vmpressure_notifier(struct notifier_block *nb,
+				      unsigned long action, void *data)
+{
+	lowmem_pressure = action;
+	lowmem_pressure_stamp = jiffies;
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notifier,
+};
+
+static short lowmem_vmpressure_adj(int other_free, int other_file,
+				   short min_score_adj, int array_size,
+				   int *minfree)
+{
+	int pressure = 0;
+	int swap_free = 100;
+	int decision;
+	short table_adj = min_score_adj;
+	int i;
+
+	/* a report older than a second means reclaim has been idle */
+	if (time_before_eq(jiffies, lowmem_pressure_stamp + HZ))
+		pressure = lowmem_pressure;
+	if (total_swap_pages)
+		swap_free = get_nr_swap_pages() * 100 / total_swap_pages;
+
+	if (100 - pressure >= lowmem_min_efficiency &&
+	    swap_free >= lowmem_min_swap_free) {
+		if (array_size > 0 && other_free < lowmem_minfree[0] &&
+		    other_file < lowmem_minfree[0]) {
+			decision = LMK_DECISION_DEFAULT;
+		} else {
+			min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+			decision = LMK_DECISION_SKIP;
+		}
+	} else {
+		for (i = 0; i < array_size; i++) {
+			if (other_free < lowmem_minfree[i]) {
+				if (lowmem_adj[i] < min_score_adj) {
+					min_score_adj = lowmem_adj[i];
+					*minfree = lowmem_minfree[i];
+				}
+				break;
+			}
+		}
+		decision = LMK_DECISION_ESCALATE;
+	}
+
+	trace_lowmem_decision(other_free, other_file, pressure, swap_free,
+			      table_adj, min_score_adj, decision);
+
+	return min_score_adj;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
 	short min_score_adj = OOM_SCORE_ADJ_MAX + 1;
 	int minfree = 0;
 	int selected_tasksize = 0;
 	short selected_oom_score_adj;
+	ktime_t start;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -93,6 +554,10 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			break;
 		}
 	}
+	if (sc->nr_to_scan > 0 && lowmem_vmpressure)
+		min_score_adj = lowmem_vmpressure_adj(other_free, other_file,
+						      min_score_adj, array_size,
+						      &minfree);
 	if (sc->nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %hd\n",
 				sc->nr_to_scan, sc->gfp_mask, other_free,
@@ -109,45 +574,17 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	selected_oom_score_adj = min_score_adj;
 
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		short oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select '%s' (%d), adj %hd, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
+	start = ktime_get();
+	selected = lowmem_select_victim(min_score_adj, &selected_tasksize,
+					&selected_oom_score_adj);
+	lowmem_scan_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	lowmem_scan_count++;
+
+	if (IS_ERR(selected)) {
+		rcu_read_unlock();
+		return 0;
 	}
+
 	if (selected) {
 		lowmem_print(1, "Killing '%s' (%d), adj %hd,\n" \
 				"   to free %ldkB on behalf of '%s' (%d) because\n" \
@@ -162,8 +599,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     min_score_adj,
 			     other_free * (long)(PAGE_SIZE / 1024));
 		lowmem_deathpending_timeout = jiffies + HZ;
+		trace_lowmem_kill(selected, selected_tasksize,
+				  selected_oom_score_adj, min_score_adj);
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
+		lowmem_queue_reap(selected);
 		rem -= selected_tasksize;
 		lowmem_lmkcount++;
 	}
@@ -180,13 +620,22 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_reaper_thread = kthread_run(lowmem_reaper, NULL, "lmk_reaper");
+	if (IS_ERR(lowmem_reaper_thread)) {
+		pr_err("failed to start the reaper thread\n");
+		lowmem_reaper_thread = NULL;
+	}
 	register_shrinker(&lowmem_shrinker);
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_reaper_thread)
+		kthread_stop(lowmem_reaper_thread);
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
@@ -281,6 +730,18 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 module_param_named(lmkcount, lowmem_lmkcount, uint, S_IRUGO);
+module_param_named(vmpressure, lowmem_vmpressure, bool, S_IRUGO | S_IWUSR);
+module_param_named(min_efficiency, lowmem_min_efficiency, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(min_swap_free, lowmem_min_swap_free, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(reaper, lowmem_reaper_enable, bool, S_IRUGO | S_IWUSR);
+module_param_named(reap_pages, lowmem_reap_pages, ulong, S_IRUGO);
+module_param_named(kill_to_free_us, lowmem_kill_to_free_us, ulong, S_IRUGO);
+module_param_named(kill_to_free_max_us, lowmem_kill_to_free_max_us, ulong,
+		   S_IRUGO);
+module_param_named(scan_ns, lowmem_scan_ns, ulong, S_IRUGO);
+module_param_named(scan_count, lowmem_scan_count, uint, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
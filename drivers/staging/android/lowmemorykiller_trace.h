@@ -0,0 +1,93 @@
+/*
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define LMK_DECISION_DEFAULT	0	/* static minfree table */
+#define LMK_DECISION_SKIP	1	/* reclaim is efficient, don't kill */
+#define LMK_DECISION_ESCALATE	2	/* reclaim is thrashing, ignore cache */
+
+#define show_lmk_decision(decision)					\
+	__print_symbolic(decision,					\
+			 { LMK_DECISION_DEFAULT, "default" },		\
+			 { LMK_DECISION_SKIP, "skip" },			\
+			 { LMK_DECISION_ESCALATE, "escalate" })
+
+TRACE_EVENT(lowmem_decision,
+	TP_PROTO(int other_free, int other_file, int pressure,
+		 int swap_free, short table_adj, short min_score_adj,
+		 int decision),
+	TP_ARGS(other_free, other_file, pressure, swap_free, table_adj,
+		min_score_adj, decision),
+
+	TP_STRUCT__entry(
+		__field(int, other_free)
+		__field(int, other_file)
+		__field(int, pressure)
+		__field(int, swap_free)
+		__field(short, table_adj)
+		__field(short, min_score_adj)
+		__field(int, decision)
+	),
+	TP_fast_assign(
+		__entry->other_free = other_free;
+		__entry->other_file = other_file;
+		__entry->pressure = pressure;
+		__entry->swap_free = swap_free;
+		__entry->table_adj = table_adj;
+		__entry->min_score_adj = min_score_adj;
+		__entry->decision = decision;
+	),
+	TP_printk("ofree=%d ofile=%d pressure=%d swap_free=%d%% table_adj=%hd min_adj=%hd decision=%s",
+		  __entry->other_free, __entry->other_file,
+		  __entry->pressure, __entry->swap_free,
+		  __entry->table_adj, __entry->min_score_adj,
+		  show_lmk_decision(__entry->decision))
+);
+
+TRACE_EVENT(lowmem_kill,
+	TP_PROTO(struct task_struct *killed_task, int tasksize,
+		 short oom_score_adj, short min_score_adj),
+	TP_ARGS(killed_task, tasksize, oom_score_adj, min_score_adj),
+
+	TP_STRUCT__entry(
+		__array(char, comm, TASK_COMM_LEN)
+		__field(pid_t, pid)
+		__field(int, tasksize)
+		__field(short, oom_score_adj)
+		__field(short, min_score_adj)
+	),
+	TP_fast_assign(
+		memcpy(__entry->comm, killed_task->comm, TASK_COMM_LEN);
+		__entry->pid = killed_task->pid;
+		__entry->tasksize = tasksize;
+		__entry->oom_score_adj = oom_score_adj;
+		__entry->min_score_adj = min_score_adj;
+	),
+	TP_printk("comm=%s pid=%d size=%d adj=%hd min_adj=%hd",
+		  __entry->comm, __entry->pid, __entry->tasksize,
+		  __entry->oom_score_adj, __entry->min_score_adj)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
@@ -19,6 +19,7 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
@@ -42,6 +43,13 @@ static DEFINE_SPINLOCK(sync_timeline_list_lock);
 static LIST_HEAD(sync_fence_list_head);
 static DEFINE_SPINLOCK(sync_fence_list_lock);
 
+/*
+ * How long sync_fence_wait() spins before it sleeps on a fence that is
+ * next to signal on all its timelines, in microseconds. 0 disables it.
+ */
+static unsigned int sync_wait_spin_us = 20;
+module_param_named(wait_spin_us, sync_wait_spin_us, uint, 0644);
+
 struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 					   int size, const char *name)
 {
@@ -119,10 +127,16 @@ static void sync_timeline_remove_pt(struct sync_pt *pt)
 	struct sync_timeline *obj = pt->parent;
 	unsigned long flags;
 
-	spin_lock_irqsave(&obj->active_list_lock, flags);
-	if (!list_empty(&pt->active_list))
-		list_del_init(&pt->active_list);
-	spin_unlock_irqrestore(&obj->active_list_lock, flags);
+	/*
+	 * A pt is activated once and leaves the active list for good when
+	 * it signals, so only the ones still pending need the lock.
+	 */
+	if (!list_empty_careful(&pt->active_list)) {
+		spin_lock_irqsave(&obj->active_list_lock, flags);
+		if (!list_empty(&pt->active_list))
+			list_del_init(&pt->active_list);
+		spin_unlock_irqrestore(&obj->active_list_lock, flags);
+	}
 
 	spin_lock_irqsave(&obj->child_list_lock, flags);
 	if (!list_empty(&pt->child_list)) {
@@ -141,15 +155,20 @@ void sync_timeline_signal(struct sync_timeline *obj)
 
 	spin_lock_irqsave(&obj->active_list_lock, flags);
 
+	/*
+	 * The active list is kept in signaling order, so what signaled is
+	 * a prefix of it and we can stop at the first pt that has not.
+	 */
 	list_for_each_safe(pos, n, &obj->active_list_head) {
 		struct sync_pt *pt =
 			container_of(pos, struct sync_pt, active_list);
 
-		if (_sync_pt_has_signaled(pt)) {
-			list_del_init(pos);
-			list_add(&pt->signaled_list, &signaled_pts);
-			kref_get(&pt->fence->kref);
-		}
+		if (!_sync_pt_has_signaled(pt))
+			break;
+
+		list_del_init(pos);
+		list_add_tail(&pt->signaled_list, &signaled_pts);
+		kref_get(&pt->fence->kref);
 	}
 
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
@@ -223,6 +242,7 @@ static struct sync_pt *sync_pt_dup(struct sync_pt *pt)
 static void sync_pt_activate(struct sync_pt *pt)
 {
 	struct sync_timeline *obj = pt->parent;
+	struct sync_pt *pos;
 	unsigned long flags;
 	int err;
 
@@ -232,7 +252,14 @@ static void sync_pt_activate(struct sync_pt *pt)
 	if (err != 0)
 		goto out;
 
-	list_add_tail(&pt->active_list, &obj->active_list_head);
+	/*
+	 * Insert in signaling order. New pts usually signal last, so look
+	 * from the tail; this is where the walk stops right away.
+	 */
+	list_for_each_entry_reverse(pos, &obj->active_list_head, active_list)
+		if (obj->ops->compare(pos, pt) <= 0)
+			break;
+	list_add(&pt->active_list, &pos->active_list);
 
 out:
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
@@ -509,6 +536,7 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 		list_for_each_safe(pos, n, &fence->waiter_list_head)
 			list_move(pos, &signaled_waiters);
 
+		fence->timestamp = ktime_get();
 		fence->status = status;
 	} else {
 		status = 0;
@@ -588,16 +616,73 @@ static bool sync_fence_check(struct sync_fence *fence)
 	return fence->status != 0;
 }
 
+/*
+ * A fence is expected to signal soon when each of its pending pts is the
+ * next one its timeline will signal.
+ */
+static bool sync_fence_imminent(struct sync_fence *fence)
+{
+	struct sync_pt *pt;
+	struct sync_timeline *obj;
+	unsigned long flags;
+	bool next;
+
+	list_for_each_entry(pt, &fence->pt_list_head, pt_list) {
+		obj = pt->parent;
+
+		spin_lock_irqsave(&obj->active_list_lock, flags);
+		next = list_empty(&pt->active_list) ||
+			obj->active_list_head.next == &pt->active_list;
+		spin_unlock_irqrestore(&obj->active_list_lock, flags);
+
+		if (!next)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Busy-wait up to sync_wait_spin_us for an imminent fence, which is far
+ * cheaper than a sleep and wakeup when the signal is only microseconds
+ * away. Returns whether the fence signaled.
+ */
+static bool sync_fence_spin(struct sync_fence *fence)
+{
+	unsigned int spin_us = ACCESS_ONCE(sync_wait_spin_us);
+	u64 deadline;
+
+	if (!spin_us || num_online_cpus() == 1 || !sync_fence_imminent(fence))
+		return false;
+
+	deadline = local_clock() + spin_us * NSEC_PER_USEC;
+	while (!sync_fence_check(fence)) {
+		if (need_resched() || signal_pending(current) ||
+		    local_clock() > deadline)
+			return false;
+		cpu_relax();
+	}
+
+	return true;
+}
+
 int sync_fence_wait(struct sync_fence *fence, long timeout)
 {
 	int err = 0;
 	struct sync_pt *pt;
+	bool waited, spun = false;
 
 	trace_sync_wait(fence, 1);
 	list_for_each_entry(pt, &fence->pt_list_head, pt_list)
 		trace_sync_pt(pt);
 
-	if (timeout > 0) {
+	waited = timeout && !sync_fence_check(fence);
+	if (waited)
+		spun = sync_fence_spin(fence);
+
+	if (spun) {
+		err = 1;
+	} else if (timeout > 0) {
 		timeout = msecs_to_jiffies(timeout);
 		err = wait_event_interruptible_timeout(fence->wq,
 						       sync_fence_check(fence),
@@ -608,6 +693,9 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 	}
 	trace_sync_wait(fence, 0);
 
+	if (waited && fence->status)
+		trace_sync_wake(fence, spun);
+
 	if (err < 0)
 		return err;
 
@@ -39,6 +39,8 @@ struct sync_fence;
  *			  1 if b will signal before a
  *			  0 if a and b will signal at the same time
  *			 -1 if a will signabl before b
+ *			  sync_timeline_signal() relies on this to find the
+ *			  pts that signaled, so has_signaled must agree
  * @free_pt:		called before sync_pt is freed
  * @release_obj:	called before sync_timeline is freed
  * @print_obj:		deprecated
@@ -95,7 +97,9 @@ struct sync_timeline_ops {
  * @child_list_head:	list of children sync_pts for this sync_timeline
  * @child_list_lock:	lock protecting @child_list_head, destroyed, and
  *			  sync_pt.status
- * @active_list_head:	list of active (unsignaled/errored) sync_pts
+ * @active_list_head:	list of active (unsignaled/errored) sync_pts, in the
+ *			  order they will signal as given by ops->compare
+ * @active_list_lock:	lock protecting @active_list_head and sync_pt.status
  * @sync_timeline_list:	membership in global sync_timeline_list
  */
 struct sync_timeline {
@@ -153,6 +157,7 @@ struct sync_pt {
  * @waiter_list_head:	list of asynchronous waiters on this fence
  * @waiter_list_lock:	lock protecting @waiter_list_head and @status
  * @status:		1: signaled, 0:active, <0: error
+ * @timestamp:		time @status left 0, to trace the wakeup latency
  *
  * @wq:			wait queue for fence signaling
  * @sync_fence_list:	membership in global fence list
@@ -168,6 +173,7 @@ struct sync_fence {
 	struct list_head	waiter_list_head;
 	spinlock_t		waiter_list_lock; /* also protects status */
 	int			status;
+	ktime_t			timestamp;
 
 	wait_queue_head_t	wq;
 
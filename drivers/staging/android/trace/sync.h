@@ -53,6 +53,31 @@ TRACE_EVENT(sync_wait,
 			__get_str(name), __entry->status)
 );
 
+TRACE_EVENT(sync_wake,
+	TP_PROTO(struct sync_fence *fence, bool spun),
+
+	TP_ARGS(fence, spun),
+
+	TP_STRUCT__entry(
+			__string(name, fence->name)
+			__field(s32, status)
+			__field(s64, latency)
+			__field(bool, spun)
+	),
+
+	TP_fast_assign(
+			__assign_str(name, fence->name);
+			__entry->status = fence->status;
+			__entry->latency = ktime_to_ns(ktime_sub(ktime_get(),
+							fence->timestamp));
+			__entry->spun = spun;
+	),
+
+	TP_printk("name=%s state=%d latency=%lldns %s", __get_str(name),
+			__entry->status, __entry->latency,
+			__entry->spun ? "spun" : "slept")
+);
+
 TRACE_EVENT(sync_pt,
 	TP_PROTO(struct sync_pt *pt),
 
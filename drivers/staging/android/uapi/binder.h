@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -69,6 +70,29 @@ struct flat_binder_object {
 	binder_uintptr_t	cookie;
 };
 
+/*
+ * A scatter-gather buffer, only accepted by BC_TRANSACTION_SG and
+ * BC_REPLY_SG. The driver copies 'length' bytes from 'buffer' straight
+ * into the target's transaction buffer, behind the offsets, and rewrites
+ * 'buffer' to the address of the copy in the target. If
+ * BINDER_BUFFER_FLAG_HAS_PARENT is set, 'parent' is the index in the
+ * offsets array of an earlier buffer object and the pointer stored at
+ * 'parent_offset' in that buffer is rewritten as well, so that the
+ * target sees an intact tree of pointers.
+ */
+struct binder_buffer_object {
+	__u32			type;
+	__u32			flags;
+	binder_uintptr_t	buffer;
+	binder_size_t		length;
+	binder_size_t		parent;
+	binder_size_t		parent_offset;
+};
+
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses appropriately.
@@ -159,6 +183,11 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	binder_size_t buffers_size;	/* space for all scatter-gather buffers */
+};
+
 struct binder_ptr_cookie {
 	binder_uintptr_t ptr;
 	binder_uintptr_t cookie;
@@ -341,6 +370,14 @@ enum binder_driver_command_protocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the transaction, followed by the
+	 * total size of its BINDER_TYPE_PTR buffers, each rounded up to
+	 * 8 bytes.
+	 */
 };
 
 #endif /* _UAPI_LINUX_BINDER_H */
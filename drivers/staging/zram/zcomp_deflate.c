@@ -0,0 +1,164 @@
+/*
+ * Compressed RAM block device - deflate compression backend
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/zlib.h>
+
+#include "zcomp_deflate.h"
+
+/*
+ * Raw deflate (no zlib header) with a window of one page: nothing is ever
+ * referenced further back, and it keeps the per-stream workspace small.
+ */
+#define ZCOMP_DEFLATE_LEVEL	3
+#define ZCOMP_DEFLATE_WINBITS	12
+#define ZCOMP_DEFLATE_MEMLEVEL	8
+
+/*
+ * Decompression has no stream of its own and runs with the zsmalloc
+ * object mapped, i.e. atomically, so each cpu gets an inflate stream,
+ * allocated while any zcomp uses this backend.
+ */
+static DEFINE_PER_CPU(struct z_stream_s, zcomp_inflate_strm);
+static DEFINE_MUTEX(zcomp_inflate_lock);
+static int zcomp_inflate_users;
+
+static void zcomp_deflate_free_inflate(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct z_stream_s *strm = &per_cpu(zcomp_inflate_strm, cpu);
+
+		vfree(strm->workspace);
+		strm->workspace = NULL;
+	}
+}
+
+static int zcomp_deflate_init(void)
+{
+	int cpu, ret = 0;
+
+	mutex_lock(&zcomp_inflate_lock);
+	if (zcomp_inflate_users++)
+		goto out;
+	for_each_possible_cpu(cpu) {
+		struct z_stream_s *strm = &per_cpu(zcomp_inflate_strm, cpu);
+
+		strm->workspace = vzalloc(zlib_inflate_workspacesize());
+		if (!strm->workspace ||
+		    zlib_inflateInit2(strm, -ZCOMP_DEFLATE_WINBITS) != Z_OK) {
+			zcomp_deflate_free_inflate();
+			zcomp_inflate_users--;
+			ret = -ENOMEM;
+			break;
+		}
+	}
+out:
+	mutex_unlock(&zcomp_inflate_lock);
+	return ret;
+}
+
+static void zcomp_deflate_exit(void)
+{
+	mutex_lock(&zcomp_inflate_lock);
+	if (!--zcomp_inflate_users)
+		zcomp_deflate_free_inflate();
+	mutex_unlock(&zcomp_inflate_lock);
+}
+
+static void zcomp_deflate_destroy(void *private)
+{
+	struct z_stream_s *strm = private;
+
+	if (strm)
+		vfree(strm->workspace);
+	kfree(strm);
+}
+
+static void *zcomp_deflate_create(gfp_t flags)
+{
+	struct z_stream_s *strm;
+
+	strm = kzalloc(sizeof(*strm), flags);
+	if (!strm)
+		return NULL;
+	strm->workspace = __vmalloc(zlib_deflate_workspacesize(
+					-ZCOMP_DEFLATE_WINBITS,
+					ZCOMP_DEFLATE_MEMLEVEL),
+				    flags | __GFP_HIGHMEM, PAGE_KERNEL);
+	if (!strm->workspace ||
+	    zlib_deflateInit2(strm, ZCOMP_DEFLATE_LEVEL, Z_DEFLATED,
+			      -ZCOMP_DEFLATE_WINBITS, ZCOMP_DEFLATE_MEMLEVEL,
+			      Z_DEFAULT_STRATEGY) != Z_OK) {
+		zcomp_deflate_destroy(strm);
+		return NULL;
+	}
+	return strm;
+}
+
+static int zcomp_deflate_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	struct z_stream_s *strm = private;
+	int ret;
+
+	ret = zlib_deflateReset(strm);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	strm->next_in = src;
+	strm->avail_in = PAGE_SIZE;
+	strm->next_out = dst;
+	/* the stream buffer is two pages, for data that does not shrink */
+	strm->avail_out = 2 * PAGE_SIZE;
+	ret = zlib_deflate(strm, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return -EINVAL;
+	*dst_len = strm->total_out;
+	return 0;
+}
+
+static int zcomp_deflate_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst)
+{
+	struct z_stream_s *strm = &get_cpu_var(zcomp_inflate_strm);
+	int ret;
+
+	ret = zlib_inflateReset(strm);
+	if (ret != Z_OK)
+		goto out;
+
+	strm->next_in = src;
+	strm->avail_in = src_len;
+	strm->next_out = dst;
+	strm->avail_out = PAGE_SIZE;
+	ret = zlib_inflate(strm, Z_FINISH);
+	if (ret == Z_STREAM_END && strm->total_out == PAGE_SIZE)
+		ret = Z_OK;
+out:
+	put_cpu_var(zcomp_inflate_strm);
+	return ret == Z_OK ? 0 : -EINVAL;
+}
+
+struct zcomp_backend zcomp_deflate = {
+	.compress = zcomp_deflate_compress,
+	.decompress = zcomp_deflate_decompress,
+	.create = zcomp_deflate_create,
+	.destroy = zcomp_deflate_destroy,
+	.init = zcomp_deflate_init,
+	.exit = zcomp_deflate_exit,
+	.name = "deflate",
+};
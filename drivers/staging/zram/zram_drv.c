@@ -23,15 +23,19 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/cpumask.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/completion.h>
 
 #include "zram_drv.h"
 
@@ -42,99 +46,264 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices = 1;
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static const char *default_compressor = "lzo";
+
+static int zram_test_flag(struct zram_meta *meta, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	return meta->table[index].value & BIT(flag);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static void zram_set_flag(struct zram_meta *meta, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	meta->table[index].value |= BIT(flag);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_clear_flag(struct zram_meta *meta, u32 index,
+			enum zram_pageflags flag)
 {
-	zram_stat64_add(zram, v, 1);
+	meta->table[index].value &= ~BIT(flag);
 }
 
-static int zram_test_flag(struct zram_meta *meta, u32 index,
-			enum zram_pageflags flag)
+static size_t zram_get_obj_size(struct zram_meta *meta, u32 index)
 {
-	return meta->table[index].flags & BIT(flag);
+	return meta->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static void zram_set_flag(struct zram_meta *meta, u32 index,
-			enum zram_pageflags flag)
+static void zram_set_obj_size(struct zram_meta *meta,
+					u32 index, size_t size)
 {
-	meta->table[index].flags |= BIT(flag);
+	unsigned long flags = meta->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
-static void zram_clear_flag(struct zram_meta *meta, u32 index,
-			enum zram_pageflags flag)
+/*
+ * Table entries are protected by a bit spinlock on ZRAM_ACCESS, so
+ * that I/O to different pages never contends on a device-wide lock.
+ */
+static void zram_lock_table(struct zram_meta *meta, u32 index)
 {
-	meta->table[index].flags &= ~BIT(flag);
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 }
 
-static int page_zero_filled(void *ptr)
+static void zram_unlock_table(struct zram_meta *meta, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+/*
+ * Check whether the page consists of a single repeated machine word,
+ * which is then stored in the table entry instead of the pool.
+ */
+static bool page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
-			return 0;
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page); pos++) {
+		if (val != page[pos])
+			return false;
 	}
 
-	return 1;
+	*element = val;
+	return true;
+}
+
+/* Expand a same element page into the page aligned buffer at ptr */
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned int i;
+
+	if (value == REPEAT_BYTE(value & 0xff)) {
+		/* covers zero pages; use the arch optimised memset */
+		memset(ptr, value & 0xff, len);
+	} else {
+		for (i = 0; i < len / sizeof(*page); i++)
+			page[i] = value;
+	}
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+retry:
+	/* block 0 is never used, so that an element of 0 is never a block */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx == zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	int was_set;
+
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	WARN_ON_ONCE(!was_set);
+}
+
+/* Synchronously read one page stored at blk_idx on the backing device */
+static int read_from_bdev(struct zram *zram, struct page *page,
+			  unsigned long blk_idx)
+{
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx * (PAGE_SIZE >> SECTOR_SHIFT);
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	ret = submit_bio_wait(READ, bio);
+	bio_put(bio);
+	atomic64_inc(&zram->stats.bd_reads);
+	return ret;
+}
+
+static int read_from_bdev_buf(struct zram *zram, char *mem,
+			      unsigned long blk_idx)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = read_from_bdev(zram, page, blk_idx);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+	return ret;
+}
+
+/*
+ * Reading from the backing device sleeps, so it is done without the
+ * table entry lock; check afterwards that the entry still refers to the
+ * block that was read and has not been freed or rewritten meanwhile.
+ */
+static bool zram_wb_unchanged(struct zram_meta *meta, u32 index,
+			      unsigned long blk_idx)
+{
+	bool ret;
+
+	zram_lock_table(meta, index);
+	ret = zram_test_flag(meta, index, ZRAM_WB) &&
+		meta->table[index].element == blk_idx;
+	zram_unlock_table(meta, index);
+	return ret;
+}
+#else
+static inline void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+}
+
+static inline int read_from_bdev(struct zram *zram, struct page *page,
+				 unsigned long blk_idx)
+{
+	return -EIO;
+}
+
+static inline int read_from_bdev_buf(struct zram *zram, char *mem,
+				     unsigned long blk_idx)
+{
+	return -EIO;
+}
+
+static inline bool zram_wb_unchanged(struct zram_meta *meta, u32 index,
+				     unsigned long blk_idx)
+{
+	return true;
+}
+#endif
+
+/*
+ * To protect concurrent access to the same index entry,
+ * caller should hold this table index entry's bit_spinlock to
+ * indicate this index entry is accessing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
-	u16 size = meta->table[index].size;
+	size_t size = zram_get_obj_size(meta, index);
+
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	/* tell a writeback in flight that this entry has changed */
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, meta->table[index].element);
+		meta->table[index].element = 0;
+#ifdef CONFIG_ZRAM_WRITEBACK
+		atomic64_dec(&zram->stats.bd_count);
+#endif
+		atomic64_dec(&zram->stats.pages_stored);
+		return;
+	}
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
-			zram->stats.pages_zero--;
-		}
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_clear_flag(meta, index, ZRAM_SAME);
+		if (!meta->table[index].element)
+			atomic64_dec(&zram->stats.pages_zero);
+		atomic64_dec(&zram->stats.pages_same);
+		meta->table[index].element = 0;
 		return;
 	}
 
+	if (!handle)
+		return;
+
 	if (unlikely(size > max_zpage_size))
-		zram->stats.bad_compress--;
+		atomic64_dec(&zram->stats.bad_compress);
 
 	zs_free(meta->mem_pool, handle);
 
 	if (size <= PAGE_SIZE / 2)
-		zram->stats.good_compress--;
+		atomic64_dec(&zram->stats.good_compress);
 
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			meta->table[index].size);
-	zram->stats.pages_stored--;
+	atomic64_sub(size, &zram->stats.compr_size);
+	atomic64_dec(&zram->stats.pages_stored);
 
 	meta->table[index].handle = 0;
-	meta->table[index].size = 0;
+	zram_set_obj_size(meta, index, 0);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -145,35 +314,66 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+/*
+ * Decompress the object of a compressed (not same filled, not written
+ * back) entry into mem. The caller holds the table entry lock.
+ */
+static int zram_decompress_locked(struct zram *zram, char *mem, u32 index)
 {
-	int ret = LZO_E_OK;
-	size_t clen = PAGE_SIZE;
+	int ret = 0;
 	unsigned char *cmem;
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
-
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
+	size_t size = zram_get_obj_size(meta, index);
 
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
-	if (meta->table[index].size == PAGE_SIZE)
+	if (size == PAGE_SIZE)
 		memcpy(mem, cmem, PAGE_SIZE);
 	else
-		ret = lzo1x_decompress_safe(cmem, meta->table[index].size,
-						mem, &clen);
+		ret = zcomp_decompress(zram->comp, cmem, size, mem);
 	zs_unmap_object(meta->mem_pool, handle);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		atomic64_inc(&zram->stats.failed_reads);
+	}
+
+	return ret;
+}
+
+/* Read the full page at index into mem. May sleep. */
+static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+{
+	int ret;
+	struct zram_meta *meta = zram->meta;
+
+retry:
+	zram_lock_table(meta, index);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
+		zram_unlock_table(meta, index);
+		zram_fill_page(mem, PAGE_SIZE, element);
+		return 0;
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long blk_idx = meta->table[index].element;
+
+		zram_unlock_table(meta, index);
+		ret = read_from_bdev_buf(zram, mem, blk_idx);
+		if (!ret && !zram_wb_unchanged(meta, index, blk_idx))
+			goto retry;
 		return ret;
 	}
 
-	return 0;
+	ret = zram_decompress_locked(zram, mem, index);
+	zram_unlock_table(meta, index);
+
+	return ret;
 }
 
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
@@ -185,41 +385,57 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	struct zram_meta *meta = zram->meta;
 	page = bvec->bv_page;
 
-	if (unlikely(!meta->table[index].handle) ||
-			zram_test_flag(meta, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
-	}
-
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
 		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!uncmem) {
+			pr_info("Unable to allocate temp memory\n");
+			return -ENOMEM;
+		}
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
+		ret = zram_decompress_page(zram, uncmem, index);
+		if (!ret) {
+			user_mem = kmap_atomic(page);
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+					bvec->bv_len);
+			kunmap_atomic(user_mem);
+			flush_dcache_page(page);
+		}
+		kfree(uncmem);
+		return ret;
+	}
 
-	if (!uncmem) {
-		pr_info("Unable to allocate temp memory\n");
-		ret = -ENOMEM;
-		goto out_cleanup;
+retry:
+	zram_lock_table(meta, index);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	if (unlikely(!meta->table[index].handle) ||
+			zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
+		zram_unlock_table(meta, index);
+		handle_same_page(bvec, element);
+		return 0;
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK))
-		goto out_cleanup;
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long blk_idx = meta->table[index].element;
 
-	if (is_partial_io(bvec))
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-				bvec->bv_len);
+		zram_unlock_table(meta, index);
+		ret = read_from_bdev(zram, page, blk_idx);
+		if (!ret && !zram_wb_unchanged(meta, index, blk_idx))
+			goto retry;
+		if (!ret)
+			flush_dcache_page(page);
+		return ret;
+	}
 
-	flush_dcache_page(page);
-	ret = 0;
-out_cleanup:
+	user_mem = kmap_atomic(page);
+	ret = zram_decompress_locked(zram, user_mem, index);
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-		kfree(uncmem);
+	zram_unlock_table(meta, index);
+
+	if (!ret)
+		flush_dcache_page(page);
 	return ret;
 }
 
@@ -228,14 +444,13 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret = 0;
 	size_t clen;
-	unsigned long handle;
+	unsigned long handle, element;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm = NULL;
 
 	page = bvec->bv_page;
-	src = meta->compress_buffer;
-
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
@@ -251,14 +466,6 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (meta->table[index].handle ||
-	    zram_test_flag(meta, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec)) {
@@ -270,16 +477,33 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		zram->stats.pages_zero++;
-		zram_set_flag(meta, index, ZRAM_ZERO);
+	if (page_same_filled(uncmem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		/* Free memory associated with this sector now. */
+		zram_lock_table(meta, index);
+		zram_free_page(zram, index);
+		zram_set_flag(meta, index, ZRAM_SAME);
+		meta->table[index].element = element;
+		zram_unlock_table(meta, index);
+
+		atomic64_inc(&zram->stats.pages_same);
+		if (!element)
+			atomic64_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       meta->compress_workmem);
+	/* Only pages that really need compressing take a stream */
+	if (user_mem)
+		kunmap_atomic(user_mem);
+	zstrm = zcomp_strm_find(zram->comp);
+	if (!is_partial_io(bvec)) {
+		user_mem = kmap_atomic(page);
+		uncmem = user_mem;
+	}
+
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
 	if (!is_partial_io(bvec)) {
 		kunmap_atomic(user_mem);
@@ -287,15 +511,14 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = NULL;
 	}
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
 
+	src = zstrm->buffer;
 	if (unlikely(clen > max_zpage_size)) {
-		zram->stats.bad_compress++;
 		clen = PAGE_SIZE;
-		src = NULL;
 		if (is_partial_io(bvec))
 			src = uncmem;
 	}
@@ -309,29 +532,47 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
-	if ((clen == PAGE_SIZE) && !is_partial_io(bvec))
+	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
 		src = kmap_atomic(page);
-	memcpy(cmem, src, clen);
-	if ((clen == PAGE_SIZE) && !is_partial_io(bvec))
+		memcpy(cmem, src, PAGE_SIZE);
 		kunmap_atomic(src);
+	} else {
+		memcpy(cmem, src, clen);
+	}
 
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
 	zs_unmap_object(meta->mem_pool, handle);
 
+	/*
+	 * Free memory associated with this sector
+	 * before overwriting unused sectors.
+	 */
+	zram_lock_table(meta, index);
+	zram_free_page(zram, index);
+
 	meta->table[index].handle = handle;
-	meta->table[index].size = clen;
+	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE)
+		zram_set_flag(meta, index, ZRAM_HUGE);
+	zram_unlock_table(meta, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram->stats.pages_stored++;
+	atomic64_add(clen, &zram->stats.compr_size);
+	atomic64_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
-		zram->stats.good_compress++;
+		atomic64_inc(&zram->stats.good_compress);
+	if (clen == PAGE_SIZE)
+		atomic64_inc(&zram->stats.bad_compress);
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
 
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
@@ -340,19 +581,294 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+
+	return ret;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* number of pages written to the backing device per batch of bios */
+#define ZRAM_WB_BATCH	32
+
+struct zram_wb_batch {
+	atomic_t pending;
+	struct completion done;
+};
+
+struct zram_wb_req {
+	struct page *page;
+	struct bio *bio;
+	unsigned long blk_idx;
+	u32 index;
+};
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_batch *batch = bio->bi_private;
+
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/*
+ * Copy the uncompressed contents of the entry at index into page if it
+ * is a writeback candidate for mode, and mark it ZRAM_UNDER_WB. Any
+ * write or free of the entry before zram_wb_commit() clears that flag.
+ * The flag has no owner, so the caller holds zram->wb_lock: another
+ * writeback must not set it again in between.
+ */
+static bool zram_wb_prepare(struct zram *zram, u32 index,
+			    enum zram_wb_mode mode, struct page *page)
+{
+	struct zram_meta *meta = zram->meta;
+	bool ret = false;
+	void *mem;
+
+	zram_lock_table(meta, index);
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME) ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB))
+		goto out;
+
+	if (mode == ZRAM_WB_IDLE && !zram_test_flag(meta, index, ZRAM_IDLE))
+		goto out;
+	if (mode == ZRAM_WB_HUGE && !zram_test_flag(meta, index, ZRAM_HUGE))
+		goto out;
+
+	mem = kmap_atomic(page);
+	ret = !zram_decompress_locked(zram, mem, index);
+	kunmap_atomic(mem);
+	if (ret)
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+out:
+	zram_unlock_table(meta, index);
+	return ret;
+}
+
+/*
+ * Replace the in-memory copy of an entry with its block on the backing
+ * device once the write has completed, unless the entry was rewritten
+ * or freed in the meantime.
+ */
+static void zram_wb_commit(struct zram *zram, struct zram_wb_req *req)
+{
+	struct zram_meta *meta = zram->meta;
+	u32 index = req->index;
+	bool ok = test_bit(BIO_UPTODATE, &req->bio->bi_flags);
+
+	zram_lock_table(meta, index);
+	if (!ok || !zram_test_flag(meta, index, ZRAM_UNDER_WB)) {
+		zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+		zram_unlock_table(meta, index);
+		free_block_bdev(zram, req->blk_idx);
+		return;
+	}
+
+	zram_free_page(zram, index);
+	zram_set_flag(meta, index, ZRAM_WB);
+	meta->table[index].element = req->blk_idx;
+	zram_unlock_table(meta, index);
+
+	/* the page is still stored, only no longer in memory */
+	atomic64_inc(&zram->stats.pages_stored);
+
+	atomic64_inc(&zram->stats.bd_count);
+	atomic64_inc(&zram->stats.bd_writes);
+}
+
+/*
+ * Write the pages selected by mode to the backing device. Bios are
+ * submitted asynchronously in plugged batches of ZRAM_WB_BATCH; the
+ * table is only updated after each batch completes. The caller holds
+ * init_lock for reading; concurrent writebacks wait for each other.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	struct zram_wb_req *reqs;
+	struct zram_wb_batch batch;
+	struct blk_plug plug;
+	unsigned long nr_pages = zram->disksize >> PAGE_SHIFT;
+	u32 index = 0;
+	int i, nr, ret = 0;
+
+	reqs = kcalloc(ZRAM_WB_BATCH, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs)
+		return -ENOMEM;
+
+	mutex_lock(&zram->wb_lock);
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		reqs[i].page = alloc_page(GFP_KERNEL);
+		if (!reqs[i].page) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
+	while (index < nr_pages && !ret) {
+		nr = 0;
+		atomic_set(&batch.pending, 1);
+		init_completion(&batch.done);
+
+		blk_start_plug(&plug);
+		for (; index < nr_pages && nr < ZRAM_WB_BATCH; index++) {
+			struct zram_wb_req *req = &reqs[nr];
+			struct bio *bio;
+
+			if (!zram_wb_prepare(zram, index, mode, req->page))
+				continue;
+
+			req->index = index;
+			req->blk_idx = alloc_block_bdev(zram);
+			bio = bio_alloc(GFP_KERNEL, 1);
+			if (!req->blk_idx || !bio) {
+				ret = req->blk_idx ? -ENOMEM : -ENOSPC;
+				if (bio)
+					bio_put(bio);
+				if (req->blk_idx)
+					free_block_bdev(zram, req->blk_idx);
+				zram_lock_table(zram->meta, index);
+				zram_clear_flag(zram->meta, index, ZRAM_UNDER_WB);
+				zram_unlock_table(zram->meta, index);
+				break;
+			}
+
+			bio->bi_sector = req->blk_idx * (PAGE_SIZE >> SECTOR_SHIFT);
+			bio->bi_bdev = zram->bdev;
+			bio->bi_end_io = zram_wb_end_io;
+			bio->bi_private = &batch;
+			bio_add_page(bio, req->page, PAGE_SIZE, 0);
+			req->bio = bio;
+
+			atomic_inc(&batch.pending);
+			submit_bio(WRITE, bio);
+			nr++;
+		}
+		blk_finish_plug(&plug);
+
+		if (!atomic_dec_and_test(&batch.pending))
+			wait_for_completion(&batch.done);
+
+		for (i = 0; i < nr; i++) {
+			zram_wb_commit(zram, &reqs[i]);
+			bio_put(reqs[i].bio);
+		}
+		cond_resched();
+	}
+
+out:
+	mutex_unlock(&zram->wb_lock);
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (reqs[i].page)
+			__free_page(reqs[i].page);
+	kfree(reqs);
 	return ret;
 }
 
+/* Mark every stored entry idle; reads and writes clear the mark again */
+void zram_mark_idle(struct zram *zram)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long nr_pages = zram->disksize >> PAGE_SHIFT;
+	u32 index;
+
+	for (index = 0; index < nr_pages; index++) {
+		zram_lock_table(meta, index);
+		if (meta->table[index].handle &&
+				!zram_test_flag(meta, index, ZRAM_SAME) &&
+				!zram_test_flag(meta, index, ZRAM_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		zram_unlock_table(meta, index);
+		if (!(index % 1024))
+			cond_resched();
+	}
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	/* hope filp_close flush all of IO */
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/*
+ * Attach the block device at file_name as backing device. The caller
+ * holds init_lock for writing and the device is not initialised yet.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *file_name)
+{
+	struct file *backing_dev;
+	struct inode *inode;
+	struct block_device *bdev = NULL;
+	unsigned long nr_pages, *bitmap = NULL;
+	unsigned int old_block_size;
+	int err;
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+	/* Support only block device in this moment */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	zram_reset_bdev(zram);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+
+	pr_info("setup backing device %s\n", file_name);
+	return 0;
+out:
+	vfree(bitmap);
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(backing_dev, NULL);
+	return err;
+}
+#else
+static inline void zram_reset_bdev(struct zram *zram) {}
+#endif
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -368,10 +884,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -451,7 +967,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error;
 	}
 
@@ -470,8 +986,10 @@ static void __zram_reset_device(struct zram *zram)
 	size_t index;
 	struct zram_meta *meta;
 
-	if (!zram->init_done)
+	if (!zram->init_done) {
+		zram_reset_bdev(zram);
 		return;
+	}
 
 	meta = zram->meta;
 	zram->init_done = 0;
@@ -479,14 +997,18 @@ static void __zram_reset_device(struct zram *zram)
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		unsigned long handle = meta->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(meta, index, ZRAM_SAME) ||
+				zram_test_flag(meta, index, ZRAM_WB))
 			continue;
 
 		zs_free(meta->mem_pool, handle);
 	}
 
+	zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 	zram_meta_free(zram->meta);
 	zram->meta = NULL;
+	zram_reset_bdev(zram);
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -504,38 +1026,25 @@ void zram_reset_device(struct zram *zram)
 void zram_meta_free(struct zram_meta *meta)
 {
 	zs_destroy_pool(meta->mem_pool);
-	kfree(meta->compress_workmem);
-	free_pages((unsigned long)meta->compress_buffer, 1);
 	vfree(meta->table);
 	kfree(meta);
 }
 
-struct zram_meta *zram_meta_alloc(u64 disksize)
+struct zram_meta *zram_meta_alloc(const char *pool_name, u64 disksize)
 {
 	size_t num_pages;
 	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
 	if (!meta)
 		goto out;
 
-	meta->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!meta->compress_workmem)
-		goto free_meta;
-
-	meta->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!meta->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		goto free_workmem;
-	}
-
 	num_pages = disksize >> PAGE_SHIFT;
 	meta->table = vzalloc(num_pages * sizeof(*meta->table));
 	if (!meta->table) {
 		pr_err("Error allocating zram address table\n");
-		goto free_buffer;
+		goto free_meta;
 	}
 
-	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
+	meta->mem_pool = zs_create_pool(pool_name, GFP_NOIO | __GFP_HIGHMEM);
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto free_table;
@@ -545,10 +1054,6 @@ struct zram_meta *zram_meta_alloc(u64 disksize)
 
 free_table:
 	vfree(meta->table);
-free_buffer:
-	free_pages((unsigned long)meta->compress_buffer, 1);
-free_workmem:
-	kfree(meta->compress_workmem);
 free_meta:
 	kfree(meta);
 	meta = NULL;
@@ -556,7 +1061,8 @@ out:
 	return meta;
 }
 
-void zram_init_device(struct zram *zram, struct zram_meta *meta)
+void zram_init_device(struct zram *zram, struct zram_meta *meta,
+		      struct zcomp *comp)
 {
 	if (zram->disksize > 2 * (totalram_pages << PAGE_SHIFT)) {
 		pr_info(
@@ -576,6 +1082,7 @@ void zram_init_device(struct zram *zram, struct zram_meta *meta)
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
 	zram->meta = meta;
+	zram->comp = comp;
 	zram->init_done = 1;
 
 	pr_debug("Initialization done!\n");
@@ -587,10 +1094,10 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
-	down_write(&zram->lock);
+	zram_lock_table(zram->meta, index);
 	zram_free_page(zram, index);
-	up_write(&zram->lock);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_table(zram->meta, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -602,9 +1109,10 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = -ENOMEM;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	mutex_init(&zram->wb_lock);
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -654,6 +1162,9 @@ static int create_device(struct zram *zram, int device_id)
 	}
 
 	zram->init_done = 0;
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 	return 0;
 
 out_free_disk:
@@ -17,8 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -51,10 +53,22 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value is for
+ * object size (excluding header), the higher bits is for
+ * zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT 24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page consists entirely of one repeated machine word */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT,
+	ZRAM_ACCESS,	/* page is now accessed */
+	ZRAM_WB,	/* page is stored on the backing device */
+	ZRAM_UNDER_WB,	/* page is being written to the backing device */
+	ZRAM_HUGE,	/* incompressible page */
+	ZRAM_IDLE,	/* not accessed since last idle marking */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -63,43 +77,62 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	unsigned long handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __aligned(4);
+	union {
+		unsigned long handle;
+		/*
+		 * repeated word of a ZRAM_SAME page, or block index on the
+		 * backing device of a ZRAM_WB page
+		 */
+		unsigned long element;
+	};
+	/*
+	 * object size and zram_pageflags. The ZRAM_ACCESS bit doubles
+	 * as a bit spinlock protecting this entry.
+	 */
+	unsigned long value;
+};
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 bad_compress;	/* % of pages with compression ratio>=75% */
+	atomic64_t compr_size;		/* compressed size of pages stored */
+	atomic64_t num_reads;		/* failed + successful */
+	atomic64_t num_writes;		/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;		/* non-page-aligned I/O requests */
+	atomic64_t notify_free;		/* no. of swap slot free notifications */
+	atomic64_t pages_zero;		/* no. of zero filled pages */
+	atomic64_t pages_same;		/* no. of same element filled pages */
+	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic64_t bad_compress;	/* % of pages with compression ratio>=75% */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
+#endif
 };
 
 struct zram_meta {
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	struct zs_pool *mem_pool;
 };
 
 struct zram {
 	struct zram_meta *meta;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers, table,
-				   * 32bit stat counters against concurrent
-				   * notifications, reads and writes */
+	struct zcomp *comp;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
-	/* Prevent concurrent execution of device init, reset and R/W request */
+	/* maximum number of concurrent compression streams */
+	int max_comp_streams;
+	/* compression backend, selected before disksize is set */
+	char compressor[10];
+	/*
+	 * Prevent concurrent execution of device init, reset and R/W
+	 * request. Individual table entries are protected by their own
+	 * ZRAM_ACCESS bit spinlock, so reads and writes to different
+	 * pages proceed in parallel.
+	 */
 	struct rw_semaphore init_lock;
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
@@ -108,6 +141,17 @@ struct zram {
 	u64 disksize;	/* bytes */
 
 	struct zram_stats stats;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* optional block device for incompressible and idle pages */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* allocation bitmap of page sized blocks on bdev */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	/* one writeback at a time, see zram_wb_prepare() */
+	struct mutex wb_lock;
+#endif
 };
 
 extern struct zram *zram_devices;
@@ -117,8 +161,21 @@ extern struct attribute_group zram_disk_attr_group;
 #endif
 
 extern void zram_reset_device(struct zram *zram);
-extern struct zram_meta *zram_meta_alloc(u64 disksize);
+extern struct zram_meta *zram_meta_alloc(const char *pool_name,
+					u64 disksize);
 extern void zram_meta_free(struct zram_meta *meta);
-extern void zram_init_device(struct zram *zram, struct zram_meta *meta);
+extern void zram_init_device(struct zram *zram, struct zram_meta *meta,
+			     struct zcomp *comp);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,	/* pages marked idle by zram_mark_idle() */
+	ZRAM_WB_HUGE,	/* incompressible pages */
+};
+
+extern int zram_set_backing_dev(struct zram *zram, const char *file_name);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 
 #endif
@@ -973,6 +973,8 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 		threadgroup_change_end(tsk);
 
+		/* release_task() drops the old leader from the index */
+		lowmem_adj_tree_add(tsk);
 		release_task(leader);
 	}
 
@@ -387,6 +387,13 @@ extern unsigned int cpufreq_interactive_get_hispeed_freq(int cpu);
 extern unsigned int cpufreq_interactive_get_down_sample_time(void);
 #endif
 #endif
+#ifdef CONFIG_CPU_FREQ_GOV_SCHED
+extern void cpufreq_sched_set_util(int cpu, unsigned long util,
+				   bool invariant);
+#else
+static inline void cpufreq_sched_set_util(int cpu, unsigned long util,
+					  bool invariant) { }
+#endif
 #ifdef CONFIG_CPU_FREQ_DEFAULT_GOV_PERFORMANCE
 #define CPUFREQ_DEFAULT_GOVERNOR	(&cpufreq_gov_performance)
 #elif defined(CONFIG_CPU_FREQ_DEFAULT_GOV_POWERSAVE)
@@ -404,6 +411,9 @@ extern struct cpufreq_governor cpufreq_gov_conservative;
 #elif defined(CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE)
 extern struct cpufreq_governor cpufreq_gov_interactive;
 #define CPUFREQ_DEFAULT_GOVERNOR	(&cpufreq_gov_interactive)
+#elif defined(CONFIG_CPU_FREQ_DEFAULT_GOV_SCHED)
+extern struct cpufreq_governor cpufreq_gov_sched;
+#define CPUFREQ_DEFAULT_GOVERNOR	(&cpufreq_gov_sched)
 #endif
 
 
@@ -107,6 +107,8 @@ extern unsigned long nr_running_cpu(unsigned int cpu);
 extern int register_hmp_task_migration_notifier(struct notifier_block *nb);
 #define HMP_UP_MIGRATION       0
 #define HMP_DOWN_MIGRATION     1
+/* number of windows kept for the window-based task demand */
+#define HMP_DEMAND_WINDOWS     5
 #ifdef CONFIG_SOFT_TASK_MIGRATION
 #define HMP_PRE_UP_MIGRATION     2
 #define HMP_PRE_DOWN_MIGRATION     3
@@ -901,10 +903,28 @@ void free_sched_domains(cpumask_var_t doms[], unsigned int ndoms);
 bool cpus_share_cache(int this_cpu, int that_cpu);
 
 #ifdef CONFIG_SCHED_HMP
+/*
+ * One operating point of an hmp_domain's energy model. Capacity is on the
+ * scale of load_avg_ratio, 1024 being the fastest cpu at its top frequency;
+ * power is per cpu, in mW, while busy and while idle at that frequency.
+ */
+struct hmp_energy_state {
+	unsigned long freq;		/* kHz */
+	unsigned long capacity;
+	unsigned long busy_power;
+	unsigned long idle_power;
+};
+
+struct hmp_energy_model {
+	int nr_states;
+	struct hmp_energy_state *states;	/* by ascending frequency */
+};
+
 struct hmp_domain {
 	struct cpumask cpus;
 	struct cpumask possible_cpus;
 	struct list_head hmp_domains;
+	struct hmp_energy_model *energy;	/* NULL without a DT model */
 };
 
 extern int set_hmp_boost(int enable);
@@ -970,6 +990,14 @@ struct sched_avg {
 #ifdef CONFIG_SCHED_HMP
 	u64 hmp_last_up_migration;
 	u64 hmp_last_down_migration;
+	/*
+	 * Window-based demand: run time (frequency scaled, ns) in the
+	 * current window and the demand of the last windows, most
+	 * recent first, in [0..1024].
+	 */
+	u64 hmp_window_start;
+	u32 hmp_window_runtime;
+	u16 hmp_window_hist[HMP_DEMAND_WINDOWS];
 #endif
 	u32 usage_avg_sum;
 };
@@ -1136,6 +1164,11 @@ struct task_struct {
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	/* lowmemorykiller index of thread group leaders by oom_score_adj */
+	struct rb_node adj_node;
+	short adj_key;
+#endif
 
 	struct mm_struct *mm, *active_mm;
 #ifdef CONFIG_COMPAT_BRK
@@ -2069,6 +2102,22 @@ extern void block_all_signals(int (*notifier)(void *priv), void *priv,
 			      sigset_t *mask);
 extern void unblock_all_signals(void);
 extern void release_task(struct task_struct * p);
+
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+extern void lowmem_adj_tree_add(struct task_struct *p);
+extern void lowmem_adj_tree_del(struct task_struct *p);
+extern void lowmem_adj_tree_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_tree_add(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_tree_del(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_tree_update(struct task_struct *p)
+{
+}
+#endif
 extern int send_sig_info(int, struct siginfo *, struct task_struct *);
 extern int force_sigsegv(int, struct task_struct *);
 extern int force_sig_info(int, struct siginfo *, struct task_struct *);
@@ -0,0 +1,54 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cpufreq_sched
+
+#if !defined(_TRACE_CPUFREQ_SCHED_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_CPUFREQ_SCHED_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(cpufreq_sched_request,
+	TP_PROTO(u32 cpu_id, unsigned long util, unsigned long targfreq),
+	TP_ARGS(cpu_id, util, targfreq),
+
+	TP_STRUCT__entry(
+	    __field(          u32, cpu_id   )
+	    __field(unsigned long, util     )
+	    __field(unsigned long, targfreq )
+	   ),
+
+	TP_fast_assign(
+	    __entry->cpu_id = (u32) cpu_id;
+	    __entry->util = util;
+	    __entry->targfreq = targfreq;
+	),
+
+	TP_printk("cpu=%u util=%lu targ=%lu",
+	      __entry->cpu_id, __entry->util, __entry->targfreq)
+);
+
+TRACE_EVENT(cpufreq_sched_setspeed,
+	TP_PROTO(u32 cpu_id, unsigned long targfreq,
+		 unsigned long actualfreq),
+	TP_ARGS(cpu_id, targfreq, actualfreq),
+
+	TP_STRUCT__entry(
+	    __field(          u32, cpu_id     )
+	    __field(unsigned long, targfreq   )
+	    __field(unsigned long, actualfreq )
+	   ),
+
+	TP_fast_assign(
+	    __entry->cpu_id = (u32) cpu_id;
+	    __entry->targfreq = targfreq;
+	    __entry->actualfreq = actualfreq;
+	),
+
+	TP_printk("cpu=%u targ=%lu actual=%lu",
+	      __entry->cpu_id, __entry->targfreq,
+	      __entry->actualfreq)
+);
+
+#endif /* _TRACE_CPUFREQ_SCHED_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -115,6 +115,21 @@ struct ion_fd_data {
 	int fd;
 };
 
+/**
+ * struct ion_fd_partial_data - a shared fd and a byte range of its buffer
+ * @fd:		a file descriptor obtained from ION_IOC_SHARE or ION_IOC_MAP
+ * @offset:	start of the range in bytes
+ * @len:	length of the range in bytes
+ *
+ * The layout is the same for 32 and 64 bit userspace.
+ */
+struct ion_fd_partial_data {
+	int fd;
+	int __padding;
+	__u64 offset;
+	__u64 len;
+};
+
 /**
  * struct ion_handle_data - a handle passed to/from the kernel
  * @handle:	a handle
@@ -215,6 +230,16 @@ struct ion_preload_data {
  */
 #define ION_IOC_SYNC		_IOWR(ION_IOC_MAGIC, 7, struct ion_fd_data)
 
+/**
+ * DOC: ION_IOC_SYNC_PARTIAL - syncs a range of a shared file descriptor
+ *
+ * Like ION_IOC_SYNC but only does cache maintenance on the pages covering
+ * the given range, so a cpu that wrote a few lines of a large buffer does
+ * not pay for cleaning all of it.
+ */
+#define ION_IOC_SYNC_PARTIAL	_IOW(ION_IOC_MAGIC, 9, \
+				     struct ion_fd_partial_data)
+
 /**
  * DOC: ION_IOC_PRELOAD_ALLOC - prefetches pages to page pool
  */
@@ -1620,6 +1620,10 @@ static void __sched_fork(struct task_struct *p)
 #ifdef CONFIG_SCHED_HMP
 	p->se.avg.hmp_last_up_migration = 0;
 	p->se.avg.hmp_last_down_migration = 0;
+	p->se.avg.hmp_window_start = 0;
+	p->se.avg.hmp_window_runtime = 0;
+	memset(p->se.avg.hmp_window_hist, 0,
+	       sizeof(p->se.avg.hmp_window_hist));
 #else
 	p->se.avg.runnable_avg_period = 0;
 	p->se.avg.runnable_avg_sum = 0;
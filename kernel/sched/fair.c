@@ -695,6 +695,14 @@ __update_curr(struct cfs_rq *cfs_rq, struct sched_entity *curr,
 	update_min_vruntime(cfs_rq);
 }
 
+#ifdef CONFIG_SCHED_HMP
+static void hmp_update_demand(struct sched_entity *se, u64 now,
+			      unsigned long delta_exec);
+#else
+static inline void hmp_update_demand(struct sched_entity *se, u64 now,
+				     unsigned long delta_exec) {}
+#endif
+
 static void update_curr(struct cfs_rq *cfs_rq)
 {
 	struct sched_entity *curr = cfs_rq->curr;
@@ -722,6 +730,7 @@ static void update_curr(struct cfs_rq *cfs_rq)
 		trace_sched_stat_runtime(curtask, delta_exec, curr->vruntime);
 		cpuacct_charge(curtask, delta_exec);
 		account_group_exec_runtime(curtask, delta_exec);
+		hmp_update_demand(curr, rq_of(cfs_rq)->clock, delta_exec);
 	}
 
 	account_cfs_rq_runtime(cfs_rq, delta_exec);
@@ -1228,9 +1237,9 @@ struct hmp_global_attr {
 };
 
 #ifdef CONFIG_HMP_FREQUENCY_INVARIANT_SCALE
-#define HMP_DATA_SYSFS_MAX 14
+#define HMP_DATA_SYSFS_MAX 18
 #else
-#define HMP_DATA_SYSFS_MAX 13
+#define HMP_DATA_SYSFS_MAX 17
 #endif
 
 struct hmp_data_struct {
@@ -1592,6 +1601,133 @@ unsigned int hmp_semiboost_down_threshold = 150;
 #ifdef CONFIG_EXYNOS_MARCH_DYNAMIC_CPU_HOTPLUG
 extern unsigned int cluster1_hotplug_in_threshold_by_hmp;
 #endif
+
+/*
+ * Window-based task demand, an alternative to load_avg_ratio for placement
+ * and cpufreq: the run time of a task is accounted in fixed windows of
+ * hmp_window_size ms, aligned on the rq clock so that they line up across
+ * cpus, and its demand is the highest share of a window it ran in over the
+ * last HMP_DEMAND_WINDOWS windows and the current one.  A task that starts
+ * running heavily shows up within one window rather than after the ~100ms
+ * load_avg_ratio needs to reach the up threshold, and keeps its demand for
+ * a few windows when it goes back to sleep between frames.
+ *
+ * hmp_window_demand: use the window-based demand instead of load_avg_ratio
+ * hmp_window_size: window length in ms
+ */
+static int hmp_window_demand;
+static int hmp_window_size = 16;
+
+static inline u64 hmp_window_ns(void)
+{
+	return (u64)ACCESS_ONCE(hmp_window_size) * NSEC_PER_MSEC;
+}
+
+static inline u32 hmp_window_ratio(u64 runtime, u64 size)
+{
+	return min_t(u64, div64_u64(runtime << 10, size), 1024);
+}
+
+/* Close the current window and the empty ones up to the one holding now */
+static void hmp_roll_windows(struct sched_avg *sa, u64 now, u64 size)
+{
+	u64 nr = div64_u64(now - sa->hmp_window_start, size);
+	u16 last = hmp_window_ratio(sa->hmp_window_runtime, size);
+	int i;
+
+	for (i = HMP_DEMAND_WINDOWS - 1; i >= 0; i--) {
+		if (i >= nr)
+			sa->hmp_window_hist[i] = sa->hmp_window_hist[i - nr];
+		else if (i == nr - 1)
+			sa->hmp_window_hist[i] = last;
+		else
+			sa->hmp_window_hist[i] = 0;
+	}
+	sa->hmp_window_runtime = 0;
+	sa->hmp_window_start += nr * size;
+}
+
+/* Account delta_exec ns of run time ending at now to se; rq lock held */
+static void hmp_update_demand(struct sched_entity *se, u64 now,
+			      unsigned long delta_exec)
+{
+	struct sched_avg *sa = &se->avg;
+	u64 size = hmp_window_ns();
+	u64 end = sa->hmp_window_start + size;
+	u64 run_start = now - delta_exec;
+	u32 scale = 1024;
+
+#ifdef CONFIG_HMP_FREQUENCY_INVARIANT_SCALE
+	if (hmp_data.freqinvar_load_scale_enabled)
+		scale = freq_scale[cpu_of(rq_of(cfs_rq_of(se)))].curr_scale;
+#endif
+
+	/* clocks of different cpus may be slightly apart after migration */
+	if ((s64)(now - sa->hmp_window_start) < 0)
+		return;
+	run_start = max(run_start, sa->hmp_window_start);
+
+	if (now >= end) {
+		/* the part of this run that fell in the window being closed */
+		if (run_start < end)
+			sa->hmp_window_runtime += ((end - run_start) * scale) >> 10;
+		hmp_roll_windows(sa, now, size);
+		run_start = max(run_start, sa->hmp_window_start);
+	}
+	sa->hmp_window_runtime += ((now - run_start) * scale) >> 10;
+}
+
+/*
+ * Demand of se in [0..1024] as seen at now, without touching its windows:
+ * the current window counts as soon as it is over, or before that if it
+ * already holds more run time than the completed ones.
+ */
+static unsigned long hmp_task_demand(struct sched_entity *se, u64 now)
+{
+	struct sched_avg *sa = &se->avg;
+	u64 size = hmp_window_ns();
+	u64 nr = 0;
+	unsigned long demand;
+	int i;
+
+	if ((s64)(now - sa->hmp_window_start) > 0)
+		nr = div64_u64(now - sa->hmp_window_start, size);
+	if (nr > HMP_DEMAND_WINDOWS)
+		return 0;
+
+	demand = hmp_window_ratio(sa->hmp_window_runtime, size);
+	for (i = 0; i + nr < HMP_DEMAND_WINDOWS; i++)
+		demand = max_t(unsigned long, demand, sa->hmp_window_hist[i]);
+	return demand;
+}
+
+/* The load of a task as compared against the hmp thresholds */
+static inline unsigned long hmp_task_load(struct sched_entity *se)
+{
+	if (hmp_window_demand)
+		return hmp_task_demand(se, rq_of(cfs_rq_of(se))->clock);
+	return se->avg.load_avg_ratio;
+}
+
+/*
+ * Raise rq->hmp_heaviest_load to the load of se, enqueued on or running on
+ * rq, or clear it when rq has no fair task left; rq->lock held.
+ */
+static inline void hmp_update_heaviest(struct rq *rq, struct sched_entity *se)
+{
+	unsigned long load;
+
+	if (!rq->cfs.h_nr_running) {
+		rq->hmp_heaviest_load = 0;
+		return;
+	}
+	if (se) {
+		load = hmp_task_load(se);
+		if (load > rq->hmp_heaviest_load)
+			rq->hmp_heaviest_load = load;
+	}
+}
+
 /*
  * Needed to determine heaviest tasks etc.
  */
@@ -1599,6 +1735,9 @@ static inline unsigned int hmp_cpu_is_fastest(int cpu);
 static inline unsigned int hmp_cpu_is_slowest(int cpu);
 static inline struct hmp_domain *hmp_slower_domain(int cpu);
 static inline struct hmp_domain *hmp_faster_domain(int cpu);
+#else
+static inline void hmp_update_heaviest(struct rq *rq,
+				       struct sched_entity *se) {}
 #endif
 
 static inline void __update_task_entity_contrib(struct sched_entity *se)
@@ -1729,6 +1868,37 @@ static inline void update_rq_runnable_avg(struct rq *rq, int runnable)
 	trace_sched_rq_runnable_load(cpu_of(rq), rq->cfs.runnable_load_avg);
 }
 
+/*
+ * Report the utilization of rq to the 'sched' cpufreq governor: the larger
+ * of its recent busy time and the load of the tasks queued on it now, so a
+ * task waking up with a busy history raises it at once. With window-based
+ * demand, p (the task being enqueued or ticked, if any) is not let run
+ * below its demand either. Once the last fair task has left, 0 is reported
+ * so that the cpu does not hold its policy up while it idles.
+ */
+static inline void update_rq_cpufreq(struct rq *rq, struct task_struct *p)
+{
+#ifdef CONFIG_CPU_FREQ_GOV_SCHED
+	unsigned long util;
+	bool invariant = false;
+
+	util = (rq->avg.runnable_avg_sum << 10) /
+	       (rq->avg.runnable_avg_period + 1);
+	util = max(util, rq->avg.load_avg_ratio);
+#ifdef CONFIG_SCHED_HMP
+	if (hmp_window_demand && p)
+		util = max(util, hmp_task_demand(&p->se, rq->clock));
+#endif
+	util = min(util, 1024UL);
+	if (!rq->cfs.h_nr_running)
+		util = 0;
+#ifdef CONFIG_HMP_FREQUENCY_INVARIANT_SCALE
+	invariant = hmp_data.freqinvar_load_scale_enabled;
+#endif
+	cpufreq_sched_set_util(cpu_of(rq), util, invariant);
+#endif
+}
+
 /* Add the load generated by se into cfs_rq's child load-average */
 static inline void enqueue_entity_load_avg(struct cfs_rq *cfs_rq,
 						  struct sched_entity *se,
@@ -1820,6 +1990,9 @@ void idle_exit_fair(struct rq *this_rq)
 static inline void update_entity_load_avg(struct sched_entity *se,
 					  int update_cfs_rq) {}
 static inline void update_rq_runnable_avg(struct rq *rq, int runnable) {}
+static inline void update_rq_cpufreq(struct rq *rq, struct task_struct *p) {}
+static inline void hmp_update_heaviest(struct rq *rq,
+				       struct sched_entity *se) {}
 static inline void enqueue_entity_load_avg(struct cfs_rq *cfs_rq,
 					   struct sched_entity *se,
 					   int wakeup) {}
@@ -3085,6 +3258,8 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 		update_rq_runnable_avg(rq, rq->nr_running);
 		inc_nr_running(rq);
 	}
+	hmp_update_heaviest(rq, &p->se);
+	update_rq_cpufreq(rq, p);
 	hrtick_update(rq);
 }
 
@@ -3146,6 +3321,8 @@ static void dequeue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 		dec_nr_running(rq);
 		update_rq_runnable_avg(rq, 1);
 	}
+	hmp_update_heaviest(rq, NULL);
+	update_rq_cpufreq(rq, NULL);
 	hrtick_update(rq);
 }
 
@@ -3565,6 +3742,17 @@ static int hmp_pre_down_migration_noti(int cpu);
 DEFINE_PER_CPU(struct hmp_domain *, hmp_cpu_domain);
 static const int hmp_max_tasks=5;
 
+/*
+ * hmp_energy_available: every hmp_domain has an energy model from the DT
+ * hmp_energy_aware: place tasks by energy model instead of up/down thresholds;
+ *	off until the power numbers in the DT are measured ones, see the
+ *	energy_aware attribute
+ * hmp_energy_margin: capacity a cpu needs per 1024 of utilization
+ */
+static int hmp_energy_available;
+static int hmp_energy_aware;
+static unsigned int hmp_energy_margin = 1280;
+
 extern void __init arch_get_hmp_domains(struct list_head *hmp_domains_list);
 
 /* Setup hmp_domains */
@@ -3586,14 +3774,18 @@ static int __init hmp_cpu_mask_setup(void)
 
 	/* Print hmp_domains */
 	dc = 0;
+	hmp_energy_available = 1;
 	list_for_each(pos, &hmp_domains) {
 		domain = list_entry(pos, struct hmp_domain, hmp_domains);
 		cpulist_scnprintf(buf, 64, &domain->possible_cpus);
-		pr_debug("  HMP domain %d: %s\n", dc, buf);
+		pr_debug("  HMP domain %d: %s, %d energy states\n", dc, buf,
+			 domain->energy ? domain->energy->nr_states : 0);
 
 		for_each_cpu_mask(cpu, domain->possible_cpus) {
 			per_cpu(hmp_cpu_domain, cpu) = domain;
 		}
+		if (!domain->energy)
+			hmp_energy_available = 0;
 		dc++;
 	}
 
@@ -3635,7 +3827,7 @@ static struct sched_entity *hmp_get_heaviest_task(struct sched_entity* se, int m
 {
 	int num_tasks = hmp_max_tasks;
 	struct sched_entity *max_se = se;
-	unsigned long int max_ratio = se->avg.load_avg_ratio;
+	unsigned long int max_ratio = hmp_task_load(se);
 	const struct cpumask *hmp_target_mask = NULL;
 
 	if (migrate_up) {
@@ -3652,12 +3844,14 @@ static struct sched_entity *hmp_get_heaviest_task(struct sched_entity* se, int m
 
 	while(num_tasks && se) {
 		if (entity_is_task(se)) {
-			if(se->avg.load_avg_ratio > max_ratio &&
+			unsigned long int ratio = hmp_task_load(se);
+
+			if(ratio > max_ratio &&
 					(hmp_target_mask &&
 					 cpumask_intersects(hmp_target_mask,
 						 tsk_cpus_allowed(task_of(se))))) {
 				max_se = se;
-				max_ratio = se->avg.load_avg_ratio;
+				max_ratio = ratio;
 			}
 		}
 		se = __pick_next_entity(se);
@@ -3687,12 +3881,14 @@ static struct sched_entity *hmp_get_lightest_task(struct sched_entity* se, int m
 
 	while(num_tasks && se) {
 		if (entity_is_task(se)) {
-			if(se->avg.load_avg_ratio < min_ratio &&
+			unsigned long int ratio = hmp_task_load(se);
+
+			if(ratio < min_ratio &&
 					(hmp_target_mask &&
 					 cpumask_intersects(hmp_target_mask,
 						 tsk_cpus_allowed(task_of(se))))) {
 				min_se = se;
-				min_ratio = se->avg.load_avg_ratio;
+				min_ratio = ratio;
 			}
 		}
 		se = __pick_next_entity(se);
@@ -4205,6 +4401,36 @@ int set_hmp_down_threshold(int value)
 	return hmp_down_threshold_from_sysfs(value);
 }
 
+/* energy_aware can only be turned on with a model for every domain */
+static int hmp_energy_aware_from_sysfs(int value)
+{
+	if (value < 0 || value > 1 || (value && !hmp_energy_available))
+		return -1;
+	return value;
+}
+
+static int hmp_energy_margin_from_sysfs(int value)
+{
+	if (value < 1024 || value > 4096)
+		return -1;
+	return value;
+}
+
+static int hmp_window_demand_from_sysfs(int value)
+{
+	if (value < 0 || value > 1)
+		return -1;
+	return value;
+}
+
+/* a window must not be shorter than a tick, which is what accounts it */
+static int hmp_window_size_from_sysfs(int value)
+{
+	if (value < (int)jiffies_to_msecs(1) || value > 100)
+		return -1;
+	return value;
+}
+
 #ifdef CONFIG_HMP_FREQUENCY_INVARIANT_SCALE
 /* freqinvar control is only 0,1 off/on */
 static int hmp_freqinvar_from_sysfs(int value)
@@ -4299,6 +4525,24 @@ static int hmp_attr_init(void)
 		NULL,
 		hmp_aggressive_yield_from_sysfs);
 
+	hmp_attr_add("energy_aware",
+		&hmp_energy_aware,
+		NULL,
+		hmp_energy_aware_from_sysfs);
+	hmp_attr_add("energy_margin",
+		(int *)&hmp_energy_margin,
+		NULL,
+		hmp_energy_margin_from_sysfs);
+
+	hmp_attr_add("window_demand",
+		&hmp_window_demand,
+		NULL,
+		hmp_window_demand_from_sysfs);
+	hmp_attr_add("window_size_ms",
+		&hmp_window_size,
+		NULL,
+		hmp_window_size_from_sysfs);
+
 #ifdef CONFIG_HMP_FREQUENCY_INVARIANT_SCALE
 	/* default frequency-invariant scaling ON */
 	hmp_data.freqinvar_load_scale_enabled = 1;
@@ -4381,6 +4625,134 @@ static inline unsigned int hmp_domain_min_load(struct hmp_domain *hmpd,
 	return min_runnable_load;
 }
 
+/*
+ * Energy-aware placement
+ *
+ * Each hmp_domain may carry an energy model: per operating point, the
+ * capacity of one of its cpus and the power it draws while busy and while
+ * idle. Utilization is load_avg_ratio converted to that absolute capacity
+ * scale using the top capacity of the domain it was measured in.
+ *
+ * The cost of a placement is the estimated power of the domains involved,
+ * with the domain running at the lowest operating point that covers its
+ * busiest cpu, and each cpu busy for util/capacity of the time. A task is
+ * placed on the cpu that fits its demand with hmp_energy_margin headroom
+ * at the lowest cost; if none fits, on the one with the most spare room.
+ */
+static inline unsigned long hmp_max_capacity(struct hmp_domain *hmpd)
+{
+	return hmpd->energy->states[hmpd->energy->nr_states - 1].capacity;
+}
+
+static inline unsigned long hmp_cpu_util(int cpu)
+{
+	return (cpu_rq(cpu)->avg.load_avg_ratio *
+		hmp_max_capacity(hmp_cpu_domain(cpu))) >> 10;
+}
+
+/* utilization of cpu once 'demand' moved from src_cpu to dst_cpu */
+static unsigned long hmp_energy_util(int cpu, int src_cpu, int dst_cpu,
+				     unsigned long demand)
+{
+	unsigned long util = hmp_cpu_util(cpu);
+
+	if (cpu == src_cpu)
+		util = util > demand ? util - demand : 0;
+	if (cpu == dst_cpu)
+		util += demand;
+	return util;
+}
+
+static unsigned long hmp_domain_energy(struct hmp_domain *hmpd, int src_cpu,
+				       int dst_cpu, unsigned long demand)
+{
+	struct hmp_energy_model *em = hmpd->energy;
+	struct hmp_energy_state *state;
+	unsigned long util, max_util = 0, energy = 0;
+	int cpu, i;
+
+	for_each_cpu_and(cpu, &hmpd->cpus, cpu_online_mask)
+		max_util = max(max_util,
+			       hmp_energy_util(cpu, src_cpu, dst_cpu, demand));
+
+	for (i = 0; i < em->nr_states - 1; i++)
+		if (em->states[i].capacity >= max_util)
+			break;
+	state = &em->states[i];
+
+	for_each_cpu_and(cpu, &hmpd->cpus, cpu_online_mask) {
+		util = min(hmp_energy_util(cpu, src_cpu, dst_cpu, demand),
+			   state->capacity);
+		energy += (util * state->busy_power +
+			   (state->capacity - util) * state->idle_power) /
+			  state->capacity;
+	}
+	return energy;
+}
+
+static inline bool hmp_energy_fits(struct hmp_domain *hmpd, unsigned long util)
+{
+	return util * hmp_energy_margin <= hmp_max_capacity(hmpd) << 10;
+}
+
+/*
+ * hmp_energy_select_cpu - the cpu task p, now on cpu, should run on.
+ * Candidates are cpu itself and the least loaded allowed cpu of each
+ * other domain.
+ */
+static int hmp_energy_select_cpu(struct task_struct *p, int cpu)
+{
+	struct hmp_domain *src = hmp_cpu_domain(cpu), *hmpd;
+	unsigned long demand, util, src_energy, src_energy_without;
+	long cost, best_cost = LONG_MAX, spare, best_spare = LONG_MIN;
+	int target, best_cpu = NR_CPUS, spare_cpu = cpu;
+
+	demand = (hmp_task_load(&p->se) * hmp_max_capacity(src)) >> 10;
+	src_energy = hmp_domain_energy(src, -1, -1, 0);
+	src_energy_without = hmp_domain_energy(src, cpu, -1, demand);
+
+	list_for_each_entry(hmpd, &hmp_domains, hmp_domains) {
+		if (hmpd == src)
+			target = cpu;
+		else
+			hmp_domain_min_load(hmpd, &target, tsk_cpus_allowed(p));
+		if (target >= NR_CPUS)
+			continue;
+
+		util = hmp_energy_util(target, cpu, target, demand);
+		if (!hmp_energy_fits(hmpd, util)) {
+			spare = (long)hmp_max_capacity(hmpd) - (long)util;
+			if (spare > best_spare) {
+				best_spare = spare;
+				spare_cpu = target;
+			}
+			continue;
+		}
+
+		/* energy of the move relative to leaving the task where it is */
+		if (hmpd == src)
+			cost = 0;
+		else
+			cost = (long)src_energy_without - (long)src_energy +
+			       (long)hmp_domain_energy(hmpd, -1, target, demand) -
+			       (long)hmp_domain_energy(hmpd, -1, -1, 0);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_cpu = target;
+		}
+	}
+
+	return best_cpu < NR_CPUS ? best_cpu : spare_cpu;
+}
+
+/* Does the energy model place the task of se, now on cpu, in hmpd? */
+static inline bool hmp_energy_prefers(struct sched_entity *se, int cpu,
+				      struct hmp_domain *hmpd)
+{
+	return cpumask_test_cpu(hmp_energy_select_cpu(task_of(se), cpu),
+				&hmpd->cpus);
+}
+
 /*
  * Calculate the task starvation
  * This is the ratio of actually running time vs. runnable time.
@@ -6935,6 +7307,7 @@ static unsigned int hmp_up_migration(int cpu, int *target_cpu, struct sched_enti
 	int temp_target_cpu;
 	unsigned int up_threshold;
 	unsigned int min_load;
+	unsigned long load;
 	u64 now;
 
 	if (hmp_cpu_is_fastest(cpu))
@@ -6950,9 +7323,10 @@ static unsigned int hmp_up_migration(int cpu, int *target_cpu, struct sched_enti
 			up_threshold = hmp_semiboost_up_threshold;
 		else
 			up_threshold = hmp_up_threshold;
+		load = hmp_task_load(se);
 
 #ifdef CONFIG_EXYNOS_MARCH_DYNAMIC_CPU_HOTPLUG
-		if (se->avg.load_avg_ratio > cluster1_hotplug_in_threshold_by_hmp) {
+		if (load > cluster1_hotplug_in_threshold_by_hmp) {
 			struct cpumask big_online_cpumask;
 			int fast_online_num;
 			if (!spin_trylock(&hmp_hotplug_migration)) {
@@ -6970,9 +7344,14 @@ static unsigned int hmp_up_migration(int cpu, int *target_cpu, struct sched_enti
 			}
 		}
 #else
-		if (se->avg.load_avg_ratio < up_threshold)
+		if (!hmp_energy_aware && load < up_threshold)
 			return 0;
 #endif
+		/* semiboost still sends tasks above its threshold up */
+		if (hmp_energy_aware &&
+		    !(hmp_semiboost() && load >= up_threshold) &&
+		    !hmp_energy_prefers(se, cpu, hmp_faster_domain(cpu)))
+			return 0;
 	}
 
 	/* Let the task load settle before doing another up migration */
@@ -7051,7 +7430,16 @@ static unsigned int hmp_down_migration(int cpu, struct sched_entity *se)
 		else
 			down_threshold = hmp_down_threshold;
 
-		if (se->avg.load_avg_ratio < down_threshold)
+		if (hmp_energy_aware) {
+			/* semiboost keeps tasks above its threshold up */
+			if (hmp_semiboost() &&
+			    hmp_task_load(se) >= down_threshold)
+				return 0;
+			return hmp_energy_prefers(se, cpu,
+						  hmp_slower_domain(cpu));
+		}
+
+		if (hmp_task_load(se) < down_threshold)
 			return 1;
 	}
 	return 0;
@@ -7318,95 +7706,191 @@ out_unlock:
 	return 0;
 }
 
-static DEFINE_SPINLOCK(hmp_force_migration);
+/*
+ * Each cpu only checks its own runqueue for tasks to force up or offload,
+ * from its own tick, and idle pull only locks the slower cpu with the
+ * heaviest cached candidate: neither takes a global lock nor scans the
+ * runqueues of other cpus under their rq->lock.
+ */
+static inline unsigned int hmp_up_threshold_now(void)
+{
+	return hmp_semiboost() ? hmp_semiboost_up_threshold : hmp_up_threshold;
+}
+
+static inline unsigned int hmp_down_threshold_now(void)
+{
+	return hmp_semiboost() ? hmp_semiboost_down_threshold :
+				 hmp_down_threshold;
+}
+
+/* O(1), without rq->lock: could hmp_force_up_migration() act on cpu? */
+static inline int hmp_force_check_needed(int cpu, struct rq *rq)
+{
+	unsigned int nr_running = ACCESS_ONCE(rq->cfs.h_nr_running);
+	unsigned long load;
+
+	if (!nr_running)
+		return 0;
+	/* hmp_offload_down() */
+	if (nr_running > 1 && !hmp_cpu_is_slowest(cpu) &&
+	    !hmp_aggressive_up_migration)
+		return 1;
+	if (hmp_cpu_is_fastest(cpu))
+		return 0;
+	if (hmp_boost())
+		return 1;
+
+	load = ACCESS_ONCE(rq->hmp_heaviest_load);
+#ifdef CONFIG_EXYNOS_MARCH_DYNAMIC_CPU_HOTPLUG
+	/* bringing the big cluster in */
+	if (load > cluster1_hotplug_in_threshold_by_hmp)
+		return 1;
+#endif
+	/*
+	 * The energy model moves a task up mostly when its cpu no longer
+	 * fits its load with hmp_energy_margin headroom.
+	 */
+	if (hmp_energy_aware)
+		return (hmp_semiboost() && load >= hmp_up_threshold_now()) ||
+		       !hmp_energy_fits(hmp_cpu_domain(cpu), hmp_cpu_util(cpu));
+#ifdef CONFIG_EXYNOS_MARCH_DYNAMIC_CPU_HOTPLUG
+	/*
+	 * hmp_up_migration() has no load threshold then, but a task below
+	 * the down threshold would only be sent back down.
+	 */
+	return load >= hmp_down_threshold_now();
+#else
+	return load >= hmp_up_threshold_now();
+#endif
+}
+
+/* Time rq->lock is held by the forced migration checks, for schedstats */
+static inline u64 hmp_lock_stamp(void)
+{
+#ifdef CONFIG_SCHEDSTATS
+	return local_clock();
+#else
+	return 0;
+#endif
+}
+
+static inline void hmp_lock_stat(struct rq *rq, u64 start, int idle_pull)
+{
+#ifdef CONFIG_SCHEDSTATS
+	u64 held = local_clock() - start;
+
+	if (idle_pull) {
+		rq->hmp_pull_count++;
+		rq->hmp_pull_lock_time += held;
+		rq->hmp_pull_lock_max = max(rq->hmp_pull_lock_max, held);
+	} else {
+		rq->hmp_force_count++;
+		rq->hmp_force_lock_time += held;
+		rq->hmp_force_lock_max = max(rq->hmp_force_lock_max, held);
+	}
+#endif
+}
+
+/* The task that runs the fair class on rq, through its group entities */
+static inline struct sched_entity *hmp_running_entity(struct rq *rq)
+{
+	struct sched_entity *curr = rq->cfs.curr;
+	struct cfs_rq *cfs_rq;
+
+	while (curr && !entity_is_task(curr)) {
+		cfs_rq = group_cfs_rq(curr);
+		curr = cfs_rq->curr;
+	}
+	return curr;
+}
 
 /*
- * hmp_force_up_migration checks runqueues for tasks that need to
- * be actively migrated to a faster cpu.
+ * Called from the tick with rq->lock held: note the load of the running
+ * task and have trigger_load_balance() raise the softirq this tick when
+ * it may need to be forced up, leaving rq->next_balance alone.
+ */
+static void hmp_tick(struct rq *rq, struct task_struct *curr)
+{
+	hmp_update_heaviest(rq, &curr->se);
+	if (!hmp_cpu_is_fastest(cpu_of(rq)) &&
+	    hmp_force_check_needed(cpu_of(rq), rq))
+		rq->hmp_force_pending = 1;
+}
+
+/*
+ * hmp_force_up_migration checks the runqueue of this_cpu for tasks that
+ * need to be actively migrated to a faster cpu, or offloaded to an idle
+ * slower one.
  */
 static void hmp_force_up_migration(int this_cpu)
 {
-	int cpu, target_cpu;
+	int target_cpu;
 	struct sched_entity *curr, *orig;
-	struct rq *target;
+	struct rq *target = cpu_rq(this_cpu);
 	unsigned long flags;
-	unsigned int force;
+	unsigned int force = 0;
 	struct task_struct *p;
+	u64 start;
 
-	if (!spin_trylock(&hmp_force_migration)) {
-		//trace_printk("CPU%d FAILED TO GET MIGRATION SPINLOCK\n", this_cpu);
+	target->hmp_force_pending = 0;
+	if (!hmp_force_check_needed(this_cpu, target))
 		return;
-	}
-	//trace_printk("hmp_force_up_migration spinlock TAKEN cpu=%d\n", this_cpu);
-
-	for_each_online_cpu(cpu) {
-		force = 0;
-		target = cpu_rq(cpu);
-		raw_spin_lock_irqsave(&target->lock, flags);
-		curr = target->cfs.curr;
-		if (!curr) {
-			raw_spin_unlock_irqrestore(&target->lock, flags);
-			continue;
-		}
-		//trace_printk("examining CPU%d\n", cpu);
-		if (!entity_is_task(curr)) {
-			struct cfs_rq *cfs_rq;
-
-			cfs_rq = group_cfs_rq(curr);
-			while (cfs_rq) {
-				curr = cfs_rq->curr;
-				cfs_rq = group_cfs_rq(curr);
-			}
-		}
-		orig = curr;
-		curr = hmp_get_heaviest_task(curr, 1);
 
-		p = task_of(curr);
-		if (hmp_up_migration(cpu, &target_cpu, curr)) {
-			if (!target->active_balance) {
+	raw_spin_lock_irqsave(&target->lock, flags);
+	start = hmp_lock_stamp();
+	curr = hmp_running_entity(target);
+	if (!curr)
+		goto out;
+
+	orig = curr;
+	curr = hmp_get_heaviest_task(curr, 1);
+	target->hmp_heaviest_load = hmp_task_load(curr);
+
+	p = task_of(curr);
+	if (hmp_up_migration(this_cpu, &target_cpu, curr)) {
+		if (!target->active_balance) {
 #ifdef CONFIG_SOFT_TASK_MIGRATION
-				if (!(hmp_pre_up_migration_noti(target_cpu) & NOTIFY_STOP_MASK)) {
+			if (!(hmp_pre_up_migration_noti(target_cpu) & NOTIFY_STOP_MASK)) {
 #endif//CONFIG_SOFT_TASK_MIGRATION
-				get_task_struct(p);
-				target->active_balance = 1;
-				target->push_cpu = target_cpu;
-				target->migrate_task = p;
-				force = 1;
-				trace_sched_hmp_migrate(p, target->push_cpu,
-					HMP_MIGRATE_FORCE);
-				hmp_next_up_delay(&p->se, target->push_cpu);
+			get_task_struct(p);
+			target->active_balance = 1;
+			target->push_cpu = target_cpu;
+			target->migrate_task = p;
+			force = 1;
+			trace_sched_hmp_migrate(p, target->push_cpu,
+				HMP_MIGRATE_FORCE);
+			hmp_next_up_delay(&p->se, target->push_cpu);
 #ifdef CONFIG_SOFT_TASK_MIGRATION
-				}
-#endif//CONFIG_SOFT_TASK_MIGRATION
 			}
+#endif//CONFIG_SOFT_TASK_MIGRATION
 		}
-		if (!force && !target->active_balance) {
-			/*
-			 * For now we just check the currently running task.
-			 * Selecting the lightest task for offloading will
-			 * require extensive book keeping.
-			 */
-			curr = hmp_get_lightest_task(orig, 1);
-			p = task_of(curr);
-			target->push_cpu = hmp_offload_down(cpu, curr);
-			if (target->push_cpu < NR_CPUS) {
-				get_task_struct(p);
-				target->active_balance = 1;
-				target->migrate_task = p;
-				force = 1;
-				trace_sched_hmp_migrate(p, target->push_cpu,
-					HMP_MIGRATE_OFFLOAD);
-				hmp_next_down_delay(&p->se, target->push_cpu);
-			}
+	}
+	if (!force && !target->active_balance) {
+		/*
+		 * For now we just check the currently running task.
+		 * Selecting the lightest task for offloading will
+		 * require extensive book keeping.
+		 */
+		curr = hmp_get_lightest_task(orig, 1);
+		p = task_of(curr);
+		target->push_cpu = hmp_offload_down(this_cpu, curr);
+		if (target->push_cpu < NR_CPUS) {
+			get_task_struct(p);
+			target->active_balance = 1;
+			target->migrate_task = p;
+			force = 1;
+			trace_sched_hmp_migrate(p, target->push_cpu,
+				HMP_MIGRATE_OFFLOAD);
+			hmp_next_down_delay(&p->se, target->push_cpu);
 		}
-		raw_spin_unlock_irqrestore(&target->lock, flags);
-		if (force)
-			stop_one_cpu_nowait(cpu_of(target),
-				hmp_active_task_migration_cpu_stop,
-				target, &target->active_balance_work);
 	}
-	spin_unlock(&hmp_force_migration);
-	//trace_printk("spinlock RELEASE cpu %d\n", this_cpu);
+out:
+	hmp_lock_stat(target, start, 0);
+	raw_spin_unlock_irqrestore(&target->lock, flags);
+	if (force)
+		stop_one_cpu_nowait(cpu_of(target),
+			hmp_active_task_migration_cpu_stop,
+			target, &target->active_balance_work);
 }
 #else
 static void hmp_force_up_migration(int this_cpu) { }
@@ -7416,72 +7900,56 @@ static void hmp_force_up_migration(int this_cpu) { }
  * hmp_idle_pull looks at little domain runqueues to see
  * if a task should be pulled.
  *
- * Reuses hmp_force_migration spinlock.
- *
+ * The runqueue with the heaviest cached candidate is picked without
+ * locking any, then only that one is locked to check the candidate.
  */
 static unsigned int hmp_idle_pull(int this_cpu)
 {
 	int cpu;
-	struct sched_entity *curr, *orig;
+	struct sched_entity *curr;
 	struct hmp_domain *hmp_domain = NULL;
-	struct rq *target, *rq;
-	unsigned long flags,ratio = 0;
+	struct rq *target = NULL, *rq;
+	unsigned long flags,ratio = 0,load;
 	unsigned int force=0;
 	unsigned int up_threshold;
-	struct task_struct *p = NULL;
+	int boost;
+	struct task_struct *p;
+	u64 start;
 
 	if (!hmp_cpu_is_slowest(this_cpu))
 		hmp_domain = hmp_slower_domain(this_cpu);
 	if (!hmp_domain)
 		return 0;
 
-	if (!spin_trylock(&hmp_force_migration)) {
-		return 0;
-	}
-
 	/* first select a task */
+	boost = hmp_boost();
+	up_threshold = hmp_up_threshold_now();
 	for_each_cpu(cpu, &hmp_domain->cpus) {
 		rq = cpu_rq(cpu);
-		raw_spin_lock_irqsave(&rq->lock, flags);
-		curr = rq->cfs.curr;
-		if (!curr) {
-			raw_spin_unlock_irqrestore(&rq->lock, flags);
-			continue;
-		}
-		if (!entity_is_task(curr)) {
-			struct cfs_rq *cfs_rq;
-
-			cfs_rq = group_cfs_rq(curr);
-			while (cfs_rq) {
-				curr = cfs_rq->curr;
-				if(!entity_is_task(curr))
-					cfs_rq = group_cfs_rq(curr);
-				else
-					cfs_rq = NULL;
-			}
-		}
-		orig = curr;
-		curr = hmp_get_heaviest_task(curr, 1);
-		if (hmp_semiboost())
-			up_threshold = hmp_semiboost_up_threshold;
-		else
-			up_threshold = hmp_up_threshold;
-
-		if (hmp_boost() || curr->avg.load_avg_ratio > up_threshold)
-			if (curr->avg.load_avg_ratio > ratio) {
-				p = task_of(curr);
+		load = ACCESS_ONCE(rq->hmp_heaviest_load);
+		if (boost || load > up_threshold)
+			if (load > ratio) {
 				target = rq;
-				ratio = curr->avg.load_avg_ratio;
+				ratio = load;
 			}
-		raw_spin_unlock_irqrestore(&rq->lock, flags);
 	}
 
-	if ( !p )
-		goto done;
+	if (!target)
+		return 0;
 
-	/* now we have a candidate */
+	/* now check the candidate is still there */
 	raw_spin_lock_irqsave(&target->lock, flags);
-	if (!target->active_balance && task_rq(p) == target) {
+	start = hmp_lock_stamp();
+	curr = hmp_running_entity(target);
+	if (!curr) {
+		hmp_update_heaviest(target, NULL);
+		goto out;
+	}
+	curr = hmp_get_heaviest_task(curr, 1);
+	load = hmp_task_load(curr);
+	target->hmp_heaviest_load = load;
+	if ((boost || load > up_threshold) && !target->active_balance) {
+		p = task_of(curr);
 		get_task_struct(p);
 		target->active_balance = 1;
 		target->push_cpu = this_cpu;
@@ -7491,14 +7959,14 @@ static unsigned int hmp_idle_pull(int this_cpu)
 			HMP_MIGRATE_IDLE_PULL);
 		hmp_next_up_delay(&p->se, target->push_cpu);
 	}
+out:
+	hmp_lock_stat(target, start, 1);
 	raw_spin_unlock_irqrestore(&target->lock, flags);
 	if (force) {
 		stop_one_cpu_nowait(cpu_of(target),
 				hmp_idle_pull_cpu_stop,
 				target, &target->active_balance_work);
 	}
-done:
-	spin_unlock(&hmp_force_migration);
 	return force;
 }
 #else
@@ -7538,9 +8006,13 @@ static inline int on_null_domain(int cpu)
  */
 void trigger_load_balance(struct rq *rq, int cpu)
 {
+	int balance = time_after_eq(jiffies, rq->next_balance);
+
+#ifdef CONFIG_SCHED_HMP
+	balance |= rq->hmp_force_pending;
+#endif
 	/* Don't need to rebalance while attached to NULL domain */
-	if (time_after_eq(jiffies, rq->next_balance) &&
-	    likely(!on_null_domain(cpu)))
+	if (balance && likely(!on_null_domain(cpu)))
 		raise_softirq(SCHED_SOFTIRQ);
 #ifdef CONFIG_NO_HZ_COMMON
 	if (nohz_kick_needed(rq, cpu) && likely(!on_null_domain(cpu)))
@@ -7586,6 +8058,10 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 		task_tick_numa(rq, curr);
 
 	update_rq_runnable_avg(rq, 1);
+	update_rq_cpufreq(rq, curr);
+#ifdef CONFIG_SCHED_HMP
+	hmp_tick(rq, curr);
+#endif
 }
 
 /*
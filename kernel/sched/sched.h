@@ -466,6 +466,14 @@ struct rq {
 	struct cpu_stop_work active_balance_work;
 #ifdef CONFIG_SCHED_HMP
 	struct task_struct *migrate_task;
+	/*
+	 * Load of the heaviest task enqueued or ticked here since the
+	 * forced migration checks last walked this rq, for them to see
+	 * without rq->lock whether the rq is worth a look.
+	 */
+	unsigned long hmp_heaviest_load;
+	/* the tick found the forced migration checks worth running */
+	int hmp_force_pending;
 #endif
 	/* cpu of this runqueue: */
 	int cpu;
@@ -517,6 +525,16 @@ struct rq {
 	/* try_to_wake_up() stats */
 	unsigned int ttwu_count;
 	unsigned int ttwu_local;
+
+#ifdef CONFIG_SCHED_HMP
+	/* forced migration checks of this rq, and rq->lock hold time */
+	unsigned int hmp_force_count;
+	u64 hmp_force_lock_time;
+	u64 hmp_force_lock_max;
+	unsigned int hmp_pull_count;
+	u64 hmp_pull_lock_time;
+	u64 hmp_pull_lock_max;
+#endif
 #endif
 
 #ifdef CONFIG_SMP
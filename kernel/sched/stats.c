@@ -10,7 +10,7 @@
  * bump this up when changing the output format or the meaning of an existing
  * format, so that tools can adapt (or abort)
  */
-#define SCHEDSTAT_VERSION 15
+#define SCHEDSTAT_VERSION 16
 
 static int show_schedstat(struct seq_file *seq, void *v)
 {
@@ -44,6 +44,15 @@ static int show_schedstat(struct seq_file *seq, void *v)
 
 		seq_printf(seq, "\n");
 
+#ifdef CONFIG_SCHED_HMP
+		/* hmp forced migration stats */
+		seq_printf(seq, "hmp%d %u %llu %llu %u %llu %llu\n",
+		    cpu, rq->hmp_force_count,
+		    rq->hmp_force_lock_time, rq->hmp_force_lock_max,
+		    rq->hmp_pull_count,
+		    rq->hmp_pull_lock_time, rq->hmp_pull_lock_max);
+#endif
+
 #ifdef CONFIG_SMP
 		/* domain-specific stats */
 		rcu_read_lock();
@@ -0,0 +1,173 @@
+/*
+ * LZ4 - Fast LZ compression algorithm
+ *
+ * Implements the LZ4 block format designed by Yann Collet.
+ * The full LZ4 package can be found at:
+ * http://code.google.com/p/lz4/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include "lz4defs.h"
+
+static inline unsigned char *lz4_write_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+static inline unsigned char *lz4_write_literals(unsigned char *op,
+		const unsigned char *anchor, size_t len, unsigned char **token)
+{
+	*token = op++;
+	if (len >= RUN_MASK) {
+		**token = RUN_MASK << ML_BITS;
+		op = lz4_write_length(op, len - RUN_MASK);
+	} else {
+		**token = (unsigned char)(len << ML_BITS);
+	}
+	memcpy(op, anchor, len);
+	return op + len;
+}
+
+/*
+ * Count the number of bytes that match between ip and ref,
+ * stopping at limit.
+ */
+static inline const unsigned char *lz4_count(const unsigned char *ip,
+		const unsigned char *ref, const unsigned char *limit)
+{
+	while (ip + sizeof(u32) <= limit && A32(ip) == A32(ref)) {
+		ip += sizeof(u32);
+		ref += sizeof(u32);
+	}
+	while (ip < limit && *ip == *ref) {
+		ip++;
+		ref++;
+	}
+	return ip;
+}
+
+static size_t lz4_do_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, u32 *hash_table)
+{
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char *const iend = src + src_len;
+	const unsigned char *const mflimit = iend - MFLIMIT;
+	const unsigned char *const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ref;
+	unsigned char *op = dst;
+	unsigned char *token;
+	size_t len;
+
+	if (src_len < MIN_LENGTH)
+		goto last_literals;
+
+	memset(hash_table, 0, LZ4_MEM_COMPRESS);
+
+	/* First byte */
+	hash_table[LZ4_HASH_VALUE(ip)] = 0;
+	ip++;
+
+	for (;;) {
+		unsigned int attempts = 1U << SKIP_STRENGTH;
+		u32 h;
+
+		/* Find a match */
+		do {
+			unsigned int step = attempts++ >> SKIP_STRENGTH;
+
+			if (unlikely(ip > mflimit))
+				goto last_literals;
+
+			h = LZ4_HASH_VALUE(ip);
+			ref = src + hash_table[h];
+			hash_table[h] = ip - src;
+			if (ip - ref <= MAX_DISTANCE && A32(ref) == A32(ip))
+				break;
+			ip += step;
+		} while (1);
+
+		/* Catch up */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Encode literal length and copy literals */
+		op = lz4_write_literals(op, anchor, ip - anchor, &token);
+
+		for (;;) {
+			const unsigned char *mstart = ip;
+
+			/* Encode offset */
+			put_unaligned_le16((u16)(ip - ref), op);
+			op += 2;
+
+			/* Encode match length */
+			ip = lz4_count(ip + MINMATCH, ref + MINMATCH,
+					matchlimit);
+			len = ip - mstart - MINMATCH;
+			if (len >= ML_MASK) {
+				*token += ML_MASK;
+				op = lz4_write_length(op, len - ML_MASK);
+			} else {
+				*token += (unsigned char)len;
+			}
+
+			anchor = ip;
+
+			/* Test end of chunk */
+			if (ip > mflimit)
+				goto last_literals;
+
+			/* Fill table */
+			hash_table[LZ4_HASH_VALUE(ip - 2)] = ip - 2 - src;
+
+			/* Test next position for an immediate match */
+			h = LZ4_HASH_VALUE(ip);
+			ref = src + hash_table[h];
+			hash_table[h] = ip - src;
+			if (ip - ref > MAX_DISTANCE || A32(ref) != A32(ip))
+				break;
+
+			/* Match without literals */
+			token = op++;
+			*token = 0;
+		}
+
+		/* Prepare next loop */
+		ip++;
+	}
+
+last_literals:
+	/* Encode last literals */
+	op = lz4_write_literals(op, anchor, iend - anchor, &token);
+
+	return op - dst;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	if (!src_len)
+		return -EINVAL;
+
+	*dst_len = lz4_do_compress(src, src_len, dst, wrkmem);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
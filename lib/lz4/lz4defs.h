@@ -0,0 +1,51 @@
+/*
+ * lz4defs.h -- LZ4 block format constants and architecture specific defines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <asm/unaligned.h>
+
+#define A32(p)	get_unaligned((const u32 *)(p))
+
+#define COPY4(dst, src)	\
+		put_unaligned(get_unaligned((const u32 *)(src)), (u32 *)(dst))
+#if BITS_PER_LONG == 64
+#define COPY8(dst, src)	\
+		put_unaligned(get_unaligned((const u64 *)(src)), (u64 *)(dst))
+#else
+#define COPY8(dst, src)	\
+		do { COPY4(dst, src); COPY4((dst) + 4, (src) + 4); } while (0)
+#endif
+
+/*
+ * Block format constants: a match is at least MINMATCH bytes long, the
+ * last LASTLITERALS bytes of a block are always literals and the last
+ * match must start at least MFLIMIT bytes before the end of the block.
+ */
+#define MINMATCH	4
+#define LASTLITERALS	5
+#define MFLIMIT		(COPYLENGTH + MINMATCH)
+#define COPYLENGTH	8
+#define MIN_LENGTH	(MFLIMIT + 1)
+
+#define MAXD_LOG	16
+#define MAX_DISTANCE	((1 << MAXD_LOG) - 1)
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define LZ4_HASH_LOG	12
+#define LZ4_HASH_SIZE	(1 << LZ4_HASH_LOG)
+#define LZ4_HASH_VALUE(p)	\
+		((A32(p) * 2654435761U) >> ((MINMATCH * 8) - LZ4_HASH_LOG))
+
+/*
+ * Skip ahead faster over incompressible data: after 2^SKIP_STRENGTH
+ * failed attempts the step between probes grows by one byte.
+ */
+#define SKIP_STRENGTH	6
@@ -21,6 +21,7 @@
 #include <linux/eventfd.h>
 #include <linux/swap.h>
 #include <linux/printk.h>
+#include <linux/notifier.h>
 #include <linux/vmpressure.h>
 
 /*
@@ -39,15 +40,6 @@
  */
 static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
 
-/*
- * These thresholds are used when we account memory pressure through
- * scanned/reclaimed ratio. The current values were chosen empirically. In
- * essence, they are percents: the higher the value, the more number
- * unsuccessful reclaims there were.
- */
-static const unsigned int vmpressure_level_med = 60;
-static const unsigned int vmpressure_level_critical = 95;
-
 /*
  * When there are too little pages left to scan, vmpressure() may miss the
  * critical pressure as number of pages will be less than "window size".
@@ -69,11 +61,51 @@ static const unsigned int vmpressure_level_critical = 95;
  */
 static const unsigned int vmpressure_level_critical_prio = ilog2(100 / 10);
 
+/*
+ * Pressure of global (non memcg) reclaim is also accounted here and
+ * reported to in-kernel clients, such as the Android low memory killer,
+ * through vmpressure_notifier. This works with CONFIG_MEMCG disabled.
+ */
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+static void vmpressure_global_work_fn(struct work_struct *work);
+
+static struct vmpressure global_vmpressure = {
+	.sr_lock = __MUTEX_INITIALIZER(global_vmpressure.sr_lock),
+	.events = LIST_HEAD_INIT(global_vmpressure.events),
+	.events_lock = __MUTEX_INITIALIZER(global_vmpressure.events_lock),
+	.work = __WORK_INITIALIZER(global_vmpressure.work,
+				   vmpressure_global_work_fn),
+};
+
 static struct vmpressure *work_to_vmpressure(struct work_struct *work)
 {
 	return container_of(work, struct vmpressure, work);
 }
 
+static unsigned long vmpressure_calc_pressure(unsigned long scanned,
+					      unsigned long reclaimed)
+{
+	unsigned long scale = scanned + reclaimed;
+	unsigned long pressure;
+
+	/*
+	 * We calculate the ratio (in percents) of how many pages were
+	 * scanned vs. reclaimed in a given time frame (window). Note that
+	 * time is in VM reclaimer's "ticks", i.e. number of pages
+	 * scanned. This makes it possible to set desired reaction time
+	 * and serves as a ratelimit.
+	 */
+	pressure = scale - (reclaimed * scale / scanned);
+	pressure = pressure * 100 / scale;
+
+	pr_debug("%s: %3lu  (s: %lu  r: %lu)\n", __func__, pressure,
+		 scanned, reclaimed);
+
+	return pressure;
+}
+
+#ifdef CONFIG_MEMCG
 static struct vmpressure *cg_to_vmpressure(struct cgroup *cg)
 {
 	return css_to_vmpressure(cgroup_subsys_state(cg, mem_cgroup_subsys_id));
@@ -103,6 +135,15 @@ static const char * const vmpressure_str_levels[] = {
 	[VMPRESSURE_CRITICAL] = "critical",
 };
 
+/*
+ * These thresholds are used when we account memory pressure through
+ * scanned/reclaimed ratio. The current values were chosen empirically. In
+ * essence, they are percents: the higher the value, the more number
+ * unsuccessful reclaims there were.
+ */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
 static enum vmpressure_levels vmpressure_level(unsigned long pressure)
 {
 	if (pressure >= vmpressure_level_critical)
@@ -115,23 +156,7 @@ static enum vmpressure_levels vmpressure_level(unsigned long pressure)
 static enum vmpressure_levels vmpressure_calc_level(unsigned long scanned,
 						    unsigned long reclaimed)
 {
-	unsigned long scale = scanned + reclaimed;
-	unsigned long pressure;
-
-	/*
-	 * We calculate the ratio (in percents) of how many pages were
-	 * scanned vs. reclaimed in a given time frame (window). Note that
-	 * time is in VM reclaimer's "ticks", i.e. number of pages
-	 * scanned. This makes it possible to set desired reaction time
-	 * and serves as a ratelimit.
-	 */
-	pressure = scale - (reclaimed * scale / scanned);
-	pressure = pressure * 100 / scale;
-
-	pr_debug("%s: %3lu  (s: %lu  r: %lu)\n", __func__, pressure,
-		 scanned, reclaimed);
-
-	return vmpressure_level(pressure);
+	return vmpressure_level(vmpressure_calc_pressure(scanned, reclaimed));
 }
 
 struct vmpressure_event {
@@ -196,6 +221,45 @@ static void vmpressure_work_fn(struct work_struct *work)
 		 */
 	} while ((vmpr = vmpressure_parent(vmpr)));
 }
+#endif /* CONFIG_MEMCG */
+
+static void vmpressure_global_work_fn(struct work_struct *work)
+{
+	struct vmpressure *vmpr = work_to_vmpressure(work);
+	unsigned long scanned;
+	unsigned long reclaimed;
+	unsigned long pressure;
+
+	if (!vmpr->scanned)
+		return;
+
+	mutex_lock(&vmpr->sr_lock);
+	scanned = vmpr->scanned;
+	reclaimed = vmpr->reclaimed;
+	vmpr->scanned = 0;
+	vmpr->reclaimed = 0;
+	mutex_unlock(&vmpr->sr_lock);
+
+	/* reclaim can report more reclaimed than scanned pages */
+	if (reclaimed > scanned)
+		reclaimed = scanned;
+	pressure = vmpressure_calc_pressure(scanned, reclaimed);
+	blocking_notifier_call_chain(&vmpressure_notifier, pressure, NULL);
+}
+
+static void vmpressure_account(struct vmpressure *vmpr,
+			       unsigned long scanned, unsigned long reclaimed)
+{
+	mutex_lock(&vmpr->sr_lock);
+	vmpr->scanned += scanned;
+	vmpr->reclaimed += reclaimed;
+	scanned = vmpr->scanned;
+	mutex_unlock(&vmpr->sr_lock);
+
+	if (scanned < vmpressure_win || work_pending(&vmpr->work))
+		return;
+	schedule_work(&vmpr->work);
+}
 
 /**
  * vmpressure() - Account memory pressure through scanned/reclaimed ratio
@@ -213,8 +277,6 @@ static void vmpressure_work_fn(struct work_struct *work)
 void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
 		unsigned long scanned, unsigned long reclaimed)
 {
-	struct vmpressure *vmpr = memcg_to_vmpressure(memcg);
-
 	/*
 	 * Here we only want to account pressure that userland is able to
 	 * help us with. For example, suppose that DMA zone is under
@@ -240,15 +302,11 @@ void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
 	if (!scanned)
 		return;
 
-	mutex_lock(&vmpr->sr_lock);
-	vmpr->scanned += scanned;
-	vmpr->reclaimed += reclaimed;
-	scanned = vmpr->scanned;
-	mutex_unlock(&vmpr->sr_lock);
-
-	if (scanned < vmpressure_win || work_pending(&vmpr->work))
-		return;
-	schedule_work(&vmpr->work);
+	if (!memcg)
+		vmpressure_account(&global_vmpressure, scanned, reclaimed);
+#ifdef CONFIG_MEMCG
+	vmpressure_account(memcg_to_vmpressure(memcg), scanned, reclaimed);
+#endif
 }
 
 /**
@@ -281,6 +339,30 @@ void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio)
 	vmpressure(gfp, memcg, vmpressure_win, 0);
 }
 
+/**
+ * vmpressure_notifier_register() - Subscribe to global memory pressure
+ * @nb:		notifier block to add
+ *
+ * @nb is called from process context with the pressure of global
+ * reclaim, in percents (0 means every scanned page was reclaimed), as
+ * the action argument. It is called once per vmpressure_win scanned
+ * pages at most.
+ */
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+
+/**
+ * vmpressure_notifier_unregister() - Unsubscribe from global memory pressure
+ * @nb:		notifier block to remove
+ */
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+
+#ifdef CONFIG_MEMCG
 /**
  * vmpressure_register_event() - Bind vmpressure notifications to an eventfd
  * @cg:		cgroup that is interested in vmpressure notifications
@@ -372,3 +454,4 @@ void vmpressure_init(struct vmpressure *vmpr)
 	INIT_LIST_HEAD(&vmpr->events);
 	INIT_WORK(&vmpr->work, vmpressure_work_fn);
 }
+#endif /* CONFIG_MEMCG */
@@ -0,0 +1,300 @@
+/*
+ * ashmem pin and reclaim benchmark
+ *
+ * Unpins and pins back one page at a time of a private ashmem area from
+ * 1, 2, 4 and 8 threads at once and reports the aggregate number of pin
+ * and unpin pairs per second for each step. Every area has its own lock
+ * in the driver, so this should keep scaling with the number of CPUs.
+ *
+ * Then a large area is filled, unpinned around a page that stays pinned,
+ * and ASHMEM_PURGE_ALL_CACHES is issued while the pin threads keep going.
+ * The time the purge took and the worst pin or unpin latency seen during
+ * it are reported. Pinning the area back must report ASHMEM_WAS_PURGED,
+ * find the purged pages zeroed and the pinned page intact. Purging needs
+ * CAP_SYS_ADMIN; without it, that part is skipped.
+ *
+ * usage: ashmem_bench [-t seconds] [-m megabytes]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS		8
+#define AREA_PAGES		64
+
+#define ASHMEM_NOT_PURGED	0
+#define ASHMEM_WAS_PURGED	1
+
+struct ashmem_pin {
+	uint32_t offset;
+	uint32_t len;
+};
+
+#define __ASHMEMIOC		0x77
+#define ASHMEM_SET_SIZE		_IOW(__ASHMEMIOC, 3, size_t)
+#define ASHMEM_PIN		_IOW(__ASHMEMIOC, 7, struct ashmem_pin)
+#define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
+#define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+
+struct pinner {
+	pthread_t thread;
+	int fd;
+	char *map;
+	unsigned long pairs;
+	double max_latency;
+	int err;
+};
+
+static int duration = 2;
+static int purge_mb = 64;
+static long page_size;
+static struct pinner pinners[MAX_THREADS];
+static volatile int stop;
+static volatile int measuring;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ashmem_create(size_t size, char **map)
+{
+	int fd;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)
+		goto err;
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED)
+		goto err;
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static int pin_ioctl(int fd, int cmd, size_t offset, size_t len)
+{
+	struct ashmem_pin pin = { .offset = offset, .len = len };
+
+	return ioctl(fd, cmd, &pin);
+}
+
+static void *pinner_thread(void *arg)
+{
+	struct pinner *p = arg;
+	unsigned long page;
+	double start, latency;
+
+	while (!stop) {
+		page = p->pairs % AREA_PAGES;
+		start = measuring ? now() : 0;
+		if (pin_ioctl(p->fd, ASHMEM_UNPIN, page * page_size,
+			      page_size) < 0 ||
+		    pin_ioctl(p->fd, ASHMEM_PIN, page * page_size,
+			      page_size) < 0) {
+			p->err = errno;
+			break;
+		}
+		if (start) {
+			latency = now() - start;
+			if (latency > p->max_latency)
+				p->max_latency = latency;
+		}
+		p->map[page * page_size] = p->pairs;
+		p->pairs++;
+	}
+	return NULL;
+}
+
+static int start_pinners(int nthreads)
+{
+	int i;
+
+	stop = 0;
+	for (i = 0; i < nthreads; i++) {
+		struct pinner *p = &pinners[i];
+
+		memset(p, 0, sizeof(*p));
+		p->fd = ashmem_create(AREA_PAGES * page_size, &p->map);
+		if (p->fd < 0) {
+			perror("ashmem_create");
+			return -1;
+		}
+		if (pthread_create(&p->thread, NULL, pinner_thread, p)) {
+			fprintf(stderr, "pthread_create failed\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int stop_pinners(int nthreads)
+{
+	int i, ret = 0;
+
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		struct pinner *p = &pinners[i];
+
+		pthread_join(p->thread, NULL);
+		if (p->err) {
+			fprintf(stderr, "pin: %s\n", strerror(p->err));
+			ret = 1;
+		}
+		munmap(p->map, AREA_PAGES * page_size);
+		close(p->fd);
+	}
+	return ret;
+}
+
+static int run_pin_bench(int nthreads)
+{
+	unsigned long pairs = 0;
+	double start, elapsed;
+	int i, ret;
+
+	start = now();
+	if (start_pinners(nthreads))
+		return 1;
+	sleep(duration);
+	stop = 1;
+	elapsed = now() - start;
+	for (i = 0; i < nthreads; i++)
+		pairs += pinners[i].pairs;
+	ret = stop_pinners(nthreads);
+
+	printf("%d threads: %lu pin/unpin pairs in %.2fs, %.0f pairs/s\n",
+	       nthreads, pairs, elapsed, pairs / elapsed);
+	return ret;
+}
+
+static int run_purge_bench(void)
+{
+	size_t size = (size_t)purge_mb << 20;
+	size_t pages = size / page_size;
+	size_t keep = pages / 2;
+	double start, elapsed, worst = 0;
+	char *map;
+	size_t i;
+	int fd, nthreads = MAX_THREADS / 2;
+	int ret = 0;
+
+	fd = ashmem_create(size, &map);
+	if (fd < 0) {
+		perror("ashmem_create");
+		return 1;
+	}
+	for (i = 0; i < pages; i++)
+		map[i * page_size] = 1;
+
+	/* unpin everything but the page in the middle */
+	if (pin_ioctl(fd, ASHMEM_UNPIN, 0, keep * page_size) < 0 ||
+	    pin_ioctl(fd, ASHMEM_UNPIN, (keep + 1) * page_size,
+		      (pages - keep - 1) * page_size) < 0) {
+		perror("ASHMEM_UNPIN");
+		ret = 1;
+		goto out;
+	}
+
+	if (start_pinners(nthreads)) {
+		ret = 1;
+		goto out;
+	}
+	usleep(100000);
+	measuring = 1;
+	start = now();
+	if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+		if (errno == EPERM) {
+			printf("skip purge test: needs CAP_SYS_ADMIN\n");
+		} else {
+			perror("ASHMEM_PURGE_ALL_CACHES");
+			ret = 1;
+		}
+		measuring = 0;
+		ret |= stop_pinners(nthreads);
+		goto out;
+	}
+	elapsed = now() - start;
+	measuring = 0;
+	for (i = 0; i < (size_t)nthreads; i++)
+		if (pinners[i].max_latency > worst)
+			worst = pinners[i].max_latency;
+	ret |= stop_pinners(nthreads);
+
+	printf("purge of %dMB: %.3fms, worst pin/unpin latency %.3fms\n",
+	       purge_mb, elapsed * 1e3, worst * 1e3);
+
+	if (pin_ioctl(fd, ASHMEM_PIN, 0, 0) != ASHMEM_WAS_PURGED) {
+		fprintf(stderr, "purged area not reported as purged\n");
+		ret = 1;
+	}
+	for (i = 0; i < pages; i++) {
+		if (map[i * page_size] != (i == keep)) {
+			fprintf(stderr, "page %zu: %s\n", i, i == keep ?
+				"pinned page was purged" :
+				"unpinned page was not purged");
+			ret = 1;
+			break;
+		}
+	}
+out:
+	munmap(map, size);
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, fd, i;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:m:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'm':
+			purge_mb = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-m megabytes]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || purge_mb < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0) {
+		printf("skip all tests: /dev/ashmem: %s\n", strerror(errno));
+		return 0;
+	}
+	close(fd);
+
+	for (i = 1; i <= MAX_THREADS; i *= 2)
+		ret |= run_pin_bench(i);
+	ret |= run_purge_bench();
+
+	printf("ashmem_bench: %s\n", ret ? "[FAIL]" : "[PASS]");
+	return ret;
+}
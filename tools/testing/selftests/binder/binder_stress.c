@@ -0,0 +1,1089 @@
+/*
+ * binder transaction throughput and teardown stress test
+ *
+ * A forked server registers itself as the context manager and echoes
+ * every transaction back from a pool of looper threads. In the default
+ * mode the test then issues synchronous calls to it from 1, 2, 4 and 8
+ * client threads and reports the aggregate round trips per second for
+ * each step. Without a driver-wide lock this should keep scaling with
+ * the number of CPUs instead of flattening out after the first thread.
+ *
+ * With -s, short-lived client processes instead hammer the server with a
+ * mix of plain, one-way, binder-carrying and fd-returning transactions
+ * and are killed at random points, so that process and thread teardown
+ * races with transactions, node references and death notifications in
+ * flight. The server holds a death notification on every binder it is
+ * sent and the test fails unless one is delivered for each of them. A
+ * run that stops making progress is caught by an alarm.
+ *
+ * With -g, 64 KB to 1 MB payloads spread over several user buffers are
+ * sent both the traditional way, gathered into one flat parcel first,
+ * and with BC_TRANSACTION_SG, which lets the driver copy each buffer
+ * straight into the server's mapping. The throughput of both is
+ * reported for each size.
+ *
+ * With -r, one CPU hog per CPU competes with the server's SCHED_OTHER
+ * threads while a client thread calls the server, first as SCHED_FIFO
+ * and then as SCHED_OTHER. The handling thread reports its own policy,
+ * so the test fails unless it ran with the FIFO priority of the caller
+ * and dropped it again once it replied. The average and worst-case
+ * round trip of each pass are reported. This needs CAP_SYS_NICE and is
+ * skipped without it.
+ *
+ * The test needs the context manager slot and is skipped when a
+ * servicemanager already holds it.
+ *
+ * usage: binder_stress [-t seconds] [-d payload_bytes] [-s] [-p clients] [-g]
+ *                      [-r]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "binder.h"
+
+#define MAX_THREADS		8
+#define SERVER_THREADS		(2 * MAX_THREADS)
+#define STRESS_CLIENT_THREADS	3
+#define MAP_SIZE		(4 * 1024 * 1024)
+#define MAX_PAYLOAD		4096
+#define MAX_HANDLES		1024
+#define SG_CHUNKS		16
+#define SG_MIN_SIZE		(64 * 1024)
+#define SG_MAX_SIZE		(1024 * 1024)
+#define MAX_HOGS		64
+#define RT_PRIO			50
+
+enum {
+	CODE_ECHO = 1,
+	CODE_BINDER,		/* carries a local binder object */
+	CODE_GET_FD,		/* reply carries a file descriptor */
+	CODE_SUM,		/* reply carries the byte sum of the payload */
+	CODE_SINK,		/* reply carries a dummy word */
+	CODE_GET_SCHED,		/* reply carries the handler's struct sched */
+};
+
+struct sched {
+	int32_t policy;
+	int32_t priority;
+};
+
+/* counters shared between the server, the clients and the main process */
+struct shared {
+	unsigned long calls;
+	unsigned long failed;
+	unsigned long deaths;
+	unsigned long binder_clients;
+};
+
+struct cmdbuf {
+	size_t len;
+	uint8_t data[256];
+};
+
+struct client {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	binder_uintptr_t pending_free;
+	const void *reply_data;
+	size_t reply_size;
+	unsigned long calls;
+	int err;
+};
+
+static int duration = 2;
+static size_t payload = 64;
+static int nr_clients = 4;
+static struct shared *shared;
+static volatile int stop;
+
+static int binder_fd;
+static int null_fd;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static char handle_tracked[MAX_HANDLES];
+static char local_binder;
+static int sent_binder;
+static pid_t server_pid;
+static pid_t client_pids[64];
+static pid_t hog_pids[MAX_HOGS];
+static int nr_hogs;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put32(struct cmdbuf *cb, uint32_t v)
+{
+	memcpy(cb->data + cb->len, &v, sizeof(v));
+	cb->len += sizeof(v);
+}
+
+static void putptr(struct cmdbuf *cb, binder_uintptr_t v)
+{
+	memcpy(cb->data + cb->len, &v, sizeof(v));
+	cb->len += sizeof(v);
+}
+
+static void putmem(struct cmdbuf *cb, const void *p, size_t size)
+{
+	memcpy(cb->data + cb->len, p, size);
+	cb->len += size;
+}
+
+static int binder_open_map(void)
+{
+	struct binder_version vers;
+	void *map;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int binder_write_read(int fd, const void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *rconsumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (uintptr_t)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (uintptr_t)rbuf;
+	bwr.read_size = rsize;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (rconsumed)
+		*rconsumed = bwr.read_consumed;
+	return 0;
+}
+
+/* take a reference and a death notification on a handle we were sent */
+static void server_track_handle(struct cmdbuf *cb, uint32_t handle)
+{
+	struct binder_handle_cookie hc;
+
+	if (handle >= MAX_HANDLES)
+		return;
+	pthread_mutex_lock(&handles_lock);
+	if (handle_tracked[handle]) {
+		pthread_mutex_unlock(&handles_lock);
+		return;
+	}
+	handle_tracked[handle] = 1;
+	pthread_mutex_unlock(&handles_lock);
+
+	hc.handle = handle;
+	hc.cookie = handle;
+	put32(cb, BC_ACQUIRE);
+	put32(cb, handle);
+	put32(cb, BC_REQUEST_DEATH_NOTIFICATION);
+	putmem(cb, &hc, sizeof(hc));
+}
+
+static void server_dead_binder(binder_uintptr_t cookie)
+{
+	struct binder_handle_cookie hc;
+	struct cmdbuf cb = { 0 };
+	uint32_t handle = cookie;
+
+	hc.handle = handle;
+	hc.cookie = cookie;
+	put32(&cb, BC_CLEAR_DEATH_NOTIFICATION);
+	putmem(&cb, &hc, sizeof(hc));
+	put32(&cb, BC_RELEASE);
+	put32(&cb, handle);
+	put32(&cb, BC_DEAD_BINDER_DONE);
+	putptr(&cb, cookie);
+	/*
+	 * The handle can be handed out again as soon as the release is
+	 * processed, so it must be untracked before.
+	 */
+	pthread_mutex_lock(&handles_lock);
+	handle_tracked[handle] = 0;
+	pthread_mutex_unlock(&handles_lock);
+	binder_write_read(binder_fd, cb.data, cb.len, NULL, 0, NULL);
+	__sync_fetch_and_add(&shared->deaths, 1);
+}
+
+static uint32_t byte_sum(const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	uint32_t sum = 0;
+
+	while (len--)
+		sum += *b++;
+	return sum;
+}
+
+/* the payload is in the scatter-gather buffers if there are any */
+static uint32_t payload_sum(struct binder_transaction_data *tr)
+{
+	binder_size_t *offs = (void *)(uintptr_t)tr->data.ptr.offsets;
+	struct binder_buffer_object *bp;
+	uint32_t sum = 0;
+	size_t i;
+
+	if (!tr->offsets_size)
+		return byte_sum((void *)(uintptr_t)tr->data.ptr.buffer,
+				tr->data_size);
+	for (i = 0; i < tr->offsets_size / sizeof(*offs); i++) {
+		bp = (void *)(uintptr_t)(tr->data.ptr.buffer + offs[i]);
+		if (bp->type == BINDER_TYPE_PTR)
+			sum += byte_sum((void *)(uintptr_t)bp->buffer,
+					bp->length);
+	}
+	return sum;
+}
+
+static void server_transaction(struct binder_transaction_data *tr)
+{
+	struct binder_transaction_data reply;
+	struct flat_binder_object fd_obj;
+	binder_size_t fd_off = 0;
+	struct sched_param param;
+	struct cmdbuf cb = { 0 };
+	struct sched sched;
+	uint32_t sum;
+
+	if (tr->code == CODE_BINDER && tr->offsets_size) {
+		binder_size_t *offs = (void *)(uintptr_t)tr->data.ptr.offsets;
+		struct flat_binder_object *obj;
+
+		obj = (void *)(uintptr_t)(tr->data.ptr.buffer + offs[0]);
+		if (obj->type == BINDER_TYPE_HANDLE)
+			server_track_handle(&cb, obj->handle);
+	}
+
+	if (!(tr->flags & TF_ONE_WAY)) {
+		memset(&reply, 0, sizeof(reply));
+		if (tr->code == CODE_GET_FD) {
+			memset(&fd_obj, 0, sizeof(fd_obj));
+			fd_obj.type = BINDER_TYPE_FD;
+			fd_obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+			fd_obj.handle = null_fd;
+			reply.data_size = sizeof(fd_obj);
+			reply.offsets_size = sizeof(fd_off);
+			reply.data.ptr.buffer = (uintptr_t)&fd_obj;
+			reply.data.ptr.offsets = (uintptr_t)&fd_off;
+		} else if (tr->code == CODE_SUM || tr->code == CODE_SINK) {
+			sum = tr->code == CODE_SUM ? payload_sum(tr) : 0;
+			reply.data_size = sizeof(sum);
+			reply.data.ptr.buffer = (uintptr_t)&sum;
+		} else if (tr->code == CODE_GET_SCHED) {
+			sched.policy = sched_getscheduler(0) &
+				       ~SCHED_RESET_ON_FORK;
+			sched.priority = sched_getparam(0, &param) ? -1 :
+					 param.sched_priority;
+			reply.data_size = sizeof(sched);
+			reply.data.ptr.buffer = (uintptr_t)&sched;
+		} else {
+			/* echo the payload, the reply must be sent first */
+			reply.data_size = tr->data_size;
+			reply.data.ptr.buffer = tr->data.ptr.buffer;
+		}
+		put32(&cb, BC_REPLY);
+		putmem(&cb, &reply, sizeof(reply));
+	}
+	put32(&cb, BC_FREE_BUFFER);
+	putptr(&cb, tr->data.ptr.buffer);
+	binder_write_read(binder_fd, cb.data, cb.len, NULL, 0, NULL);
+}
+
+static int server_parse(uint8_t *ptr, uint8_t *end)
+{
+	struct binder_transaction_data tr;
+	struct binder_ptr_cookie pc;
+	binder_uintptr_t cookie;
+	uint32_t cmd;
+
+	while (ptr < end) {
+		memcpy(&cmd, ptr, sizeof(cmd));
+		ptr += sizeof(cmd);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_SPAWN_LOOPER:
+		case BR_OK:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+		case BR_RELEASE:
+		case BR_DECREFS:
+			/* only the context manager node lives here */
+			ptr += sizeof(pc);
+			break;
+		case BR_TRANSACTION:
+			memcpy(&tr, ptr, sizeof(tr));
+			ptr += sizeof(tr);
+			server_transaction(&tr);
+			break;
+		case BR_DEAD_BINDER:
+			memcpy(&cookie, ptr, sizeof(cookie));
+			ptr += sizeof(cookie);
+			server_dead_binder(cookie);
+			break;
+		case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+			ptr += sizeof(cookie);
+			break;
+		case BR_REPLY:
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+		default:
+			fprintf(stderr, "server: unexpected return 0x%x\n", cmd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *server_thread(void *arg)
+{
+	uint32_t cmd = BC_ENTER_LOOPER;
+	uint8_t rbuf[512];
+	size_t consumed;
+
+	binder_write_read(binder_fd, &cmd, sizeof(cmd), NULL, 0, NULL);
+	for (;;) {
+		if (binder_write_read(binder_fd, NULL, 0, rbuf, sizeof(rbuf),
+				      &consumed))
+			break;
+		if (server_parse(rbuf, rbuf + consumed))
+			break;
+	}
+	/* the main process notices a dead server through BR_DEAD_REPLY */
+	_exit(1);
+	return NULL;
+}
+
+/*
+ * Fork the context manager. Returns its pid, 0 if the slot is taken or
+ * -1 on error.
+ */
+static pid_t start_server(void)
+{
+	pthread_t thread;
+	int pipefd[2];
+	char status;
+	pid_t pid;
+	int i;
+
+	if (pipe(pipefd))
+		return -1;
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid) {
+		close(pipefd[1]);
+		if (read(pipefd[0], &status, 1) != 1)
+			status = 'e';
+		close(pipefd[0]);
+		if (status == 'k')
+			return pid;
+		waitpid(pid, NULL, 0);
+		return status == 'b' ? 0 : -1;
+	}
+
+	close(pipefd[0]);
+	status = 'e';
+	null_fd = open("/dev/null", O_RDONLY);
+	binder_fd = binder_open_map();
+	if (null_fd < 0 || binder_fd < 0)
+		goto out;
+	if (ioctl(binder_fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		if (errno == EBUSY)
+			status = 'b';
+		else
+			perror("BINDER_SET_CONTEXT_MGR");
+		goto out;
+	}
+	for (i = 0; i < SERVER_THREADS; i++) {
+		if (pthread_create(&thread, NULL, server_thread, NULL))
+			goto out;
+	}
+	status = 'k';
+out:
+	if (write(pipefd[1], &status, 1) != 1 || status != 'k')
+		_exit(1);
+	for (;;)
+		pause();
+}
+
+/*
+ * Issue one transaction to the context manager and wait for it to
+ * complete. Returns -EAGAIN if the driver failed it, e.g. for lack of
+ * buffer space, or another negative errno if binder itself failed. A
+ * non-zero @buffers_size sends it with BC_TRANSACTION_SG.
+ */
+static int client_call_sg(struct client *c, uint32_t code, uint32_t flags,
+			  const void *data, size_t size,
+			  const binder_size_t *offs, size_t offs_size,
+			  size_t buffers_size)
+{
+	struct binder_transaction_data tr;
+	struct flat_binder_object obj;
+	struct binder_ptr_cookie pc;
+	struct cmdbuf cb = { 0 };
+	uint8_t rbuf[256];
+	uint8_t *ptr, *end;
+	size_t consumed;
+	uint32_t cmd;
+	int done = 0;
+	int ret = 0;
+
+	if (c->pending_free) {
+		put32(&cb, BC_FREE_BUFFER);
+		putptr(&cb, c->pending_free);
+		c->pending_free = 0;
+	}
+	memset(&tr, 0, sizeof(tr));
+	tr.code = code;
+	tr.flags = flags;
+	tr.data_size = size;
+	tr.offsets_size = offs_size;
+	tr.data.ptr.buffer = (uintptr_t)data;
+	tr.data.ptr.offsets = (uintptr_t)offs;
+	if (buffers_size) {
+		binder_size_t bsize = buffers_size;
+
+		put32(&cb, BC_TRANSACTION_SG);
+		putmem(&cb, &tr, sizeof(tr));
+		putmem(&cb, &bsize, sizeof(bsize));
+	} else {
+		put32(&cb, BC_TRANSACTION);
+		putmem(&cb, &tr, sizeof(tr));
+	}
+
+	while (!done) {
+		ret = binder_write_read(c->fd, cb.data, cb.len,
+					rbuf, sizeof(rbuf), &consumed);
+		if (ret)
+			return ret;
+		cb.len = 0;
+		ptr = rbuf;
+		end = rbuf + consumed;
+		while (ptr < end) {
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_SPAWN_LOOPER:
+			case BR_OK:
+				break;
+			case BR_TRANSACTION_COMPLETE:
+				if (flags & TF_ONE_WAY)
+					done = 1;
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, ptr, sizeof(pc));
+				ptr += sizeof(pc);
+				put32(&cb, cmd == BR_INCREFS ?
+				      BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+				putmem(&cb, &pc, sizeof(pc));
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				ptr += sizeof(pc);
+				break;
+			case BR_REPLY:
+				memcpy(&tr, ptr, sizeof(tr));
+				ptr += sizeof(tr);
+				if (tr.offsets_size) {
+					memcpy(&obj, (void *)(uintptr_t)
+					       tr.data.ptr.buffer, sizeof(obj));
+					if (obj.type == BINDER_TYPE_FD)
+						close(obj.handle);
+				}
+				c->reply_data = (void *)(uintptr_t)
+					tr.data.ptr.buffer;
+				c->reply_size = tr.data_size;
+				c->pending_free = tr.data.ptr.buffer;
+				done = 1;
+				break;
+			case BR_FAILED_REPLY:
+				ret = -EAGAIN;
+				done = 1;
+				break;
+			case BR_DEAD_REPLY:
+				return -EPIPE;
+			default:
+				fprintf(stderr, "client: unexpected return 0x%x\n",
+					cmd);
+				return -EPROTO;
+			}
+		}
+	}
+	if (cb.len)
+		binder_write_read(c->fd, cb.data, cb.len, NULL, 0, NULL);
+	return ret;
+}
+
+static int client_call(struct client *c, uint32_t code, uint32_t flags,
+		       const void *data, size_t size,
+		       const binder_size_t *offs, size_t offs_size)
+{
+	return client_call_sg(c, code, flags, data, size, offs, offs_size, 0);
+}
+
+static void client_exit(struct client *c)
+{
+	struct cmdbuf cb = { 0 };
+
+	if (c->pending_free) {
+		put32(&cb, BC_FREE_BUFFER);
+		putptr(&cb, c->pending_free);
+		c->pending_free = 0;
+		binder_write_read(c->fd, cb.data, cb.len, NULL, 0, NULL);
+	}
+	ioctl(c->fd, BINDER_THREAD_EXIT, 0);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct client *c = arg;
+	char buf[MAX_PAYLOAD];
+
+	memset(buf, 0x5a, payload);
+	while (!stop) {
+		c->err = client_call(c, CODE_ECHO, 0, buf, payload, NULL, 0);
+		if (c->err)
+			break;
+		if (c->reply_size != payload ||
+		    memcmp(c->reply_data, buf, payload)) {
+			c->err = -EBADMSG;
+			break;
+		}
+		c->calls++;
+	}
+	client_exit(c);
+	return NULL;
+}
+
+static int run_bench(int nthreads)
+{
+	struct client clients[MAX_THREADS];
+	unsigned long calls = 0;
+	double start, elapsed;
+	int i, ret = 0;
+
+	memset(clients, 0, sizeof(clients));
+	stop = 0;
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		clients[i].fd = binder_fd;
+		if (pthread_create(&clients[i].thread, NULL, bench_thread,
+				   &clients[i])) {
+			perror("pthread_create");
+			stop = 1;
+			nthreads = i;
+			ret = 1;
+		}
+	}
+	if (!ret)
+		sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(clients[i].thread, NULL);
+		calls += clients[i].calls;
+		if (clients[i].err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(-clients[i].err));
+			ret = 1;
+		}
+	}
+	elapsed = now() - start;
+
+	printf("%d thread(s): %.0f transactions/s\n", nthreads,
+	       calls / elapsed);
+	return ret;
+}
+
+static void *stress_thread(void *arg)
+{
+	struct client *c = arg;
+	struct flat_binder_object obj;
+	binder_size_t off = 0;
+	char buf[MAX_PAYLOAD];
+	int ret = 0;
+
+	memset(buf, 0xa5, payload);
+	memset(&obj, 0, sizeof(obj));
+	obj.type = BINDER_TYPE_BINDER;
+	obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	obj.binder = (uintptr_t)&local_binder;
+
+	for (;;) {
+		switch (rand_r(&c->seed) % 5) {
+		case 0:
+			ret = client_call(c, CODE_ECHO, 0, buf, payload,
+					  NULL, 0);
+			break;
+		case 1:
+			ret = client_call(c, CODE_ECHO, TF_ONE_WAY, buf,
+					  payload, NULL, 0);
+			break;
+		case 2:
+			ret = client_call(c, CODE_BINDER, 0, &obj, sizeof(obj),
+					  &off, sizeof(off));
+			if (!ret && __sync_bool_compare_and_swap(&sent_binder,
+								 0, 1))
+				__sync_fetch_and_add(&shared->binder_clients,
+						     1);
+			break;
+		case 3:
+			ret = client_call(c, CODE_GET_FD, TF_ACCEPT_FDS, buf,
+					  payload, NULL, 0);
+			break;
+		case 4:
+			client_exit(c);
+			continue;
+		}
+		if (ret == -EAGAIN) {
+			__sync_fetch_and_add(&shared->failed, 1);
+			continue;
+		}
+		if (ret) {
+			fprintf(stderr, "client %d: %s\n", getpid(),
+				strerror(-ret));
+			_exit(1);
+		}
+		__sync_fetch_and_add(&shared->calls, 1);
+	}
+	return NULL;
+}
+
+/* fork a client that is killed with its transactions in flight */
+static pid_t start_stress_client(unsigned int seed)
+{
+	struct client clients[STRESS_CLIENT_THREADS];
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	binder_fd = binder_open_map();
+	if (binder_fd < 0)
+		_exit(1);
+	memset(clients, 0, sizeof(clients));
+	for (i = 0; i < STRESS_CLIENT_THREADS; i++) {
+		clients[i].fd = binder_fd;
+		clients[i].seed = seed + i;
+		if (pthread_create(&clients[i].thread, NULL, stress_thread,
+				   &clients[i]))
+			_exit(1);
+	}
+	usleep(10000 + rand_r(&seed) % 200000);
+	_exit(0);
+}
+
+static int run_stress(void)
+{
+	unsigned long spawned = 0, failed = 0;
+	unsigned int seed = getpid();
+	double end;
+	int status, i, n;
+	pid_t pid;
+
+	for (i = 0; i < nr_clients; i++) {
+		client_pids[i] = start_stress_client(rand_r(&seed));
+		spawned++;
+	}
+
+	end = now() + duration;
+	for (n = nr_clients; n; ) {
+		pid = wait(&status);
+		if (pid < 0) {
+			perror("wait");
+			return 1;
+		}
+		if (pid == server_pid) {
+			fprintf(stderr, "server died\n");
+			server_pid = 0;
+			return 1;
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+		for (i = 0; i < nr_clients; i++)
+			if (client_pids[i] == pid)
+				break;
+		if (i == nr_clients)
+			continue;
+		if (now() < end) {
+			client_pids[i] = start_stress_client(rand_r(&seed));
+			spawned++;
+		} else {
+			client_pids[i] = 0;
+			n--;
+		}
+	}
+
+	/* every binder the server was sent must have been reported dead */
+	for (i = 0; i < 100; i++) {
+		if (shared->deaths >= shared->binder_clients)
+			break;
+		usleep(10000);
+	}
+
+	printf("%lu client(s), %lu transactions, %lu failed, %lu death notification(s)\n",
+	       spawned, shared->calls, shared->failed, shared->deaths);
+	if (failed)
+		fprintf(stderr, "%lu client(s) exited with an error\n",
+			failed);
+	if (shared->deaths < shared->binder_clients)
+		fprintf(stderr, "%lu death notification(s) missing\n",
+			shared->binder_clients - shared->deaths);
+	return failed || shared->deaths < shared->binder_clients;
+}
+
+/*
+ * Send @size bytes held in SG_CHUNKS separate buffers, first gathered
+ * into a flat parcel and then as scatter-gather buffer objects.
+ */
+static int run_sg_bench(size_t size)
+{
+	struct binder_buffer_object objs[SG_CHUNKS];
+	binder_size_t offs[SG_CHUNKS];
+	uint8_t *chunks[SG_CHUNKS];
+	size_t chunk = size / SG_CHUNKS;
+	double rate[2], start, elapsed;
+	unsigned long calls;
+	struct client c;
+	uint8_t *parcel;
+	uint32_t sum = 0;
+	int i, sg, ret = 0;
+
+	parcel = malloc(size);
+	if (!parcel)
+		return 1;
+	memset(objs, 0, sizeof(objs));
+	for (i = 0; i < SG_CHUNKS; i++) {
+		chunks[i] = malloc(chunk);
+		if (!chunks[i])
+			return 1;
+		memset(chunks[i], i + 1, chunk);
+		sum += byte_sum(chunks[i], chunk);
+		objs[i].type = BINDER_TYPE_PTR;
+		objs[i].buffer = (uintptr_t)chunks[i];
+		objs[i].length = chunk;
+		offs[i] = i * sizeof(objs[0]);
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.fd = binder_fd;
+	for (sg = 0; sg < 2 && !ret; sg++) {
+		calls = 0;
+		start = now();
+		do {
+			/* only the first call of each kind is checked */
+			uint32_t code = calls ? CODE_SINK : CODE_SUM;
+
+			if (sg) {
+				ret = client_call_sg(&c, code, 0, objs,
+						     sizeof(objs), offs,
+						     sizeof(offs), size);
+			} else {
+				for (i = 0; i < SG_CHUNKS; i++)
+					memcpy(parcel + i * chunk, chunks[i],
+					       chunk);
+				ret = client_call(&c, code, 0, parcel, size,
+						  NULL, 0);
+			}
+			if (!ret && !calls &&
+			    (c.reply_size != sizeof(sum) ||
+			     memcmp(c.reply_data, &sum, sizeof(sum))))
+				ret = -EBADMSG;
+			if (ret) {
+				fprintf(stderr, "%zu bytes%s: %s\n", size,
+					sg ? " (sg)" : "", strerror(-ret));
+				break;
+			}
+			calls++;
+			elapsed = now() - start;
+		} while (elapsed < duration);
+		if (!ret)
+			rate[sg] = calls * size / elapsed / (1024 * 1024);
+	}
+	client_exit(&c);
+
+	if (!ret)
+		printf("%7zu bytes: %.0f MB/s flat, %.0f MB/s scatter-gather\n",
+		       size, rate[0], rate[1]);
+	for (i = 0; i < SG_CHUNKS; i++)
+		free(chunks[i]);
+	free(parcel);
+	return ret != 0;
+}
+
+static void start_hogs(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pid_t pid;
+
+	for (nr_hogs = 0; nr_hogs < cpus && nr_hogs < MAX_HOGS; nr_hogs++) {
+		pid = fork();
+		if (pid < 0)
+			break;
+		if (!pid)
+			for (;;)
+				;
+		hog_pids[nr_hogs] = pid;
+	}
+}
+
+static void stop_hogs(void)
+{
+	int i;
+
+	for (i = 0; i < nr_hogs; i++) {
+		kill(hog_pids[i], SIGKILL);
+		waitpid(hog_pids[i], NULL, 0);
+	}
+	nr_hogs = 0;
+}
+
+/*
+ * Call the server for duration seconds as @policy, check that every
+ * call was handled with the same policy and priority, and report the
+ * round trip times.
+ */
+static int run_rt_pass(struct client *c, int policy, int priority)
+{
+	double start, t, lat, max = 0, total = 0;
+	struct sched_param param;
+	unsigned long calls = 0;
+	struct sched sched;
+	int ret = 0;
+
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, policy, &param))
+		return -errno;
+	start = now();
+	do {
+		t = now();
+		ret = client_call(c, CODE_GET_SCHED, 0, NULL, 0, NULL, 0);
+		lat = now() - t;
+		if (ret)
+			break;
+		if (c->reply_size != sizeof(sched)) {
+			ret = -EBADMSG;
+			break;
+		}
+		memcpy(&sched, c->reply_data, sizeof(sched));
+		if (sched.policy != policy || sched.priority != priority) {
+			fprintf(stderr,
+				"call %lu handled as policy %d prio %d, caller has policy %d prio %d\n",
+				calls, sched.policy, sched.priority, policy,
+				priority);
+			ret = -EPERM;
+			break;
+		}
+		total += lat;
+		if (lat > max)
+			max = lat;
+		calls++;
+	} while (t - start < duration);
+
+	if (!ret && calls)
+		printf("%s caller with %d hog(s): avg %.1f us, max %.1f us\n",
+		       policy == SCHED_FIFO ? "SCHED_FIFO " : "SCHED_OTHER",
+		       nr_hogs, total / calls * 1e6, max * 1e6);
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	return ret;
+}
+
+static int run_rt_latency(void)
+{
+	struct sched_param param = { .sched_priority = RT_PRIO };
+	struct client c;
+	int ret;
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+		printf("skip rt latency test: %s\n", strerror(errno));
+		return 0;
+	}
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER, &param);
+
+	memset(&c, 0, sizeof(c));
+	c.fd = binder_fd;
+	start_hogs();
+	ret = run_rt_pass(&c, SCHED_FIFO, RT_PRIO);
+	if (!ret)
+		ret = run_rt_pass(&c, SCHED_OTHER, 0);
+	stop_hogs();
+	client_exit(&c);
+	if (ret)
+		fprintf(stderr, "rt latency: %s\n", strerror(-ret));
+	return ret != 0;
+}
+
+/* check that the server survived the run */
+static int ping(void)
+{
+	struct client c;
+	char buf[8] = "ping";
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	c.fd = binder_fd;
+	ret = client_call(&c, CODE_ECHO, 0, buf, sizeof(buf), NULL, 0);
+	if (!ret && (c.reply_size != sizeof(buf) ||
+		     memcmp(c.reply_data, buf, sizeof(buf))))
+		ret = -EBADMSG;
+	client_exit(&c);
+	if (ret)
+		fprintf(stderr, "ping: %s\n", strerror(-ret));
+	return ret != 0;
+}
+
+static void timeout(int sig)
+{
+	static const char msg[] = "binder_stress: timed out\n";
+	ssize_t n;
+	int i;
+
+	n = write(2, msg, sizeof(msg) - 1);
+	(void)n;
+	for (i = 0; i < nr_clients; i++)
+		if (client_pids[i] > 0)
+			kill(client_pids[i], SIGKILL);
+	for (i = 0; i < nr_hogs; i++)
+		kill(hog_pids[i], SIGKILL);
+	if (server_pid > 0)
+		kill(server_pid, SIGKILL);
+	_exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int stress = 0;
+	int sg = 0;
+	int rt = 0;
+	int ret = 0;
+	size_t size;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "t:d:sp:gr")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'd':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			stress = 1;
+			break;
+		case 'p':
+			nr_clients = atoi(optarg);
+			break;
+		case 'g':
+			sg = 1;
+			break;
+		case 'r':
+			rt = 1;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-t seconds] [-d payload_bytes] [-s] [-p clients] [-g] [-r]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || payload < 1 || payload > MAX_PAYLOAD ||
+	    nr_clients < 1 || nr_clients > 64) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	if (access("/dev/binder", R_OK | W_OK)) {
+		printf("skip all tests: /dev/binder not accessible\n");
+		return 0;
+	}
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	server_pid = start_server();
+	if (!server_pid) {
+		printf("skip all tests: context manager already registered\n");
+		return 0;
+	}
+	if (server_pid < 0) {
+		fprintf(stderr, "failed to start the server\n");
+		return 1;
+	}
+
+	signal(SIGALRM, timeout);
+	alarm(10 * duration + 30);
+
+	if (stress)
+		ret = run_stress();
+
+	binder_fd = binder_open_map();
+	if (binder_fd < 0) {
+		ret = 1;
+	} else if (stress) {
+		ret |= ping();
+	} else if (rt) {
+		ret = run_rt_latency();
+	} else if (sg) {
+		for (size = SG_MIN_SIZE; size <= SG_MAX_SIZE; size *= 2)
+			ret |= run_sg_bench(size);
+	} else {
+		for (i = 1; i <= MAX_THREADS; i *= 2)
+			ret |= run_bench(i);
+	}
+
+	if (server_pid > 0) {
+		kill(server_pid, SIGKILL);
+		waitpid(server_pid, NULL, 0);
+	}
+
+	printf("binder_stress: %s\n", ret ? "[FAIL]" : "[PASS]");
+	return ret;
+}
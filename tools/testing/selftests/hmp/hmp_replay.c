@@ -0,0 +1,717 @@
+/*
+ * HMP placement policy replay
+ *
+ * Replays a workload on a model of the exynos7420 4+4 cpus under the two
+ * HMP placement policies of kernel/sched/fair.c and reports the estimated
+ * energy and the latency each one gives:
+ *
+ *  threshold - up migration above hmp_up_threshold (430), down migration
+ *              below hmp_down_threshold (204)
+ *  energy    - the cpu that fits the task with hmp_energy_margin headroom
+ *              at the lowest estimated energy, as hmp_energy_select_cpu()
+ *
+ * Both use the energy model tables of exynos7420-codegen.dtsi, a per-ms
+ * geometric load average with the PELT half-life of 32ms, the 4ms
+ * migration settle time, a governor that runs each cluster at the
+ * lowest frequency with 25% headroom over its busiest cpu, and move a
+ * task queued behind another to an idle cpu of the same cluster.
+ *
+ * Each policy is then replayed again with the window-based task demand of
+ * /sys/kernel/hmp/window_demand in place of the load average: the highest
+ * share of a window (-w, default 16ms) the task ran in over the last 5
+ * windows and the current one, with run time scaled by the frequency of
+ * its cluster as frequency_invariant_load_scale does. As with the 'sched'
+ * cpufreq governor, a
+ * cpu then also runs fast enough for the demand of its runnable tasks.
+ *
+ * Besides energy, the average and worst wakeup latency and the average
+ * burst completion time, the 50th, 90th and 99th percentiles of the frame
+ * time - the completion time of the bursts of the tasks that run every
+ * frame, or of every burst of a trace - are reported, with the share of
+ * frames that took longer than the 16ms frame period.
+ *
+ * The workload is read from an ftrace text trace with the sched_switch and
+ * (optionally) sched_wakeup events enabled: every stretch between a task
+ * waking up and blocking again becomes a burst of work. Recorded run time
+ * is replayed as work at the capacity given with -c (default 512, about a
+ * mid-frequency cpu), as the trace does not tell where it ran. Without a
+ * trace, a built-in mix of periodic UI, render, game and background tasks
+ * with occasional long compute bursts is used.
+ *
+ * usage: hmp_replay [-c capacity] [-d seconds] [-w window ms] [trace]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NR_CPUS			8
+#define NR_CLUSTERS		2
+#define MAX_TASKS		512
+#define PID_MAX			65536
+
+#define UP_THRESHOLD		430
+#define DOWN_THRESHOLD		204
+#define ENERGY_MARGIN		1280
+#define SETTLE_MS		4
+#define FRAME_MS		16
+#define DEMAND_WINDOWS		5
+
+struct energy_state {
+	unsigned long freq, capacity, busy_power, idle_power;
+};
+
+/* <freq(kHz) capacity busy(mW) idle(mW)>, as in exynos7420-codegen.dtsi */
+static const struct energy_state apollo[] = {
+	{  400000, 103,  22,  6 }, {  500000, 128,  28,  7 },
+	{  600000, 154,  35,  8 }, {  700000, 180,  43,  9 },
+	{  800000, 205,  52, 10 }, {  900000, 231,  62, 11 },
+	{ 1000000, 257,  73, 13 }, { 1104000, 283,  86, 14 },
+	{ 1200000, 308, 100, 16 }, { 1296000, 333, 115, 18 },
+	{ 1400000, 359, 133, 20 }, { 1500000, 385, 153, 22 },
+};
+
+static const struct energy_state atlas[] = {
+	{  800000,  390,  170,  32 }, {  900000,  439,  205,  36 },
+	{ 1000000,  488,  245,  40 }, { 1100000,  536,  290,  45 },
+	{ 1200000,  585,  340,  50 }, { 1300000,  634,  395,  56 },
+	{ 1400000,  683,  455,  62 }, { 1500000,  731,  520,  69 },
+	{ 1600000,  780,  595,  77 }, { 1704000,  831,  680,  86 },
+	{ 1800000,  878,  770,  95 }, { 1896000,  924,  870, 105 },
+	{ 2000000,  975,  985, 116 }, { 2100000, 1024, 1110, 128 },
+};
+
+struct cluster {
+	const struct energy_state *states;
+	int nr_states;
+	int first_cpu;
+	int state;		/* current operating point */
+};
+
+static struct cluster clusters[NR_CLUSTERS] = {
+	{ apollo, sizeof(apollo) / sizeof(apollo[0]), 0, 0 },
+	{ atlas, sizeof(atlas) / sizeof(atlas[0]), 4, 0 },
+};
+
+struct burst {
+	double arrive;		/* ms */
+	double work;		/* ms at capacity 1024 */
+};
+
+struct task {
+	struct burst *bursts;
+	int nr_bursts, max_bursts;
+	int next;		/* next burst to arrive */
+	int runnable, started;
+	double arrive, remaining;
+	double load;		/* 0..1024 */
+	double ran;		/* ms run in the current ms, frequency scaled */
+	double win_runtime;	/* ms run in the current window */
+	double win_hist[DEMAND_WINDOWS];
+	int frame;		/* runs once every frame */
+	int cpu;
+	long last_migration;
+	/* trace parsing state */
+	int pid;
+	double wake_ts, burst_ts, run_ts, work;
+};
+
+struct cpu {
+	double load;		/* 0..1024 */
+	int nr_running;
+	int last;		/* round-robin position */
+};
+
+struct result {
+	double energy;		/* mJ */
+	double wake_total, wake_max;
+	double burst_total;
+	double *frames;		/* frame times, ms */
+	unsigned long nr_frames, max_frames;
+	unsigned long nr_wakeups, nr_bursts, migrations;
+	long ms;
+};
+
+static struct task tasks[MAX_TASKS];
+static int nr_tasks;
+static struct cpu cpus[NR_CPUS];
+static int pid_map[PID_MAX];
+static double work_capacity = 512;
+static double duration = 10;
+static double decay;
+static int window_size = 16;
+static int use_windows;
+
+static struct cluster *cluster_of(int cpu)
+{
+	return &clusters[cpu >= clusters[1].first_cpu];
+}
+
+static double max_capacity(struct cluster *c)
+{
+	return c->states[c->nr_states - 1].capacity;
+}
+
+static void add_burst(struct task *t, double arrive, double work)
+{
+	if (t->nr_bursts == t->max_bursts) {
+		t->max_bursts = t->max_bursts ? t->max_bursts * 2 : 64;
+		t->bursts = realloc(t->bursts,
+				    t->max_bursts * sizeof(*t->bursts));
+		if (!t->bursts) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	t->bursts[t->nr_bursts].arrive = arrive;
+	t->bursts[t->nr_bursts].work = work;
+	t->nr_bursts++;
+}
+
+static struct task *new_task(void)
+{
+	if (nr_tasks == MAX_TASKS)
+		return NULL;
+	return &tasks[nr_tasks++];
+}
+
+static void periodic(int count, double period, double work, double phase)
+{
+	struct task *t;
+	double at;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		t = new_task();
+		t->frame = period == FRAME_MS;
+		for (at = phase * i; at < duration * 1000; at += period)
+			add_burst(t, at, work);
+	}
+}
+
+static void synthetic_workload(void)
+{
+	struct task *t;
+	double at;
+
+	periodic(4, 16, 1.5, 4);	/* ui */
+	periodic(1, 16, 6, 0);		/* render */
+	periodic(1, 16, 11, 2);		/* game */
+	periodic(2, 100, 3, 50);	/* background */
+
+	/* compute bursts, 500ms every 2s */
+	t = new_task();
+	for (at = 1000; at < duration * 1000; at += 2000)
+		add_burst(t, at, 500);
+}
+
+static struct task *trace_task(int pid)
+{
+	struct task *t;
+
+	if (pid <= 0 || pid >= PID_MAX)
+		return NULL;
+	if (pid_map[pid])
+		return &tasks[pid_map[pid] - 1];
+	t = new_task();
+	if (!t)
+		return NULL;
+	t->pid = pid;
+	t->frame = 1;
+	t->wake_ts = t->burst_ts = t->run_ts = -1;
+	pid_map[pid] = nr_tasks;
+	return t;
+}
+
+static int read_trace(const char *path)
+{
+	char line[1024], *p, *q;
+	double ts, t0 = -1, scale = 1024 / work_capacity;
+	struct task *t;
+	FILE *f;
+	int events = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		p = strstr(line, ": sched_");
+		if (!p)
+			continue;
+		for (q = p; q > line && q[-1] != ' '; q--)
+			;
+		ts = strtod(q, NULL) * 1000;
+		if (t0 < 0)
+			t0 = ts;
+		if (ts - t0 >= duration * 1000)
+			break;
+
+		if (!strncmp(p, ": sched_wakeup", 14)) {
+			q = strstr(p, " pid=");
+			t = q ? trace_task(atoi(q + 5)) : NULL;
+			if (t && t->burst_ts < 0 && t->wake_ts < 0)
+				t->wake_ts = ts;
+			continue;
+		}
+		if (strncmp(p, ": sched_switch:", 15))
+			continue;
+		events++;
+
+		q = strstr(p, "prev_pid=");
+		t = q ? trace_task(atoi(q + 9)) : NULL;
+		if (t && t->run_ts >= 0) {
+			t->work += ts - t->run_ts;
+			t->run_ts = -1;
+			q = strstr(p, "prev_state=");
+			/* blocked: the burst is over */
+			if (q && q[11] != 'R') {
+				add_burst(t, t->burst_ts - t0, t->work / scale);
+				t->burst_ts = t->wake_ts = -1;
+				t->work = 0;
+			}
+		}
+
+		q = strstr(p, "next_pid=");
+		t = q ? trace_task(atoi(q + 9)) : NULL;
+		if (t) {
+			if (t->burst_ts < 0)
+				t->burst_ts = t->wake_ts >= 0 ? t->wake_ts : ts;
+			t->run_ts = ts;
+		}
+	}
+	fclose(f);
+
+	if (!events) {
+		fprintf(stderr, "%s: no sched_switch events\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* window-based demand of t, as hmp_task_demand() */
+static double window_demand(struct task *t)
+{
+	double demand = t->win_runtime * 1024 / window_size;
+	int i;
+
+	for (i = 0; i < DEMAND_WINDOWS; i++)
+		demand = fmax(demand, t->win_hist[i]);
+	return demand;
+}
+
+/* the load compared against the thresholds, as hmp_task_load() */
+static double task_load(struct task *t)
+{
+	return use_windows ? window_demand(t) : t->load;
+}
+
+static void account_window(struct task *t, long now)
+{
+	int i;
+
+	t->win_runtime += t->ran;
+	t->ran = 0;
+	if ((now + 1) % window_size)
+		return;
+	for (i = DEMAND_WINDOWS - 1; i > 0; i--)
+		t->win_hist[i] = t->win_hist[i - 1];
+	t->win_hist[0] = fmin(t->win_runtime * 1024 / window_size, 1024);
+	t->win_runtime = 0;
+}
+
+/* utilization of cpu, in capacity, once demand moved from src to dst */
+static double cpu_util(int cpu, int src, int dst, double demand)
+{
+	double util = cpus[cpu].load * max_capacity(cluster_of(cpu)) / 1024;
+
+	if (cpu == src)
+		util = util > demand ? util - demand : 0;
+	if (cpu == dst)
+		util += demand;
+	return util;
+}
+
+static double cluster_energy(struct cluster *c, int src, int dst,
+			     double demand)
+{
+	const struct energy_state *s;
+	double util, max_util = 0, energy = 0;
+	int cpu, i;
+
+	for (cpu = c->first_cpu; cpu < c->first_cpu + 4; cpu++)
+		max_util = fmax(max_util, cpu_util(cpu, src, dst, demand));
+	for (i = 0; i < c->nr_states - 1; i++)
+		if (c->states[i].capacity >= max_util)
+			break;
+	s = &c->states[i];
+
+	for (cpu = c->first_cpu; cpu < c->first_cpu + 4; cpu++) {
+		util = fmin(cpu_util(cpu, src, dst, demand), s->capacity);
+		energy += (util * s->busy_power +
+			   (s->capacity - util) * s->idle_power) / s->capacity;
+	}
+	return energy;
+}
+
+static int min_load_cpu(struct cluster *c, int idle_only)
+{
+	int cpu, best = -1;
+
+	for (cpu = c->first_cpu; cpu < c->first_cpu + 4; cpu++) {
+		if (idle_only && cpus[cpu].nr_running)
+			continue;
+		if (best < 0 || cpus[cpu].load < cpus[best].load)
+			best = cpu;
+	}
+	return best;
+}
+
+static int threshold_select(struct task *t)
+{
+	int target;
+
+	if (cluster_of(t->cpu) == &clusters[0]) {
+		if (task_load(t) < UP_THRESHOLD)
+			return t->cpu;
+		target = min_load_cpu(&clusters[1], 1);
+		return target < 0 ? t->cpu : target;
+	}
+	if (task_load(t) >= DOWN_THRESHOLD)
+		return t->cpu;
+	return min_load_cpu(&clusters[0], 0);
+}
+
+static int energy_select(struct task *t)
+{
+	struct cluster *src = cluster_of(t->cpu), *c;
+	double demand, util, cost, best_cost = 0, spare, best_spare = 0;
+	double src_energy, src_energy_without;
+	int i, target, best = -1, spare_cpu = t->cpu;
+
+	demand = task_load(t) * max_capacity(src) / 1024;
+	src_energy = cluster_energy(src, -1, -1, 0);
+	src_energy_without = cluster_energy(src, t->cpu, -1, demand);
+
+	for (i = 0; i < NR_CLUSTERS; i++) {
+		c = &clusters[i];
+		target = c == src ? t->cpu : min_load_cpu(c, 0);
+		util = cpu_util(target, t->cpu, target, demand);
+		if (util * ENERGY_MARGIN > max_capacity(c) * 1024) {
+			spare = max_capacity(c) - util;
+			if (spare_cpu == t->cpu || spare > best_spare) {
+				best_spare = spare;
+				spare_cpu = target;
+			}
+			continue;
+		}
+		if (c == src)
+			cost = 0;
+		else
+			cost = src_energy_without - src_energy +
+			       cluster_energy(c, -1, target, demand) -
+			       cluster_energy(c, -1, -1, 0);
+		if (best < 0 || cost < best_cost) {
+			best_cost = cost;
+			best = target;
+		}
+	}
+	return best >= 0 ? best : spare_cpu;
+}
+
+static void migrate(struct task *t, int cpu, long now, struct result *r)
+{
+	if (cpu == t->cpu)
+		return;
+	if (t->runnable) {
+		cpus[t->cpu].nr_running--;
+		cpus[cpu].nr_running++;
+	}
+	t->cpu = cpu;
+	t->last_migration = now;
+	r->migrations++;
+}
+
+/*
+ * Within a cluster, as select_idle_sibling() and idle balance would: a
+ * task queued behind another goes to an idle cpu of its cluster.
+ */
+static void balance_cluster(struct task *t)
+{
+	struct cluster *c = cluster_of(t->cpu);
+	int cpu;
+
+	if (!t->runnable || t->started || cpus[t->cpu].nr_running < 2)
+		return;
+	for (cpu = c->first_cpu; cpu < c->first_cpu + 4; cpu++) {
+		if (!cpus[cpu].nr_running) {
+			cpus[t->cpu].nr_running--;
+			cpus[cpu].nr_running++;
+			t->cpu = cpu;
+			return;
+		}
+	}
+}
+
+static void reset(void)
+{
+	int i;
+
+	for (i = 0; i < nr_tasks; i++) {
+		tasks[i].next = 0;
+		tasks[i].runnable = 0;
+		tasks[i].load = 0;
+		tasks[i].ran = 0;
+		tasks[i].win_runtime = 0;
+		memset(tasks[i].win_hist, 0, sizeof(tasks[i].win_hist));
+		tasks[i].cpu = i % 4;
+		tasks[i].last_migration = -SETTLE_MS;
+	}
+	memset(cpus, 0, sizeof(cpus));
+	for (i = 0; i < NR_CLUSTERS; i++)
+		clusters[i].state = 0;
+}
+
+static void add_frame(struct result *r, double ms)
+{
+	if (r->nr_frames == r->max_frames) {
+		r->max_frames = r->max_frames ? r->max_frames * 2 : 1024;
+		r->frames = realloc(r->frames,
+				    r->max_frames * sizeof(*r->frames));
+		if (!r->frames) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	r->frames[r->nr_frames++] = ms;
+}
+
+/* run one ms of cpu, round-robin between its runnable tasks */
+static double run_cpu(int cpu, long now, struct result *r)
+{
+	struct cluster *c = cluster_of(cpu);
+	double speed = c->states[c->state].capacity / 1024.0;
+	double freq_scale = c->states[c->state].capacity / max_capacity(c);
+	double budget = 1, slice;
+	struct task *t;
+	int i = 0, n;
+
+	while (budget > 0 && cpus[cpu].nr_running) {
+		for (n = 0; n < nr_tasks; n++) {
+			i = (cpus[cpu].last + 1 + n) % nr_tasks;
+			if (tasks[i].runnable && tasks[i].cpu == cpu)
+				break;
+		}
+		cpus[cpu].last = i;
+		t = &tasks[i];
+
+		if (!t->started) {
+			double wait = fmax(0, now + 1 - budget - t->arrive);
+
+			t->started = 1;
+			r->wake_total += wait;
+			r->wake_max = fmax(r->wake_max, wait);
+			r->nr_wakeups++;
+		}
+		slice = fmin(budget, t->remaining / speed);
+		t->remaining -= slice * speed;
+		t->ran += slice * freq_scale;
+		budget -= slice;
+		if (t->remaining <= 1e-9) {
+			t->runnable = 0;
+			cpus[cpu].nr_running--;
+			r->burst_total += now + 1 - budget - t->arrive;
+			r->nr_bursts++;
+			if (t->frame)
+				add_frame(r, now + 1 - budget - t->arrive);
+		}
+	}
+	return 1 - budget;
+}
+
+static void set_frequencies(void)
+{
+	struct cluster *c;
+	struct task *t;
+	double util;
+	int i, cpu;
+
+	for (i = 0; i < NR_CLUSTERS; i++) {
+		c = &clusters[i];
+		util = 0;
+		for (cpu = c->first_cpu; cpu < c->first_cpu + 4; cpu++)
+			util = fmax(util, cpu_util(cpu, -1, -1, 0));
+		for (t = tasks; use_windows && t < tasks + nr_tasks; t++)
+			if (t->runnable && cluster_of(t->cpu) == c)
+				util = fmax(util, window_demand(t) *
+						  max_capacity(c) / 1024);
+		for (c->state = 0; c->state < c->nr_states - 1; c->state++)
+			if (c->states[c->state].capacity >= util * 1.25)
+				break;
+	}
+}
+
+static void replay(int (*select)(struct task *), struct result *r)
+{
+	const struct energy_state *s;
+	double busy, end = duration * 1000;
+	struct task *t;
+	long now;
+	int i, cpu, busy_cpu[NR_CPUS];
+
+	reset();
+	memset(r, 0, sizeof(*r));
+	for (now = 0; now < end; now++) {
+		/* wakeups, placed as select_task_rq_fair() would */
+		for (i = 0; i < nr_tasks; i++) {
+			t = &tasks[i];
+			if (t->runnable || t->next >= t->nr_bursts ||
+			    t->bursts[t->next].arrive >= now + 1)
+				continue;
+			t->arrive = t->bursts[t->next].arrive;
+			t->remaining = t->bursts[t->next].work;
+			t->next++;
+			t->runnable = 1;
+			t->started = 0;
+			cpus[t->cpu].nr_running++;
+			if (now - t->last_migration >= SETTLE_MS)
+				migrate(t, select(t), now, r);
+			balance_cluster(t);
+		}
+
+		for (cpu = 0; cpu < NR_CPUS; cpu++) {
+			busy_cpu[cpu] = cpus[cpu].nr_running > 0;
+			busy = run_cpu(cpu, now, r);
+			s = &cluster_of(cpu)->states[cluster_of(cpu)->state];
+			r->energy += (busy * s->busy_power +
+				      (1 - busy) * s->idle_power) / 1000;
+		}
+
+		for (i = 0; i < nr_tasks; i++) {
+			t = &tasks[i];
+			t->load = t->load * decay +
+				  (t->runnable || t->started ? 1024 : 0) *
+				  (1 - decay);
+			account_window(t, now);
+			if (!t->runnable)
+				t->started = 0;
+		}
+		for (cpu = 0; cpu < NR_CPUS; cpu++)
+			cpus[cpu].load = cpus[cpu].load * decay +
+					 busy_cpu[cpu] * 1024 * (1 - decay);
+
+		/* tick-time migration of running tasks */
+		for (i = 0; i < nr_tasks; i++) {
+			t = &tasks[i];
+			if (t->runnable && now - t->last_migration >= SETTLE_MS)
+				migrate(t, select(t), now, r);
+			balance_cluster(t);
+		}
+
+		set_frequencies();
+	}
+	r->ms = now;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(struct result *r, int pct)
+{
+	if (!r->nr_frames)
+		return 0;
+	return r->frames[(r->nr_frames - 1) * pct / 100];
+}
+
+static void report(const char *name, struct result *r)
+{
+	unsigned long i, janks = 0;
+
+	qsort(r->frames, r->nr_frames, sizeof(*r->frames), cmp_double);
+	for (i = 0; i < r->nr_frames; i++)
+		if (r->frames[i] > FRAME_MS)
+			janks++;
+
+	printf("%-16s %9.1fmJ %7.1fmW   wakeup %6.3fms avg %6.1fms max   "
+	       "burst %7.2fms avg   %lu migrations\n", name, r->energy,
+	       r->energy * 1000 / r->ms,
+	       r->nr_wakeups ? r->wake_total / r->nr_wakeups : 0, r->wake_max,
+	       r->nr_bursts ? r->burst_total / r->nr_bursts : 0,
+	       r->migrations);
+	printf("%-16s frame time %6.2fms p50 %6.2fms p90 %6.2fms p99   "
+	       "%.2f%% over %dms\n", "", percentile(r, 50), percentile(r, 90),
+	       percentile(r, 99),
+	       r->nr_frames ? janks * 100.0 / r->nr_frames : 0, FRAME_MS);
+}
+
+static void compare(const char *name, struct result *before,
+		    struct result *after)
+{
+	printf("%s: %+.1f%% energy, %+.3fms average wakeup latency, "
+	       "%+.2fms p90 %+.2fms p99 frame time\n", name,
+	       (after->energy / before->energy - 1) * 100,
+	       (after->nr_wakeups ? after->wake_total / after->nr_wakeups : 0) -
+	       (before->nr_wakeups ?
+		before->wake_total / before->nr_wakeups : 0),
+	       percentile(after, 90) - percentile(before, 90),
+	       percentile(after, 99) - percentile(before, 99));
+}
+
+int main(int argc, char **argv)
+{
+	struct result threshold, energy, threshold_win, energy_win;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:d:w:")) != -1) {
+		switch (opt) {
+		case 'c':
+			work_capacity = atof(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'w':
+			window_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c capacity] [-d seconds] "
+				"[-w window ms] [trace]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (work_capacity < 1 || work_capacity > 1024 || duration <= 0 ||
+	    window_size < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	decay = pow(0.5, 1 / 32.0);
+	if (optind < argc) {
+		if (read_trace(argv[optind]))
+			return 1;
+	} else {
+		synthetic_workload();
+	}
+	printf("%d tasks, %.1fs\n", nr_tasks, duration);
+
+	replay(threshold_select, &threshold);
+	replay(energy_select, &energy);
+	use_windows = 1;
+	replay(threshold_select, &threshold_win);
+	replay(energy_select, &energy_win);
+	report("threshold", &threshold);
+	report("energy", &energy);
+	report("threshold+window", &threshold_win);
+	report("energy+window", &energy_win);
+	compare("energy model", &threshold, &energy);
+	compare("window demand", &threshold, &threshold_win);
+	compare("window demand, energy model", &energy, &energy_win);
+	return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * ion system heap allocation scalability test
+ *
+ * Allocates and frees buffers from the ion system heap with 1, 2, 4 and 8
+ * concurrent threads and reports the aggregate number of allocations per
+ * second for each step. Every thread has its own ion client, so the only
+ * shared state exercised is the heap and its page pools.
+ *
+ * A second pass measures the latency of single allocations spaced out in
+ * time, as seen by e.g. camera preview start, and reports percentiles.
+ * Compare it with pool_refill_kb of the system heap set to 0 to see what
+ * the background pool refill saves.
+ *
+ * If the ion-test driver is present, a buffer is finally read back
+ * through ION_IOC_TEST_KERNEL_MAPPING to check that pages recycled by
+ * the pools are handed out cleared.
+ *
+ * usage: ion_alloc_bench [-s size] [-t seconds] [-m heap_id_mask] [-c]
+ *                        [-l latency_samples]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ion.h"
+#include "ion_test.h"
+
+#define MAX_THREADS	8
+#define LATENCY_GAP_US	20000
+
+static size_t buf_size = 256 * 1024;
+static unsigned int heap_mask = ION_HEAP_SYSTEM_MASK;
+static unsigned int alloc_flags;
+static int duration = 2;
+static int nr_samples = 100;
+static volatile int stop;
+
+struct bench_thread {
+	pthread_t thread;
+	int fd;
+	unsigned long nr_allocs;
+	int err;
+};
+
+static int ion_alloc(int fd, size_t len, ion_user_handle_t *handle)
+{
+	struct ion_allocation_data data = {
+		.len = len,
+		.align = 0,
+		.heap_id_mask = heap_mask,
+		.flags = alloc_flags,
+	};
+
+	if (ioctl(fd, ION_IOC_ALLOC, &data) < 0)
+		return -errno;
+
+	*handle = data.handle;
+	return 0;
+}
+
+static int ion_free(int fd, ion_user_handle_t handle)
+{
+	struct ion_handle_data data = {
+		.handle = handle,
+	};
+
+	if (ioctl(fd, ION_IOC_FREE, &data) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void *bench_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+	ion_user_handle_t handle;
+
+	while (!stop) {
+		t->err = ion_alloc(t->fd, buf_size, &handle);
+		if (t->err)
+			break;
+		t->err = ion_free(t->fd, handle);
+		if (t->err)
+			break;
+		t->nr_allocs++;
+	}
+
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_step(int nr_threads)
+{
+	struct bench_thread threads[MAX_THREADS];
+	unsigned long total = 0;
+	double start, elapsed;
+	int i, ret = 0;
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].fd = open("/dev/ion", O_RDWR);
+		if (threads[i].fd < 0) {
+			perror("open /dev/ion");
+			nr_threads = i;
+			ret = -1;
+			goto out;
+		}
+	}
+
+	stop = 0;
+	start = now();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i].thread, NULL, bench_fn, &threads[i]);
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		total += threads[i].nr_allocs;
+		if (threads[i].err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(-threads[i].err));
+			ret = -1;
+		}
+	}
+	elapsed = now() - start;
+
+	printf("%d allocator(s): %.0f allocs/s (%zu bytes each)\n",
+	       nr_threads, total / elapsed, buf_size);
+out:
+	for (i = 0; i < nr_threads; i++)
+		close(threads[i].fd);
+	return ret;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run_latency(void)
+{
+	ion_user_handle_t handle;
+	double *lat, start;
+	int fd, i, ret = 0;
+
+	if (nr_samples <= 0)
+		return 0;
+
+	fd = open("/dev/ion", O_RDWR);
+	lat = calloc(nr_samples, sizeof(*lat));
+	if (fd < 0 || !lat) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nr_samples; i++) {
+		/* leave the heap time to recycle and refill between samples */
+		usleep(LATENCY_GAP_US);
+		start = now();
+		ret = ion_alloc(fd, buf_size, &handle);
+		lat[i] = (now() - start) * 1e6;
+		if (ret) {
+			fprintf(stderr, "alloc: %s\n", strerror(-ret));
+			goto out;
+		}
+		ion_free(fd, handle);
+	}
+
+	qsort(lat, nr_samples, sizeof(*lat), cmp_double);
+	printf("alloc latency (us): p50 %.0f p90 %.0f p99 %.0f max %.0f\n",
+	       lat[nr_samples * 50 / 100], lat[nr_samples * 90 / 100],
+	       lat[nr_samples * 99 / 100], lat[nr_samples - 1]);
+out:
+	free(lat);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int check_cleared(void)
+{
+	struct ion_fd_data share;
+	struct ion_test_rw_data rw;
+	unsigned char *data;
+	ion_user_handle_t handle;
+	int ion_fd, test_fd, ret = -1;
+	size_t i;
+
+	test_fd = open("/dev/ion-test", O_RDWR);
+	if (test_fd < 0) {
+		printf("ion-test not available, skipping clear check\n");
+		return 0;
+	}
+
+	ion_fd = open("/dev/ion", O_RDWR);
+	data = malloc(buf_size);
+	if (ion_fd < 0 || !data)
+		goto out;
+
+	if (ion_alloc(ion_fd, buf_size, &handle))
+		goto out;
+
+	share.handle = handle;
+	if (ioctl(ion_fd, ION_IOC_SHARE, &share) < 0)
+		goto out_free;
+
+	if (ioctl(test_fd, ION_IOC_TEST_SET_FD, share.fd) < 0)
+		goto out_close;
+
+	memset(&rw, 0, sizeof(rw));
+	rw.ptr = (unsigned long)data;
+	rw.size = buf_size;
+	rw.write = 0;
+	if (ioctl(test_fd, ION_IOC_TEST_KERNEL_MAPPING, &rw) < 0)
+		goto out_unset;
+
+	for (i = 0; i < buf_size; i++)
+		if (data[i])
+			break;
+
+	if (i == buf_size) {
+		ret = 0;
+	} else {
+		fprintf(stderr, "recycled buffer not cleared at offset %zu\n",
+			i);
+	}
+out_unset:
+	ioctl(test_fd, ION_IOC_TEST_SET_FD, -1);
+out_close:
+	close(share.fd);
+out_free:
+	ion_free(ion_fd, handle);
+out:
+	free(data);
+	if (ion_fd >= 0)
+		close(ion_fd);
+	close(test_fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_threads, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "s:t:m:cl:")) != -1) {
+		switch (opt) {
+		case 's':
+			buf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'm':
+			heap_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			alloc_flags |= ION_FLAG_CACHED;
+			break;
+		case 'l':
+			nr_samples = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s size] [-t seconds] "
+				"[-m heap_id_mask] [-c] [-l samples]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (access("/dev/ion", R_OK | W_OK)) {
+		printf("skip all tests: /dev/ion not accessible\n");
+		return 0;
+	}
+
+	for (nr_threads = 1; nr_threads <= MAX_THREADS; nr_threads *= 2)
+		if (run_step(nr_threads))
+			ret = 1;
+
+	if (run_latency())
+		ret = 1;
+
+	if (check_cleared())
+		ret = 1;
+
+	printf("ion_alloc_bench: %s\n", ret ? "[FAIL]" : "[PASS]");
+	return ret;
+}
@@ -0,0 +1,541 @@
+/*
+ * logger writer scalability benchmark
+ *
+ * Writes log lines the way liblog does, a writev() of priority, tag and
+ * message, from 1, 2, 4 and 8 threads at once and reports the aggregate
+ * number of lines written per second for each step. Writers do not share
+ * a lock in the driver, so this should keep scaling with the number of
+ * CPUs.
+ *
+ * A reader follows the log during every step and checks each entry it
+ * gets from the benchmark: the header must be a version 2 logger_entry
+ * matching the writer, and the message must be intact. Lines may be lost
+ * when the writers lap the reader, but the lines of one thread must still
+ * arrive in order.
+ *
+ * The log is then filled up and read back from the start over and over,
+ * one entry per read() and batched with LOGGER_SET_BATCH_READ, and the
+ * number of lines read per second is reported for both. Finally, a poll
+ * threshold must hold poll() back until that many bytes were logged, and
+ * a uid filter must only return entries of that uid. When run as root, a
+ * reader with both must still be woken by its own uid's lines after the
+ * threshold was first reached by lines of another uid.
+ *
+ * usage: logger_bench [-t seconds] [-l log]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS		8
+#define MAX_PAYLOAD		4076
+#define MAX_MSG			200
+#define BATCH_SIZE		(64 * 1024)
+#define POLL_THRESHOLD		(16 * 1024)
+#define TAG			"logger_bench"
+#define OTHER_UID		9999
+
+#define __LOGGERIO		0xAE
+#define LOGGER_GET_LOG_BUF_SIZE	_IO(__LOGGERIO, 1)
+#define LOGGER_GET_LOG_LEN	_IO(__LOGGERIO, 2)
+#define LOGGER_SET_VERSION	_IO(__LOGGERIO, 6)
+#define LOGGER_SET_BATCH_READ	_IO(__LOGGERIO, 7)
+#define LOGGER_SET_UID_FILTER	_IO(__LOGGERIO, 8)
+#define LOGGER_SET_POLL_THRESHOLD _IO(__LOGGERIO, 9)
+
+/* struct logger_entry, version 2 of the ABI */
+struct entry {
+	uint16_t len;
+	uint16_t hdr_size;
+	int32_t pid;
+	int32_t tid;
+	int32_t sec;
+	int32_t nsec;
+	uint32_t euid;
+	char msg[MAX_PAYLOAD + 1];
+};
+
+struct writer {
+	pthread_t thread;
+	int index;
+	int tid;
+	unsigned long lines;
+	unsigned long limit;
+	int err;
+};
+
+static int duration = 2;
+static const char *log_path = "/dev/log/main";
+static volatile int stop;
+
+static struct writer writers[MAX_THREADS];
+static int nr_writers;
+static unsigned long last_seq[MAX_THREADS];
+static unsigned long checked, corrupt;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* message bodies vary in length so that entries end all over the ring */
+static int format_msg(char *buf, int index, unsigned long seq)
+{
+	int len, fill, i;
+
+	len = sprintf(buf, "w%d seq %lu ", index, seq);
+	fill = seq % (MAX_MSG - len - 1);
+	for (i = 0; i < fill; i++)
+		buf[len++] = 'a' + (seq + i) % 26;
+	buf[len++] = '\0';
+	return len;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	char prio = 4;		/* ANDROID_LOG_INFO */
+	char msg[MAX_MSG];
+	struct iovec iov[3];
+	int fd;
+
+	w->tid = syscall(SYS_gettid);
+	fd = open(log_path, O_WRONLY);
+	if (fd < 0) {
+		w->err = errno;
+		return NULL;
+	}
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = TAG;
+	iov[1].iov_len = sizeof(TAG);
+	iov[2].iov_base = msg;
+	while (!stop && (!w->limit || w->lines < w->limit)) {
+		iov[2].iov_len = format_msg(msg, w->index, w->lines + 1);
+		if (writev(fd, iov, 3) < 0) {
+			w->err = errno;
+			break;
+		}
+		w->lines++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void check_entry(struct entry *e, ssize_t size)
+{
+	char expect[MAX_MSG];
+	const char *msg;
+	unsigned long seq;
+	int index, len;
+
+	if (size < (ssize_t)offsetof(struct entry, msg) ||
+	    e->hdr_size != offsetof(struct entry, msg) ||
+	    size != e->hdr_size + e->len) {
+		corrupt++;
+		return;
+	}
+	e->msg[e->len] = '\0';
+	if (e->pid != getpid() || e->len < 1 + sizeof(TAG) ||
+	    strcmp(e->msg + 1, TAG))
+		return;
+
+	checked++;
+	msg = e->msg + 1 + sizeof(TAG);
+	if (sscanf(msg, "w%d seq %lu ", &index, &seq) != 2 ||
+	    index < 0 || index >= nr_writers ||
+	    e->tid != writers[index].tid) {
+		corrupt++;
+		return;
+	}
+	len = format_msg(expect, index, seq);
+	if (e->len != 1 + sizeof(TAG) + len || memcmp(msg, expect, len) ||
+	    seq <= last_seq[index]) {
+		corrupt++;
+		return;
+	}
+	last_seq[index] = seq;
+}
+
+static void *reader_thread(void *arg)
+{
+	int fd = *(int *)arg;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct entry e;
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(fd, &e, sizeof(e));
+		if (ret > 0) {
+			check_entry(&e, ret);
+		} else if (ret < 0 && errno == EAGAIN) {
+			if (stop)
+				break;
+			poll(&pfd, 1, 10);
+		} else {
+			perror("read");
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int run_bench(int nthreads, int rfd)
+{
+	unsigned long lines = 0;
+	double start, elapsed;
+	pthread_t reader;
+	int i, ret = 0;
+
+	memset(writers, 0, sizeof(writers));
+	memset(last_seq, 0, sizeof(last_seq));
+	checked = corrupt = 0;
+	nr_writers = nthreads;
+	stop = 0;
+
+	if (pthread_create(&reader, NULL, reader_thread, &rfd)) {
+		perror("pthread_create");
+		return 1;
+	}
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		writers[i].index = i;
+		if (pthread_create(&writers[i].thread, NULL, writer_thread,
+				   &writers[i])) {
+			perror("pthread_create");
+			nthreads = i;
+			ret = 1;
+			break;
+		}
+	}
+	if (!ret)
+		sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		lines += writers[i].lines;
+		if (writers[i].err) {
+			fprintf(stderr, "writer %d: %s\n", i,
+				strerror(writers[i].err));
+			ret = 1;
+		}
+	}
+	elapsed = now() - start;
+	pthread_join(reader, NULL);
+
+	printf("%d writer(s): %.0f lines/s, %lu read back, %lu corrupt\n",
+	       nthreads, lines / elapsed, checked, corrupt);
+	if (corrupt || !checked)
+		ret = 1;
+	return ret;
+}
+
+/* open a version 2 reader, which starts at the oldest entry in the log */
+static int open_reader(int batch)
+{
+	int version = 2;
+	int fd;
+
+	fd = open(log_path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(log_path);
+		return -1;
+	}
+	if (ioctl(fd, LOGGER_SET_VERSION, &version) ||
+	    ioctl(fd, LOGGER_SET_BATCH_READ, &batch)) {
+		perror("ioctl");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* read everything there is, calling check() on every entry if set */
+static long drain(int fd, char *buf, size_t size,
+		  int (*check)(struct entry *e))
+{
+	struct entry *e;
+	long lines = 0;
+	ssize_t ret, off;
+
+	while ((ret = read(fd, buf, size)) > 0) {
+		for (off = 0; off < ret; off += e->hdr_size + e->len) {
+			e = (struct entry *)(buf + off);
+			if (e->hdr_size != offsetof(struct entry, msg) ||
+			    off + e->hdr_size + e->len > ret) {
+				fprintf(stderr, "bad entry in batch\n");
+				return -1;
+			}
+			if (check && check(e))
+				return -1;
+			lines++;
+		}
+	}
+	if (errno != EAGAIN) {
+		perror("read");
+		return -1;
+	}
+	return lines;
+}
+
+static int run_read_bench(int rfd)
+{
+	struct writer *w = &writers[0];
+	double rate[2], start, elapsed;
+	long lines, total;
+	char *buf;
+	int size, batch, fd;
+
+	size = ioctl(rfd, LOGGER_GET_LOG_BUF_SIZE);
+	buf = malloc(BATCH_SIZE);
+	if (size <= 0 || !buf)
+		return 1;
+
+	/* lines average about MAX_MSG / 2 bytes, write the log over twice */
+	memset(writers, 0, sizeof(writers));
+	w->limit = 4UL * size / MAX_MSG;
+	nr_writers = 1;
+	stop = 0;
+	writer_thread(w);
+	if (w->err) {
+		fprintf(stderr, "writer: %s\n", strerror(w->err));
+		return 1;
+	}
+
+	for (batch = 0; batch < 2; batch++) {
+		total = 0;
+		start = now();
+		do {
+			fd = open_reader(batch);
+			if (fd < 0)
+				return 1;
+			lines = drain(fd, buf, batch ? BATCH_SIZE :
+				      sizeof(struct entry), NULL);
+			close(fd);
+			if (lines < 0)
+				return 1;
+			total += lines;
+			elapsed = now() - start;
+		} while (elapsed < duration);
+		rate[batch] = total / elapsed;
+	}
+
+	printf("read: %.0f lines/s one per read(), %.0f lines/s batched\n",
+	       rate[0], rate[1]);
+	free(buf);
+	return 0;
+}
+
+/* poll() must not return before the threshold's worth was logged */
+static int run_threshold_test(void)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	int threshold = POLL_THRESHOLD;
+	struct writer *w = &writers[0];
+	pthread_t thread;
+	char *buf;
+	int len, ret = 0;
+
+	buf = malloc(BATCH_SIZE);
+	pfd.fd = open_reader(1);
+	if (pfd.fd < 0 || !buf)
+		return 1;
+	if (drain(pfd.fd, buf, BATCH_SIZE, NULL) < 0 ||
+	    ioctl(pfd.fd, LOGGER_SET_POLL_THRESHOLD, &threshold)) {
+		perror("LOGGER_SET_POLL_THRESHOLD");
+		return 1;
+	}
+
+	memset(writers, 0, sizeof(writers));
+	w->limit = 4 * POLL_THRESHOLD / MAX_MSG;
+	stop = 0;
+	pthread_create(&thread, NULL, writer_thread, w);
+	if (poll(&pfd, 1, 5000) != 1) {
+		fprintf(stderr, "poll threshold: no wakeup\n");
+		ret = 1;
+	} else {
+		len = ioctl(pfd.fd, LOGGER_GET_LOG_LEN);
+		if (len < POLL_THRESHOLD) {
+			fprintf(stderr, "poll threshold: woken at %d bytes\n",
+				len);
+			ret = 1;
+		}
+	}
+	pthread_join(thread, NULL);
+
+	close(pfd.fd);
+	free(buf);
+	printf("poll threshold: %s\n", ret ? "failed" : "ok");
+	return ret;
+}
+
+static int check_euid(struct entry *e)
+{
+	if (e->euid == geteuid())
+		return 0;
+	fprintf(stderr, "uid filter: got an entry of uid %u\n", e->euid);
+	return 1;
+}
+
+static int run_uid_filter_test(void)
+{
+	int uid = geteuid();
+	char *buf;
+	long lines;
+	int fd;
+
+	buf = malloc(BATCH_SIZE);
+	fd = open_reader(1);
+	if (fd < 0 || !buf)
+		return 1;
+	if (ioctl(fd, LOGGER_SET_UID_FILTER, &uid)) {
+		perror("LOGGER_SET_UID_FILTER");
+		return 1;
+	}
+	lines = drain(fd, buf, BATCH_SIZE, check_euid);
+	close(fd);
+	free(buf);
+	if (lines < 0)
+		return 1;
+	printf("uid filter: %ld entries of uid %d\n", lines, uid);
+	return !lines;
+}
+
+static void *delayed_writer_thread(void *arg)
+{
+	/* give poll() time to go to sleep */
+	usleep(200 * 1000);
+	return writer_thread(arg);
+}
+
+/* lines of another uid must not leave a filtered reader unarmed */
+static int run_filtered_threshold_test(void)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	int threshold = POLL_THRESHOLD;
+	struct writer *w = &writers[0];
+	int uid = geteuid();
+	pthread_t thread;
+	int status, ret = 0;
+	char *buf;
+	pid_t pid;
+
+	if (uid != 0) {
+		printf("filtered poll threshold: skipped, needs root\n");
+		return 0;
+	}
+	buf = malloc(BATCH_SIZE);
+	pfd.fd = open_reader(1);
+	if (pfd.fd < 0 || !buf)
+		return 1;
+	if (drain(pfd.fd, buf, BATCH_SIZE, NULL) < 0 ||
+	    ioctl(pfd.fd, LOGGER_SET_UID_FILTER, &uid) ||
+	    ioctl(pfd.fd, LOGGER_SET_POLL_THRESHOLD, &threshold)) {
+		perror("ioctl");
+		return 1;
+	}
+
+	/* more than the threshold, none of which the reader gets to see */
+	memset(writers, 0, sizeof(writers));
+	w->limit = 4 * POLL_THRESHOLD / MAX_MSG;
+	stop = 0;
+	pid = fork();
+	if (pid == 0) {
+		if (setuid(OTHER_UID))
+			_exit(2);
+		writer_thread(w);
+		_exit(w->err ? 1 : 0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "filtered poll threshold: writer failed\n");
+		close(pfd.fd);
+		free(buf);
+		return 1;
+	}
+
+	w->lines = 0;
+	pthread_create(&thread, NULL, delayed_writer_thread, w);
+	if (poll(&pfd, 1, 5000) != 1) {
+		fprintf(stderr, "filtered poll threshold: no wakeup\n");
+		ret = 1;
+	} else if (drain(pfd.fd, buf, BATCH_SIZE, check_euid) <= 0) {
+		fprintf(stderr, "filtered poll threshold: nothing to read\n");
+		ret = 1;
+	}
+	pthread_join(thread, NULL);
+
+	close(pfd.fd);
+	free(buf);
+	printf("filtered poll threshold: %s\n", ret ? "failed" : "ok");
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int version = 2;
+	struct entry e;
+	int opt, i, rfd;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:l:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'l':
+			log_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-l log]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	rfd = open(log_path, O_RDONLY | O_NONBLOCK);
+	if (rfd < 0) {
+		printf("skip all tests: %s: %s\n", log_path, strerror(errno));
+		return 0;
+	}
+	if (ioctl(rfd, LOGGER_SET_VERSION, &version)) {
+		perror("LOGGER_SET_VERSION");
+		return 1;
+	}
+
+	for (i = 1; i <= MAX_THREADS; i *= 2) {
+		/* skip what other processes logged before this step */
+		while (read(rfd, &e, sizeof(e)) > 0)
+			;
+		ret |= run_bench(i, rfd);
+	}
+	ret |= run_read_bench(rfd);
+	close(rfd);
+	ret |= run_threshold_test();
+	ret |= run_uid_filter_test();
+	ret |= run_filtered_threshold_test();
+
+	printf("logger_bench: %s\n", ret ? "[FAIL]" : "[PASS]");
+	return ret;
+}
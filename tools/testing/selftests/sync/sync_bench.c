@@ -0,0 +1,277 @@
+/*
+ * sync framework signaling benchmark
+ *
+ * Creates fences on a sw_sync timeline for values 1..N in a shuffled
+ * order, then advances the timeline one step at a time and checks that
+ * exactly the fences up to the timeline value have signaled after each
+ * step, whatever order their pts were activated in.
+ *
+ * Then a waiter thread blocks in SYNC_IOC_WAIT on the next value while
+ * the main thread advances the timeline to it, in lockstep, and the number
+ * of round trips per second and the average signal to wakeup time are
+ * reported, with 0 and with hundreds of later pts pending on the timeline.
+ *
+ * Needs CONFIG_SW_SYNC_USER; without /dev/sw_sync all tests are skipped.
+ *
+ * usage: sync_bench [-t seconds] [-n fences]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PENDING		512
+
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_MAGIC	'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0,\
+		struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC		_IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+#define SYNC_IOC_MAGIC		'>'
+#define SYNC_IOC_WAIT		_IOW(SYNC_IOC_MAGIC, 0, int32_t)
+
+static int duration = 2;
+static int nr_fences = 256;
+
+static volatile int stop;
+static volatile uint32_t wait_value;
+static volatile double inc_time;
+static double wake_total;
+static unsigned long round_trips;
+static int timeline;
+static int waiter_err;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int create_fence(int tl, uint32_t value)
+{
+	struct sw_sync_create_fence_data data = { .value = value };
+
+	snprintf(data.name, sizeof(data.name), "bench%u", value);
+	if (ioctl(tl, SW_SYNC_IOC_CREATE_FENCE, &data) < 0)
+		return -1;
+	return data.fence;
+}
+
+static int inc_timeline(int tl, uint32_t inc)
+{
+	return ioctl(tl, SW_SYNC_IOC_INC, &inc);
+}
+
+static int fence_signaled(int fence)
+{
+	struct pollfd pfd = { .fd = fence, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static int run_order_test(void)
+{
+	int *fences, *order;
+	int i, j, tmp, tl;
+	int ret = 0;
+
+	tl = open("/dev/sw_sync", O_RDWR);
+	fences = calloc(nr_fences + 1, sizeof(*fences));
+	order = calloc(nr_fences, sizeof(*order));
+	if (tl < 0 || !fences || !order) {
+		perror("order test");
+		return 1;
+	}
+
+	for (i = 0; i < nr_fences; i++)
+		order[i] = i + 1;
+	srand(1);
+	for (i = nr_fences - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < nr_fences; i++) {
+		fences[order[i]] = create_fence(tl, order[i]);
+		if (fences[order[i]] < 0) {
+			perror("SW_SYNC_IOC_CREATE_FENCE");
+			ret = 1;
+			goto out;
+		}
+	}
+
+	for (i = 1; i <= nr_fences && !ret; i++) {
+		if (inc_timeline(tl, 1) < 0) {
+			perror("SW_SYNC_IOC_INC");
+			ret = 1;
+			break;
+		}
+		for (j = 1; j <= nr_fences; j++) {
+			if (fence_signaled(fences[j]) != (j <= i)) {
+				fprintf(stderr, "value %d: fence %d %s\n", i, j,
+					j <= i ? "not signaled" :
+					"signaled early");
+				ret = 1;
+				break;
+			}
+		}
+	}
+	printf("order test: %d fences, %s\n", nr_fences,
+	       ret ? "[FAIL]" : "[PASS]");
+out:
+	for (i = 1; i <= nr_fences; i++)
+		if (fences[i] > 0)
+			close(fences[i]);
+	free(order);
+	free(fences);
+	close(tl);
+	return ret;
+}
+
+static void *waiter_thread(void *arg)
+{
+	int32_t timeout = 1000;
+	uint32_t value;
+	int fence;
+
+	for (value = 1; !stop; value++) {
+		fence = create_fence(timeline, value);
+		if (fence < 0) {
+			waiter_err = errno;
+			break;
+		}
+		wait_value = value;
+		if (ioctl(fence, SYNC_IOC_WAIT, &timeout) < 0) {
+			waiter_err = errno;
+			close(fence);
+			break;
+		}
+		if (!stop) {
+			wake_total += now() - inc_time;
+			round_trips++;
+		}
+		close(fence);
+	}
+	wait_value = 0;
+	return NULL;
+}
+
+static int run_wake_bench(int pending)
+{
+	int fences[MAX_PENDING];
+	pthread_t waiter;
+	double start, elapsed;
+	uint32_t value;
+	int i;
+
+	timeline = open("/dev/sw_sync", O_RDWR);
+	if (timeline < 0) {
+		perror("/dev/sw_sync");
+		return 1;
+	}
+	/* pts far in the future that every signal used to walk past */
+	for (i = 0; i < pending; i++) {
+		fences[i] = create_fence(timeline, 0x40000000 + i);
+		if (fences[i] < 0) {
+			perror("SW_SYNC_IOC_CREATE_FENCE");
+			return 1;
+		}
+	}
+
+	stop = 0;
+	wait_value = 0;
+	wake_total = 0;
+	round_trips = 0;
+	waiter_err = 0;
+	if (pthread_create(&waiter, NULL, waiter_thread, NULL)) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 1;
+	}
+
+	start = now();
+	for (value = 1; now() - start < duration && !waiter_err; value++) {
+		while (wait_value != value && !waiter_err)
+			;
+		/* let the waiter get to sleep, or spin, in the kernel */
+		usleep(50);
+		inc_time = now();
+		if (inc_timeline(timeline, 1) < 0) {
+			perror("SW_SYNC_IOC_INC");
+			break;
+		}
+	}
+	stop = 1;
+	inc_timeline(timeline, 1);
+	pthread_join(waiter, NULL);
+	elapsed = now() - start;
+
+	for (i = 0; i < pending; i++)
+		close(fences[i]);
+	close(timeline);
+
+	if (waiter_err) {
+		fprintf(stderr, "SYNC_IOC_WAIT: %s\n", strerror(waiter_err));
+		return 1;
+	}
+	printf("%d pending pts: %lu round trips/s, %.1fus signal to wakeup\n",
+	       pending, (unsigned long)(round_trips / elapsed),
+	       round_trips ? wake_total / round_trips * 1e6 : 0);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, fd;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'n':
+			nr_fences = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-n fences]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || nr_fences < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	fd = open("/dev/sw_sync", O_RDWR);
+	if (fd < 0) {
+		printf("skip all tests: /dev/sw_sync: %s\n", strerror(errno));
+		return 0;
+	}
+	close(fd);
+
+	ret |= run_order_test();
+	ret |= run_wake_bench(0);
+	ret |= run_wake_bench(MAX_PENDING);
+
+	printf("sync_bench: %s\n", ret ? "[FAIL]" : "[PASS]");
+	return ret;
+}
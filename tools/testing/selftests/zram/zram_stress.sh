@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# zram write scalability test: configure a zram device, then write to
+# disjoint regions of it from 1, 2, 4 and 8 concurrent writers and
+# report the aggregate throughput for each step. With multiple
+# compression streams the throughput should grow with the number of
+# writers up to the number of CPUs.
+#
+# usage: zram_stress.sh [size_mb_per_writer]
+
+DEV=zram0
+SYSFS=/sys/block/$DEV
+MB=${1:-64}
+MAX_WRITERS=8
+DATA=
+
+prerequisite()
+{
+	msg="skip all tests:"
+
+	if [ $UID != 0 ]; then
+		echo $msg must be run as root >&2
+		exit 0
+	fi
+
+	if [ ! -d $SYSFS ]; then
+		modprobe zram > /dev/null 2>&1
+	fi
+
+	if [ ! -d $SYSFS ]; then
+		echo $msg zram is not available >&2
+		exit 0
+	fi
+
+	if [ "`cat $SYSFS/initstate`" != 0 ]; then
+		echo $msg /dev/$DEV is already in use >&2
+		exit 0
+	fi
+}
+
+cleanup()
+{
+	echo 1 > $SYSFS/reset
+	rm -f $DATA
+}
+
+now_ms()
+{
+	echo $((`date +%s%N` / 1000000))
+}
+
+# roughly 2:1 compressible input, similar to anonymous memory
+make_data()
+{
+	DATA=`mktemp`
+	head -c $((MB * 1024 * 1024 / 2)) /dev/urandom | od -An -x | \
+		head -c $((MB * 1024 * 1024)) > $DATA
+}
+
+run_writers()
+{
+	local n=$1 i start end
+
+	start=`now_ms`
+	for i in `seq 0 $((n - 1))`; do
+		dd if=$DATA of=/dev/$DEV bs=1M count=$MB seek=$((i * MB)) \
+			oflag=direct conv=notrunc > /dev/null 2>&1 &
+	done
+	wait
+	end=`now_ms`
+
+	[ $end -gt $start ] || end=$((start + 1))
+	echo "writers: $n  throughput: $((n * MB * 1000 / (end - start))) MB/s"
+}
+
+prerequisite
+trap cleanup EXIT
+
+echo $MAX_WRITERS > $SYSFS/max_comp_streams || exit 1
+echo $((MB * MAX_WRITERS))M > $SYSFS/disksize || exit 1
+make_data
+
+for n in 1 2 4 8; do
+	run_writers $n
+done
+
+echo "streams: `cat $SYSFS/max_comp_streams`"
+echo "compr_data_size: `cat $SYSFS/compr_data_size`"
+echo "orig_data_size: `cat $SYSFS/orig_data_size`"